@@ -0,0 +1,88 @@
+#!/bin/sh
+# Crash recovery check. A --batch run is stopped in the middle of a checkpoint with
+# --crash-checkpoint, and the state recovered at the next start (the records and
+# garbage lists printed by ut-m and ut-s) must equal that of an uninterrupted run of
+# the lines the checkpoint covers.
+#
+# The batch has three parts: A, logged operations on a few hundred buyers; B, a run
+# of 5000 insert-s lines, loaded in bulk between two checkpoints; C, more logged
+# operations. The checkpoints with pages to write are the one before B, the one
+# after B and the one at exit, and each is stopped at both stages:
+#   checkpoint  stage   recovered state
+#   1           log     A          (the operations are replayed from the log)
+#   1           pages   A          (the logged page images are applied again)
+#   2           log     A          (the bulk load is not logged)
+#   2           pages   A + B
+#   3           log     A + B + C
+#   3           pages   A + B + C
+#
+# Usage: checks/recovery.sh <binary> [options for every run, e.g. --mmap or --compress]
+set -eu
+[ $# -ge 1 ] || { echo "Usage: $0 <binary> [options]" >&2; exit 2; }
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+opts="$*"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# The lines of part A, B or C. A and C end and start with a lookup, so that their
+# inserts are not queued into the bulk run of B.
+part() {
+    awk -v part="$1" 'BEGIN {
+        if (part == "B") {
+            for (i = 0; i < 5000; i++)
+                printf "insert-s,%d,%d,bulk,author,%d\n", i % 300, 100000 + i, 1 + i % 90
+            exit
+        }
+        srand(part == "A" ? 1 : 3)
+        if (part == "C")
+            print "get-m,0"
+        for (i = 0; i < 3000; i++) {
+            p = int(rand() * 300); isbn = int(rand() * 40); r = rand()
+            if (r < 0.15)      printf "insert-m,%d,name%d,address\n", p, i
+            else if (r < 0.55) printf "insert-s,%d,%d,title,author,%d\n", p, isbn, 1 + int(rand() * 99)
+            else if (r < 0.7)  printf "del-s,%d,%d\n", p, isbn
+            else if (r < 0.75) printf "del-m,%d\n", p
+            else if (r < 0.9)  printf "update-s,%d,%d,3,%d\n", p, isbn, 1 + int(rand() * 99)
+            else               printf "update-m,%d,1,name%d\n", p, i
+        }
+        if (part == "A")
+            print "get-m,0"
+    }'
+}
+
+dump() {
+    (cd "$1" && printf 'ut-m\nut-s\nexit\n' | "$bin" $opts 2>"$1/restart.err")
+}
+
+# Reference states of uninterrupted runs
+for parts in A AB ABC; do
+    mkdir "$work/$parts"
+    for p in $(echo "$parts" | sed 's/./& /g'); do
+        part "$p"
+    done > "$work/$parts/batch.txt"
+    (cd "$work/$parts" && "$bin" $opts --batch batch.txt > /dev/null) || fail "reference run $parts"
+    dump "$work/$parts" > "$work/$parts.state"
+done
+
+for case in "1 log A" "1 pages A" "2 log A" "2 pages AB" "3 log ABC" "3 pages ABC"; do
+    set -- $case
+    dir="$work/crash-$1-$2"
+    mkdir "$dir"
+    cp "$work/ABC/batch.txt" "$dir/"
+    status=0
+    (cd "$dir" && "$bin" $opts --crash-checkpoint "$1" "$2" --batch batch.txt > /dev/null 2>&1) || status=$?
+    [ "$status" -eq 3 ] || fail "checkpoint $1, $2: the run was not stopped (status $status)"
+    dump "$dir" > "$dir.state"
+    if [ "$2" = pages ]; then
+        grep -q "interrupted checkpoint" "$dir/restart.err" || fail "checkpoint $1, $2: the log was not applied"
+    fi
+    cmp -s "$dir.state" "$work/$3.state" || fail "checkpoint $1, $2: recovered state differs from $3"
+    echo "checkpoint $1, $2: recovered $3"
+done
+echo "Recovery check passed${opts:+ ($opts)}."
@@ -3,19 +3,57 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <climits>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <ctime>
+#include <cmath>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 // File names (binary files with fixed-length records)
 const char* MASTER_FILE = "B.fl";             // Master file (buyers)
 const char* SLAVE_FILE  = "BK.fl";            // Slave file (books)
 const char* INDEX_FILE  = "B.ind";            // Index table for B.fl
-const char* MASTER_GARBAGE_FILE = "B.garbage";  // Garbage zone for master file
-const char* SLAVE_GARBAGE_FILE  = "BK.garbage";  // Garbage zone for slave file
+const char* BOOK_INDEX_FILE = "BK.ind";       // (phone, ISBN) index for BK.fl
+const char* ISBN_INDEX_FILE = "BK.isbn";      // (ISBN, phone) index for BK.fl
+const char* BOOK_FILTER_FILE = "BK.bloom";    // Bloom filter over the BK.ind keys, saved on exit
+const char* CHECKPOINT_FILE = "B.ckpt";       // Stamp of the last checkpoint
+const char* MASTER_GARBAGE_FILE = "B.free";    // Garbage zone bitmap for master file
+const char* SLAVE_GARBAGE_FILE  = "BK.free";    // Garbage zone bitmap for slave file
+const char* MASTER_GARBAGE_LIST = "B.garbage";  // Garbage zone list of older versions, converted on start
+const char* SLAVE_GARBAGE_LIST  = "BK.garbage";
+const char* SLAVE_DIRECTORY_FILE = "BK.dir";  // Block directory of a compressed BK.fl
+const char* WAL_FILE = "B.wal";               // Write-ahead log
+const char* WAL_TEMP_FILE = "B.wal.tmp";     // New log being written by a checkpoint
+const char* SHARDS_FILE = "B.shards";         // Layout of a sharded database (see SHARDING)
+const char* CHECK_TREE_FILE = "B.check";      // Scratch tree of --self-check
 
 // Structure for a buyer (master record)
 // Fields:
 //  phone (key), name, address,
 //  firstBook (record number in BK.fl for first book, -1 if none),
 //  bookCount (number of books),
+//  firstExtent, extentCount (the buyer's current run of BK.fl records, see --extents),
 //  valid (1 - record exists, 0 - logically deleted)
 struct Buyer {
     int phone;
@@ -23,6 +61,8 @@ struct Buyer {
     char address[31];
     int firstBook;   // Number of the first book record in BK.fl (-1 if none)
     int bookCount;
+    int firstExtent; // First record of the current extent in BK.fl (-1 if none)
+    int extentCount; // Records in that extent
     int valid;       // 1 = exists, 0 = deleted
 };
 
@@ -47,717 +87,7601 @@ struct IndexRecord {
     int recordNumber;  // Record number in B.fl
 };
 
-std::vector<IndexRecord> indexTable;
-std::vector<int> masterGarbage; // Record numbers of logically deleted Buyer records in B.fl
-std::vector<int> slaveGarbage;  // Record numbers of logically deleted Book records in BK.fl
+// Garbage zone of a file: one bit per record, set while the record is logically
+// deleted and free for reuse (see INDEX AND GARBAGE HANDLING)
+struct GarbageMap {
+    const char* fileName;
+    std::vector<uint64_t> words;    // Bit r % 64 of words[r / 64] is record r
+    std::vector<uint64_t> summary;  // Bit w % 64 of summary[w / 64] is set if words[w] != 0
+    std::vector<char> dirtyBlocks;  // Blocks of words changed since the last checkpoint
+    size_t firstSummary;            // No summary bit is set before this word
+    int count;                      // Free records
+};
+
+GarbageMap masterGarbage = {MASTER_GARBAGE_FILE, {}, {}, {}, 0, 0}; // Logically deleted Buyer records in B.fl
+GarbageMap slaveGarbage = {SLAVE_GARBAGE_FILE, {}, {}, {}, 0, 0};   // Logically deleted Book records in BK.fl
+
+// ===================== LATCHES =====================
+// The engine is thread-safe (build with -pthread). Every operation holds engineLatch
+// shared; checkpoints, bulk loads and the full-file commands hold it exclusively, so
+// they see no other activity (the reports read a snapshot instead, see SNAPSHOTS).
+// Inside an operation:
+//   - mutations lock the chain latch of their buyer, so all changes to one buyer and
+//     its book chain are serialized while different buyers proceed in parallel;
+//   - each index has a reader-writer latch (lookups share it, updates are exclusive);
+//   - each file of the buffer pool has a reader-writer latch: page hits and reads of
+//     a mapping share it, misses, writes and appends are exclusive;
+//   - the garbage lists, the log and the record cache have a mutex each.
+// The I/O threads that prefetch pages hold engineLatch shared and take the file latch.
+// Latches are taken in that order and the last three are never held together, except
+// that a tree latch is held while its file latch is taken. snapshotLatch comes last.
+typedef std::shared_lock<std::shared_mutex> SharedLatch;
+typedef std::unique_lock<std::shared_mutex> ExclusiveLatch;
+
+const int CHAIN_LATCHES = 1024;    // Chain latches, shared by phones with the same hash
+
+std::shared_mutex engineLatch;
+std::mutex chainLatches[CHAIN_LATCHES];
+std::mutex garbageLatch;
+
+std::mutex &chainLatch(int phone) {
+    return chainLatches[(unsigned int)phone % CHAIN_LATCHES];
+}
+
+// ===================== STATISTICS =====================
+// Every operation, report and bulk step is timed by an OpTimer, which adds its
+// latency and what its thread did meanwhile to the stats of its kind. The work is
+// tallied per thread in ioTally without atomics: records of B.fl/BK.fl read and
+// written, bytes read and written (data files, indexes and log), seeks (reads or
+// writes that do not continue where the last one on that file ended), index probes
+// and the nodes they visited, and book chain hops. Workers of parallel scans hand
+// their tally to the thread that started them; the I/O threads' prefetches are only
+// seen in the per-file counters. The stats command prints the totals, stats-json
+// prints them as one JSON object, and --stats-interval <s> appends that object to
+// B.stats every s seconds (and on exit), with the text in B.stats.txt.
+const char* STATS_FILE = "B.stats";
+const char* STATS_TEXT_FILE = "B.stats.txt";
+
+// Histogram of non-negative values (latencies in nanoseconds, chain hops):
+// HISTOGRAM_SUB_BUCKETS linear buckets per power of two, so a percentile is within
+// about 6% of the real value. Updates are relaxed atomic increments.
+const int HISTOGRAM_SUB_BUCKETS = 16;
+const int HISTOGRAM_BUCKETS = 40 * HISTOGRAM_SUB_BUCKETS;
+
+struct Histogram {
+    std::atomic<long long> counts[HISTOGRAM_BUCKETS];
+    std::atomic<long long> total;
+    std::atomic<long long> max;
+};
+
+int histogramBucket(long long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int)std::max(0LL, value);
+    int shift = 63 - __builtin_clzll(value) - 4;
+    int index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return std::min(index, HISTOGRAM_BUCKETS - 1);
+}
+
+// Largest value of bucket index.
+long long histogramBucketEnd(int index) {
+    index++;
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index - 1;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return ((long long)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift) - 1;
+}
+
+void resetHistogram(Histogram &h) {
+    for (auto &count : h.counts)
+        count.store(0, std::memory_order_relaxed);
+    h.total.store(0, std::memory_order_relaxed);
+    h.max.store(0, std::memory_order_relaxed);
+}
+
+void histogramAdd(Histogram &h, long long value) {
+    h.counts[histogramBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    h.total.fetch_add(1, std::memory_order_relaxed);
+    long long seen = h.max.load(std::memory_order_relaxed);
+    while (value > seen && !h.max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+// Value below which the fraction q of the samples fall (the end of its bucket, but
+// no more than the largest sample).
+long long histogramPercentile(const Histogram &h, double q) {
+    long long total = h.total.load(std::memory_order_relaxed);
+    long long rank = std::max(1LL, (long long)std::ceil(q * total));
+    long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h.counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(histogramBucketEnd(i), h.max.load(std::memory_order_relaxed));
+    }
+    return 0;
+}
+
+// Work done by one thread (see above)
+struct IoTally {
+    long long recordsRead;
+    long long recordsWritten;
+    long long bytesRead;
+    long long bytesWritten;
+    long long seeks;
+    long long indexProbes;
+    long long indexNodes;
+    long long chainHops;
+};
+
+thread_local IoTally ioTally = {0, 0, 0, 0, 0, 0, 0, 0};
+
+enum StatOp {
+    STAT_GET_M, STAT_GET_S, STAT_GET_ISBN, STAT_DEL_M, STAT_DEL_S, STAT_UPDATE_M, STAT_UPDATE_S,
+    STAT_DEL_M_RANGE, STAT_DEL_S_WHERE, STAT_UPDATE_S_WHERE, STAT_INSERT_M, STAT_INSERT_S, STAT_BULK_LOAD, STAT_RANGE_M, STAT_BOOKS_M, STAT_RANGE_PRICE, STAT_JOIN,
+    STAT_CALC_M, STAT_CALC_S, STAT_UT_M, STAT_UT_S, STAT_VACUUM, STAT_CHECKPOINT, STAT_LOAD, STAT_SAVE, STAT_OPS
+};
+
+const char* STAT_NAMES[STAT_OPS] = {
+    "get-m", "get-s", "get-isbn", "del-m", "del-s", "update-m", "update-s",
+    "del-m-range", "del-s-where", "update-s-where", "insert-m", "insert-s", "bulk-load", "range-m", "books-m", "range-price", "join",
+    "calc-m", "calc-s", "ut-m", "ut-s", "vacuum", "checkpoint", "load", "save"
+};
+
+struct OpStats {
+    std::atomic<long long> recordsRead;
+    std::atomic<long long> recordsWritten;
+    std::atomic<long long> bytesRead;
+    std::atomic<long long> bytesWritten;
+    std::atomic<long long> seeks;
+    std::atomic<long long> indexProbes;
+    std::atomic<long long> indexNodes;
+    Histogram latency;    // Nanoseconds
+    Histogram chainHops;  // Per operation, for the ones that walk chains
+};
+
+OpStats opStats[STAT_OPS];
+
+void addTally(IoTally &into, const IoTally &from) {
+    into.recordsRead += from.recordsRead;
+    into.recordsWritten += from.recordsWritten;
+    into.bytesRead += from.bytesRead;
+    into.bytesWritten += from.bytesWritten;
+    into.seeks += from.seeks;
+    into.indexProbes += from.indexProbes;
+    into.indexNodes += from.indexNodes;
+    into.chainHops += from.chainHops;
+}
+
+// Times one operation and adds what its thread did meanwhile to the stats of its kind.
+struct OpTimer {
+    StatOp op;
+    IoTally start;
+    std::chrono::steady_clock::time_point began;
+
+    explicit OpTimer(StatOp kind) : op(kind), start(ioTally), began(std::chrono::steady_clock::now()) {}
+
+    ~OpTimer() {
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - began;
+        OpStats &s = opStats[op];
+        const IoTally &now = ioTally;
+        s.recordsRead.fetch_add(now.recordsRead - start.recordsRead, std::memory_order_relaxed);
+        s.recordsWritten.fetch_add(now.recordsWritten - start.recordsWritten, std::memory_order_relaxed);
+        s.bytesRead.fetch_add(now.bytesRead - start.bytesRead, std::memory_order_relaxed);
+        s.bytesWritten.fetch_add(now.bytesWritten - start.bytesWritten, std::memory_order_relaxed);
+        s.seeks.fetch_add(now.seeks - start.seeks, std::memory_order_relaxed);
+        s.indexProbes.fetch_add(now.indexProbes - start.indexProbes, std::memory_order_relaxed);
+        s.indexNodes.fetch_add(now.indexNodes - start.indexNodes, std::memory_order_relaxed);
+        histogramAdd(s.latency, elapsed.count());
+        if (op == STAT_GET_S || op == STAT_DEL_S || op == STAT_DEL_M)
+            histogramAdd(s.chainHops, now.chainHops - start.chainHops);
+    }
+};
+
+// ===================== BLOCK COMPRESSION =====================
+// A small LZ codec in the LZ4 block format, used for the pages of a compressed BK.fl
+// (--compress). A block is a series of sequences: a token (literal count in the high
+// nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning "more bytes follow"),
+// the literals, then a 2-byte offset back into the output and the match. The last
+// sequence has literals only. Records compress well: most of their bytes are the
+// zero padding of the name and author fields.
+const int LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 12;
+const int LZ_MAX_OFFSET = 65535;
+
+// Append one sequence (a final one if matchLength is 0). False if it does not fit.
+bool lzSequence(unsigned char* out, int &o, int capacity, const unsigned char* literals, int literalCount,
+                int offset, int matchLength) {
+    if (o + 2 + literalCount / 255 + literalCount + 3 + matchLength / 255 > capacity)
+        return false;
+    int extra = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    out[o++] = (unsigned char)(std::min(literalCount, 15) << 4 | std::min(extra, 15));
+    if (literalCount >= 15) {
+        int n = literalCount - 15;
+        for (; n >= 255; n -= 255)
+            out[o++] = 255;
+        out[o++] = (unsigned char)n;
+    }
+    memcpy(out + o, literals, literalCount);
+    o += literalCount;
+    if (matchLength == 0)
+        return true;
+    out[o++] = (unsigned char)(offset & 255);
+    out[o++] = (unsigned char)(offset >> 8);
+    if (extra >= 15) {
+        int n = extra - 15;
+        for (; n >= 255; n -= 255)
+            out[o++] = 255;
+        out[o++] = (unsigned char)n;
+    }
+    return true;
+}
+
+// Compress size bytes of src into dst. Returns the compressed length, or 0 if it
+// would not fit in capacity bytes (the block is then stored as is).
+int compressBlock(const char* src, int size, char* dst, int capacity) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    unsigned char* out = reinterpret_cast<unsigned char*>(dst);
+    int table[1 << LZ_HASH_BITS];
+    std::fill(table, table + (1 << LZ_HASH_BITS), -1);
+    int pos = 0, anchor = 0, o = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t word;
+        memcpy(&word, in + pos, sizeof(word));
+        uint32_t hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = pos;
+        if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        int length = LZ_MIN_MATCH;
+        while (pos + length < size && in[candidate + length] == in[pos + length])
+            length++;
+        if (!lzSequence(out, o, capacity, in + anchor, pos - anchor, pos - candidate, length))
+            return 0;
+        pos += length;
+        anchor = pos;
+    }
+    if (!lzSequence(out, o, capacity, in + anchor, size - anchor, 0, 0))
+        return 0;
+    return o;
+}
+
+// Decompress a block into exactly size bytes of dst. False if the block is damaged.
+bool decompressBlock(const char* src, int srcSize, char* dst, int size) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = in + srcSize;
+    int o = 0;
+    auto readLength = [&](int n) {
+        if (n < 15)
+            return n;
+        for (unsigned char b = 255; b == 255 && in < end; n += b)
+            b = *in++;
+        return n;
+    };
+    while (in < end) {
+        int token = *in++;
+        int literals = readLength(token >> 4);
+        if (literals > end - in || literals > size - o)
+            return false;
+        memcpy(dst + o, in, literals);
+        in += literals;
+        o += literals;
+        if (in == end)
+            break;
+        if (end - in < 2)
+            return false;
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        int length = readLength(token & 15) + LZ_MIN_MATCH;
+        if (offset == 0 || offset > o || length > size - o)
+            return false;
+        if (offset >= length) {
+            memcpy(dst + o, dst + o - offset, length);
+        } else {
+            for (int i = 0; i < length; i++)
+                dst[o + i] = dst[o - offset + i];
+        }
+        o += length;
+    }
+    return o == size;
+}
+
+// ===================== BUFFER POOL =====================
+// B.fl and BK.fl are opened once for the whole process. Records are cached in
+// fixed-size pages (RECORDS_PER_PAGE consecutive records by default, so a record
+// never straddles two pages). Frames are recycled with the CLOCK policy. Dirty pages
+// are never evicted: the files only change when a checkpoint flushes them (see
+// WRITE-AHEAD LOG), so when most frames are dirty the pool grows, and once it holds
+// DIRTY_FRAME_LIMIT dirty pages a checkpoint is requested.
+const int RECORDS_PER_PAGE = 64;   // Records per cached page of B.fl/BK.fl
+const int POOL_FRAMES = 256;       // Default page frames per file
+const int DIRTY_FRAME_LIMIT = 4096; // Dirty pages per file that trigger a checkpoint
+const int MAP_EXTENT_RECORDS = 65536; // Records added to a mapping each time it grows
+
+// B.fl and BK.fl start with a header of FILE_HEADER_BYTES (one memory page, so the
+// records can still be mapped from there on): magic, format version, record size and
+// the record count as of the last flush. The count is informational; the file size
+// decides, since recovery may have changed the file after the header was written.
+// Files of older versions have no header and are migrated by --convert.
+const int FILE_MAGIC = 0x4c464b42;    // "BKFL"
+const int FILE_VERSION = 2;           // 1 (implicit): headerless files, see CONVERSION
+const int FILE_HEADER_BYTES = 4096;
+const int FILE_COMPRESSED = 1;        // Header flag: pages are stored as compressed blocks
+
+struct FileHeader {
+    int magic;
+    int version;
+    int recordSize;
+    int recordCount;
+    int flags;
+};
+
+// A compressed file (--compress, BK.fl only) stores each page as one block of
+// BLOCK_SECTOR-aligned bytes after the header, compressed if that makes it smaller.
+// The block directory (BK.dir) tells where each page is, so reading a record is a
+// directory lookup and one decompression; the pool then caches the page as usual.
+// A flush writes the changed pages to sectors no block of the current directory uses
+// and then replaces the directory (written to a new file and renamed), so a crash
+// leaves the old directory with all its blocks intact. The pages of the log are
+// applied through the pool after such a file is opened (see recoverFiles).
+const int BLOCK_SECTOR = 512;
+
+struct BlockRef {
+    long long offset;   // Byte offset of the block in the file (0: the page was never written)
+    int length;         // Bytes stored; records * recSize means not compressed
+    int records;        // Records in the block (the rest of the page reads as zeros)
+};
+
+struct DirectoryHeader {
+    int magic;              // FILE_MAGIC
+    int version;            // FILE_VERSION
+    int recordCount;
+    int pageCount;          // BlockRef entries that follow
+    unsigned int checksum;  // Over the entries
+    int reserved;
+};
+
+bool compressSlave = false;        // A new BK.fl is created compressed (--compress)
+
+bool useMmap = false;              // Storage mode: buffer pool (default) or memory-mapped files (--mmap)
+int poolFrames = POOL_FRAMES;      // Clean page frames kept per file (--pool-frames)
+bool useExtents = false;           // Book placement: garbage zone (default) or per-buyer extents (--extents)
+std::atomic<bool> checkpointNeeded(false); // A pool reached DIRTY_FRAME_LIMIT; checkpoint after the current operation
+std::atomic<bool> filesChanged(false);     // Some file was modified since the last checkpoint
+
+struct Frame {
+    int pageNo;          // Page held by this frame (-1 if empty)
+    bool dirty;          // Page was modified and must be written back
+    std::atomic<bool> referenced;  // CLOCK reference bit (also set by readers sharing the latch)
+    std::vector<char> data;
+};
+
+// Counters used to size the pool against the working set
+struct PoolStats {
+    std::atomic<long long> hits;
+    std::atomic<long long> misses;
+    std::atomic<long long> evictions;
+    std::atomic<long long> writeBacks;
+    std::atomic<long long> prefetches;   // Pages loaded by the I/O threads
+    std::atomic<long long> bytesRead;
+    std::atomic<long long> bytesWritten;
+    std::atomic<long long> seeks;        // Reads and writes not starting where the last one ended
+    std::atomic<long long> nextOffset;   // Where the last read or write ended
+};
+
+struct RecordFile {
+    const char* fileName;
+    size_t recSize;
+    int recordsPerPage;
+    int fd;
+    int recordCount;                      // Number of records in the file (including deleted ones)
+    off_t dataOffset;                     // Bytes before record 0 (FILE_HEADER_BYTES or 0)
+    std::deque<Frame> frames;             // A deque, so frames can be added in place
+    int dirtyFrames;                      // Frames (or pages of the mapping) holding a modification
+    std::unordered_map<int, int> pageTable; // pageNo -> frame index
+    int clockHand;
+    mutable PoolStats stats;   // Also counted by reads through a const RecordFile
+    char* map;                            // Mapping of the whole file in mmap mode (nullptr otherwise)
+    int mapCapacity;                      // Records the mapping (and the file) currently has room for
+    std::vector<char> mapDirty;           // Pages of the mapping modified since the last flush
+    bool compressed;                      // Pages are stored as compressed blocks
+    const char* directoryName;            // Block directory, if the file may be compressed
+    std::vector<BlockRef> blocks;         // Compressed: where each page is stored
+    std::vector<char> sectorUsed;         // Compressed: sectors holding a block
+    std::vector<std::pair<long long, int>> releasedSectors; // Sectors freed once the directory is replaced
+    size_t sectorHand;                    // Compressed: where the next sector search starts
+    std::shared_mutex latch;
+};
+
+RecordFile masterFile;   // B.fl
+RecordFile slaveFile;    // BK.fl
+
+void addFrame(RecordFile &rf) {
+    rf.frames.emplace_back();
+    Frame &f = rf.frames.back();
+    f.pageNo = -1;
+    f.dirty = false;
+    f.referenced = false;
+    f.data.assign(rf.recordsPerPage * rf.recSize, 0);
+}
+
+// Mark a page of the mapping modified. Private copies count against DIRTY_FRAME_LIMIT
+// like dirty frames of the pool.
+void markMapDirty(RecordFile &rf, int page) {
+    if (rf.mapDirty[page])
+        return;
+    rf.mapDirty[page] = 1;
+    if (++rf.dirtyFrames >= DIRTY_FRAME_LIMIT)
+        checkpointNeeded = true;
+}
+
+// Map the file privately: changes stay in memory until flushRecordFile writes them.
+bool mapRecordFile(RecordFile &rf) {
+    size_t bytes = (size_t)rf.mapCapacity * rf.recSize;
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, rf.fd, rf.dataOffset);
+    if (p == MAP_FAILED)
+        return false;
+    rf.map = static_cast<char*>(p);
+    rf.mapDirty.assign((rf.mapCapacity + rf.recordsPerPage - 1) / rf.recordsPerPage, 0);
+    rf.dirtyFrames = 0;
+    return true;
+}
+
+bool writeFileHeader(const RecordFile &rf) {
+    FileHeader header = {FILE_MAGIC, FILE_VERSION, (int)rf.recSize, rf.recordCount, rf.compressed ? FILE_COMPRESSED : 0};
+    return pwrite(rf.fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+}
+
+// FNV-1a, continuing from sum
+unsigned int fnv1a(const void* data, size_t bytes, unsigned int sum = 2166136261u) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; i++)
+        sum = (sum ^ p[i]) * 16777619u;
+    return sum;
+}
+
+// Make the renames done in the current directory durable
+bool syncDirectory() {
+    int dir = open(".", O_RDONLY);
+    bool ok = dir >= 0 && fsync(dir) == 0;
+    if (dir >= 0)
+        close(dir);
+    return ok;
+}
+
+// Replace the block directory of a compressed file (see BlockRef). Blocks it no longer
+// refers to become free only once the new directory is durable.
+bool writeDirectory(RecordFile &rf) {
+    DirectoryHeader header = {FILE_MAGIC, FILE_VERSION, rf.recordCount, (int)rf.blocks.size(), 0, 0};
+    header.checksum = fnv1a(rf.blocks.data(), rf.blocks.size() * sizeof(BlockRef));
+    std::string tempName = std::string(rf.directoryName) + ".tmp";
+    int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t bytes = rf.blocks.size() * sizeof(BlockRef);
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              write(fd, rf.blocks.data(), bytes) == (ssize_t)bytes && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tempName.c_str(), rf.directoryName) != 0 || !syncDirectory())
+        return false;
+    for (auto &run : rf.releasedSectors)
+        std::fill(rf.sectorUsed.begin() + run.first, rf.sectorUsed.begin() + run.first + run.second, 0);
+    rf.releasedSectors.clear();
+    return true;
+}
+
+int blockSectors(int length) {
+    return (length + BLOCK_SECTOR - 1) / BLOCK_SECTOR;
+}
+
+bool loadDirectory(RecordFile &rf) {
+    std::ifstream in(rf.directoryName, std::ios::binary);
+    DirectoryHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != FILE_MAGIC ||
+        header.version != FILE_VERSION || header.pageCount < 0 || header.recordCount < 0)
+        return false;
+    rf.blocks.resize(header.pageCount);
+    if (!in.read(reinterpret_cast<char*>(rf.blocks.data()), rf.blocks.size() * sizeof(BlockRef)) ||
+        fnv1a(rf.blocks.data(), rf.blocks.size() * sizeof(BlockRef)) != header.checksum)
+        return false;
+    rf.recordCount = header.recordCount;
+    rf.sectorUsed.clear();
+    for (const BlockRef &block : rf.blocks) {
+        if (block.length == 0)
+            continue;
+        size_t first = (block.offset - rf.dataOffset) / BLOCK_SECTOR;
+        size_t end = first + blockSectors(block.length);
+        if (rf.sectorUsed.size() < end)
+            rf.sectorUsed.resize(end, 0);
+        std::fill(rf.sectorUsed.begin() + first, rf.sectorUsed.begin() + end, 1);
+    }
+    return true;
+}
+
+// Check the header of a data file, writing one if the file is new (compressed if
+// it may be and --compress was given).
+bool checkFileHeader(RecordFile &rf, off_t fileSize) {
+    if (fileSize == 0) {
+        rf.compressed = rf.directoryName && compressSlave;
+        return writeFileHeader(rf) && ftruncate(rf.fd, FILE_HEADER_BYTES) == 0 && fdatasync(rf.fd) == 0 &&
+               (!rf.compressed || writeDirectory(rf));
+    }
+    FileHeader header;
+    if (fileSize < FILE_HEADER_BYTES || pread(rf.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != FILE_MAGIC) {
+        std::cerr << rf.fileName << " was written by an older version; run with --convert first." << std::endl;
+        return false;
+    }
+    if (header.version != FILE_VERSION || header.recordSize != (int)rf.recSize) {
+        std::cerr << rf.fileName << " has format version " << header.version << " (this build reads version "
+                  << FILE_VERSION << ")." << std::endl;
+        return false;
+    }
+    rf.compressed = (header.flags & FILE_COMPRESSED) != 0;
+    if (rf.compressed && (!rf.directoryName || !loadDirectory(rf))) {
+        std::cerr << "The block directory of " << rf.fileName << " is missing or damaged." << std::endl;
+        return false;
+    }
+    if (rf.directoryName && compressSlave && !rf.compressed)
+        std::cout << rf.fileName << " is not compressed; run with --convert --compress to compress it." << std::endl;
+    return true;
+}
+
+// mappable: the file may be memory-mapped in --mmap mode (otherwise it always uses the pool).
+// withHeader: the file starts with a FileHeader (B.fl and BK.fl).
+// directoryName: the file may be stored compressed, with its block directory there.
+bool openRecordFile(RecordFile &rf, const char* fileName, size_t recSize, int recordsPerPage = RECORDS_PER_PAGE,
+                    bool mappable = true, bool withHeader = true, const char* directoryName = nullptr) {
+    rf.fileName = fileName;
+    rf.recSize = recSize;
+    rf.recordsPerPage = recordsPerPage;
+    rf.recordCount = 0;
+    rf.dataOffset = withHeader ? FILE_HEADER_BYTES : 0;
+    rf.compressed = false;
+    rf.directoryName = directoryName;
+    rf.blocks.clear();
+    rf.sectorUsed.clear();
+    rf.releasedSectors.clear();
+    rf.sectorHand = 0;
+    rf.fd = open(fileName, O_RDWR | O_CREAT, 0644);
+    if (rf.fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(rf.fd, &st) != 0)
+        return false;
+    if (withHeader && !checkFileHeader(rf, st.st_size))
+        return false;
+    if (!rf.compressed)
+        rf.recordCount = std::max((off_t)0, st.st_size - rf.dataOffset) / recSize;
+    rf.frames.clear();
+    for (int i = 0; i < poolFrames; i++)
+        addFrame(rf);
+    rf.dirtyFrames = 0;
+    rf.pageTable.clear();
+    rf.clockHand = 0;
+    rf.stats.hits = 0;
+    rf.stats.misses = 0;
+    rf.stats.evictions = 0;
+    rf.stats.writeBacks = 0;
+    rf.stats.prefetches = 0;
+    rf.stats.bytesRead = 0;
+    rf.stats.bytesWritten = 0;
+    rf.stats.seeks = 0;
+    rf.stats.nextOffset = -1;
+    rf.map = nullptr;
+    rf.mapCapacity = 0;
+    // A compressed file always goes through the pool
+    if (useMmap && mappable && !rf.compressed) {
+        // Map at least one extent; the file is trimmed back to recordCount on close.
+        rf.mapCapacity = std::max(rf.recordCount, MAP_EXTENT_RECORDS);
+        if (ftruncate(rf.fd, rf.dataOffset + (off_t)rf.mapCapacity * recSize) != 0)
+            return false;
+        return mapRecordFile(rf);
+    }
+    return true;
+}
+
+// pread and pwrite on a record file, counted in its stats and the thread's tally.
+void countIo(const RecordFile &rf, off_t offset, ssize_t done) {
+    if (rf.stats.nextOffset.exchange(offset + std::max<ssize_t>(done, 0), std::memory_order_relaxed) != offset) {
+        rf.stats.seeks.fetch_add(1, std::memory_order_relaxed);
+        ioTally.seeks++;
+    }
+}
+
+ssize_t fileRead(const RecordFile &rf, void* buf, size_t bytes, off_t offset) {
+    ssize_t got = pread(rf.fd, buf, bytes, offset);
+    countIo(rf, offset, got);
+    if (got > 0) {
+        rf.stats.bytesRead.fetch_add(got, std::memory_order_relaxed);
+        ioTally.bytesRead += got;
+    }
+    return got;
+}
+
+ssize_t fileWrite(const RecordFile &rf, const void* buf, size_t bytes, off_t offset) {
+    ssize_t done = pwrite(rf.fd, buf, bytes, offset);
+    countIo(rf, offset, done);
+    if (done > 0) {
+        rf.stats.bytesWritten.fetch_add(done, std::memory_order_relaxed);
+        ioTally.bytesWritten += done;
+    }
+    return done;
+}
+
+// Read page pageNo into buf (a whole page; records past the end of the file read as
+// zeros). Safe to call from several threads while the file does not change.
+bool readPage(const RecordFile &rf, int pageNo, char* buf) {
+    size_t pageBytes = rf.recordsPerPage * rf.recSize;
+    if (!rf.compressed) {
+        ssize_t got = fileRead(rf, buf, pageBytes, rf.dataOffset + (off_t)pageNo * pageBytes);
+        if (got < 0)
+            return false;
+        memset(buf + got, 0, pageBytes - got);
+        return true;
+    }
+    if (pageNo >= (int)rf.blocks.size() || rf.blocks[pageNo].length == 0) {
+        memset(buf, 0, pageBytes);
+        return true;
+    }
+    const BlockRef &block = rf.blocks[pageNo];
+    int raw = block.records * rf.recSize;
+    memset(buf + raw, 0, pageBytes - raw);
+    if (block.length == raw)
+        return fileRead(rf, buf, raw, block.offset) == raw;
+    thread_local std::vector<char> packed;
+    packed.resize(block.length);
+    return fileRead(rf, packed.data(), block.length, block.offset) == block.length &&
+           decompressBlock(packed.data(), block.length, buf, raw);
+}
+
+// Grow the mapping (and the file) by one extent. Pointers into the old mapping become invalid.
+bool growMapping(RecordFile &rf) {
+    size_t oldBytes = (size_t)rf.mapCapacity * rf.recSize;
+    size_t newBytes = oldBytes + (size_t)MAP_EXTENT_RECORDS * rf.recSize;
+    if (ftruncate(rf.fd, rf.dataOffset + newBytes) != 0)
+        return false;
+    void* p = mremap(rf.map, oldBytes, newBytes, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return false;
+    rf.map = static_cast<char*>(p);
+    rf.mapCapacity += MAP_EXTENT_RECORDS;
+    rf.mapDirty.resize((rf.mapCapacity + rf.recordsPerPage - 1) / rf.recordsPerPage, 0);
+    return true;
+}
+
+// Choose a frame for a new page with the CLOCK policy, evicting its current page.
+// Only clean pages are evicted; if three quarters of the frames are dirty (or two
+// sweeps find no clean one) the pool gets a new frame instead.
+int victimFrame(RecordFile &rf) {
+    for (size_t step = 0; ; step++) {
+        if (rf.dirtyFrames * 4 >= (int)rf.frames.size() * 3 || step == 2 * rf.frames.size()) {
+            addFrame(rf);
+            if (rf.dirtyFrames >= DIRTY_FRAME_LIMIT)
+                checkpointNeeded = true;
+            return rf.frames.size() - 1;
+        }
+        int idx = rf.clockHand;
+        Frame &f = rf.frames[idx];
+        rf.clockHand = (rf.clockHand + 1) % rf.frames.size();
+        if (f.pageNo == -1)
+            return idx;
+        if (f.referenced) {
+            f.referenced = false;
+            continue;
+        }
+        if (f.dirty)
+            continue;
+        rf.pageTable.erase(f.pageNo);
+        f.pageNo = -1;
+        rf.stats.evictions++;
+        return idx;
+    }
+}
+
+// Snapshots give the reports a consistent view of the files while operations go on
+// (copy-on-write pages). A snapshot records how many records each of its files had
+// when it was opened; from then on, the first change to one of its pages (a write
+// through fetchRecord, or a cut by truncateRecordFile) first saves a copy of the page
+// as it was in the snapshot. Reading a page in the snapshot takes the current page
+// and then the saved copy if there is one. The copies are freed with the snapshot.
+struct SnapshotFile {
+    const RecordFile* file;
+    int recordCount;                                   // Records when the snapshot was opened
+    std::unordered_map<int, std::vector<char>> pages;  // Pages as they were, saved before their first change
+};
+
+struct Snapshot {
+    std::vector<SnapshotFile> files;
+};
+
+std::mutex snapshotLatch;                  // Guards the list and the saved pages of every snapshot
+std::vector<Snapshot*> openSnapshots;
+std::atomic<int> snapshotCount(0);         // Open snapshots, checked before taking snapshotLatch
+std::atomic<long long> snapshotsOpened(0);
+std::atomic<long long> snapshotPages(0);   // Pages saved, for pool-stats
+
+// Save a page of rf (its first records, the rest reads as zeros) for every open
+// snapshot that covers it and has no copy yet. Called before the page changes.
+void preservePage(const RecordFile &rf, int pageNo, const char* data, int records) {
+    std::lock_guard<std::mutex> lock(snapshotLatch);
+    for (Snapshot* snap : openSnapshots) {
+        for (SnapshotFile &sf : snap->files) {
+            if (sf.file != &rf || (long long)pageNo * rf.recordsPerPage >= sf.recordCount || sf.pages.count(pageNo))
+                continue;
+            std::vector<char> &copy = sf.pages[pageNo];
+            copy.assign(rf.recordsPerPage * rf.recSize, 0);
+            memcpy(copy.data(), data, (size_t)records * rf.recSize);
+            snapshotPages++;
+        }
+    }
+}
+
+// Return a pointer to the cached bytes of record recNum (nullptr on error), loading its
+// page on a miss. The caller holds the file latch exclusively (or the engine latch
+// exclusively); the pointer is valid until the next access to the same file.
+// In mmap mode the pointer addresses the mapping directly and stays valid until the next append.
+char* fetchRecord(RecordFile &rf, int recNum, bool forWrite) {
+    if (recNum < 0 || recNum >= rf.recordCount)
+        return nullptr;
+    if (forWrite)
+        filesChanged = true;
+    int pageNo = recNum / rf.recordsPerPage;
+    if (rf.map) {
+        if (forWrite && snapshotCount > 0) {
+            int first = pageNo * rf.recordsPerPage;
+            preservePage(rf, pageNo, rf.map + (size_t)first * rf.recSize, std::min(rf.recordsPerPage, rf.recordCount - first));
+        }
+        if (forWrite)
+            markMapDirty(rf, pageNo);
+        return rf.map + (size_t)recNum * rf.recSize;
+    }
+    int frameIdx;
+    auto it = rf.pageTable.find(pageNo);
+    if (it != rf.pageTable.end()) {
+        frameIdx = it->second;
+        rf.stats.hits++;
+    } else {
+        rf.stats.misses++;
+        frameIdx = victimFrame(rf);
+        if (frameIdx == -1)
+            return nullptr;
+        Frame &f = rf.frames[frameIdx];
+        if (!readPage(rf, pageNo, f.data.data()))
+            return nullptr;
+        f.pageNo = pageNo;
+        f.dirty = false;
+        rf.pageTable[pageNo] = frameIdx;
+    }
+    Frame &f = rf.frames[frameIdx];
+    f.referenced = true;
+    if (forWrite && snapshotCount > 0)
+        preservePage(rf, pageNo, f.data.data(), rf.recordsPerPage);
+    if (forWrite && !f.dirty) {
+        f.dirty = true;
+        rf.dirtyFrames++;
+    }
+    return f.data.data() + (recNum % rf.recordsPerPage) * rf.recSize;
+}
+
+// Like fetchRecord for reading, but only for a record that needs no page load (a pool
+// hit, or any record of a mapping), so the file latch may be shared. nullptr on a miss.
+const char* cachedRecord(RecordFile &rf, int recNum) {
+    if (recNum < 0 || recNum >= rf.recordCount)
+        return nullptr;
+    if (rf.map)
+        return rf.map + (size_t)recNum * rf.recSize;
+    auto it = rf.pageTable.find(recNum / rf.recordsPerPage);
+    if (it == rf.pageTable.end())
+        return nullptr;
+    Frame &f = rf.frames[it->second];
+    f.referenced = true;
+    rf.stats.hits++;
+    return f.data.data() + (recNum % rf.recordsPerPage) * rf.recSize;
+}
+
+// Call fn(record bytes) with the file latched: shared on a hit, exclusive on a miss.
+// fn must not access the same file. Returns false on error.
+template <typename Fn>
+bool visitRecord(RecordFile &rf, int recNum, Fn fn) {
+    {
+        SharedLatch shared(rf.latch);
+        const char* p = cachedRecord(rf, recNum);
+        if (p) {
+            fn(p);
+            return true;
+        }
+    }
+    ExclusiveLatch exclusive(rf.latch);
+    const char* p = fetchRecord(rf, recNum, false);
+    if (!p)
+        return false;
+    fn(p);
+    return true;
+}
+
+bool readRecord(RecordFile &rf, int recNum, void* out) {
+    return visitRecord(rf, recNum, [&](const char* p) { memcpy(out, p, rf.recSize); });
+}
+
+// Change a record in place: fn(char*) runs on the cached bytes under the exclusive file latch.
+template <typename Fn>
+bool updateRecord(RecordFile &rf, int recNum, Fn fn) {
+    ExclusiveLatch exclusive(rf.latch);
+    char* p = fetchRecord(rf, recNum, true);
+    if (!p)
+        return false;
+    fn(p);
+    return true;
+}
+
+bool writeRecord(RecordFile &rf, int recNum, const void* rec) {
+    ExclusiveLatch exclusive(rf.latch);
+    char* p = fetchRecord(rf, recNum, true);
+    if (!p)
+        return false;
+    memcpy(p, rec, rf.recSize);
+    return true;
+}
+
+// Append count records (consecutive, even with other writers) at the end of the file
+// and return the first record number (-1 on error).
+int appendRecord(RecordFile &rf, const void* recs, int count = 1) {
+    ExclusiveLatch exclusive(rf.latch);
+    int first = rf.recordCount;
+    for (int i = 0; i < count; i++) {
+        if (rf.map && rf.recordCount == rf.mapCapacity && !growMapping(rf))
+            return -1;
+        int recNum = rf.recordCount++;
+        char* p = fetchRecord(rf, recNum, true);
+        if (!p) {
+            rf.recordCount--;
+            return -1;
+        }
+        memcpy(p, static_cast<const char*>(recs) + (size_t)i * rf.recSize, rf.recSize);
+    }
+    return first;
+}
+
+// The record count, for callers that hold the engine latch only shared.
+int fileRecordCount(RecordFile &rf) {
+    SharedLatch shared(rf.latch);
+    return rf.recordCount;
+}
+
+// Append count records with one sequential write. Returns the first new record number (-1 on error).
+// Like truncateRecordFile and flushRecordFile below, it needs the engine latch held exclusively.
+int appendRecords(RecordFile &rf, const void* recs, int count) {
+    filesChanged = true;
+    int first = rf.recordCount;
+    size_t bytes = (size_t)count * rf.recSize;
+    if (rf.map) {
+        while (rf.recordCount + count > rf.mapCapacity) {
+            if (!growMapping(rf))
+                return -1;
+        }
+        memcpy(rf.map + (size_t)first * rf.recSize, recs, bytes);
+        for (int page = first / rf.recordsPerPage; page <= (first + count - 1) / rf.recordsPerPage; page++)
+            markMapDirty(rf, page);
+        rf.recordCount += count;
+        return first;
+    }
+    if (rf.compressed) {
+        // Blocks are only written by a flush, so the records go to the pool
+        for (int i = 0; i < count; i++) {
+            char* p = fetchRecord(rf, rf.recordCount++, true);
+            if (!p)
+                return -1;
+            memcpy(p, static_cast<const char*>(recs) + (size_t)i * rf.recSize, rf.recSize);
+        }
+        return first;
+    }
+    // The records go straight to the file past its current end. A crash before the
+    // next checkpoint leaves them past the size the log recorded, where recovery cuts them off.
+    if (fileWrite(rf, recs, bytes, rf.dataOffset + (off_t)first * rf.recSize) != (ssize_t)bytes)
+        return -1;
+    // Copy the part that falls in the cached tail page, so a later write-back of it
+    // cannot overwrite the new records with a stale copy
+    auto it = rf.pageTable.find(first / rf.recordsPerPage);
+    if (it != rf.pageTable.end()) {
+        int offset = first % rf.recordsPerPage;
+        int inPage = std::min(count, rf.recordsPerPage - offset);
+        memcpy(rf.frames[it->second].data.data() + offset * rf.recSize, recs, inPage * rf.recSize);
+    }
+    rf.recordCount += count;
+    return first;
+}
+
+// Cut the file down to count records, dropping cached pages past the new end.
+// The file itself is only cut by the next flush.
+bool truncateRecordFile(RecordFile &rf, int count) {
+    filesChanged = true;
+    // Open snapshots keep the pages from the new end on (later appends overwrite them)
+    for (int first = count / rf.recordsPerPage * rf.recordsPerPage; snapshotCount > 0 && first < rf.recordCount;
+         first += rf.recordsPerPage) {
+        const char* p = fetchRecord(rf, first, false);
+        if (!p)
+            return false;
+        preservePage(rf, first / rf.recordsPerPage, p, std::min(rf.recordsPerPage, rf.recordCount - first));
+    }
+    for (auto &f : rf.frames) {
+        if (f.pageNo != -1 && f.pageNo * rf.recordsPerPage >= count) {
+            rf.pageTable.erase(f.pageNo);
+            f.pageNo = -1;
+            if (f.dirty)
+                rf.dirtyFrames--;
+            f.dirty = false;
+        }
+    }
+    rf.recordCount = count;
+    return true;
+}
+
+// Call fn(file offset, data, bytes) for every modified page, with only the records that exist in the file.
+template <typename Fn>
+void forEachDirtyPage(const RecordFile &rf, Fn fn) {
+    if (rf.map) {
+        for (size_t page = 0; page < rf.mapDirty.size(); page++) {
+            int first = page * rf.recordsPerPage;
+            int count = std::min(rf.recordsPerPage, rf.recordCount - first);
+            if (rf.mapDirty[page] && count > 0)
+                fn(rf.dataOffset + (off_t)first * rf.recSize, rf.map + (size_t)first * rf.recSize, count * rf.recSize);
+        }
+        return;
+    }
+    for (auto &f : rf.frames) {
+        if (f.pageNo == -1 || !f.dirty)
+            continue;
+        int first = f.pageNo * rf.recordsPerPage;
+        int count = std::min(rf.recordsPerPage, rf.recordCount - first);
+        if (count > 0)
+            fn(rf.dataOffset + (off_t)first * rf.recSize, f.data.data(), count * rf.recSize);
+    }
+}
+
+// Find count free sectors in a row for a block, after the ones found since the last
+// directory was written, or at the end of the file. Returns the first one.
+size_t allocateSectors(RecordFile &rf, int count) {
+    size_t run = 0;
+    for (size_t s = rf.sectorHand; s < rf.sectorUsed.size(); s++) {
+        run = rf.sectorUsed[s] ? 0 : run + 1;
+        if (run == (size_t)count) {
+            rf.sectorHand = s + 1;
+            std::fill(rf.sectorUsed.begin() + (s + 1 - count), rf.sectorUsed.begin() + (s + 1), 1);
+            return s + 1 - count;
+        }
+    }
+    size_t first = rf.sectorUsed.size();
+    rf.sectorUsed.resize(first + count, 1);
+    rf.sectorHand = first + count;
+    return first;
+}
+
+// Write page pageNo (its first records records) as a new block of a compressed file.
+// The sectors of the block it replaces are released with the next directory.
+bool storeBlock(RecordFile &rf, int pageNo, const char* data, int records) {
+    int raw = records * rf.recSize;
+    thread_local std::vector<char> packed;
+    packed.resize(raw);
+    int length = compressBlock(data, raw, packed.data(), raw - 1);
+    const char* bytes = length > 0 ? packed.data() : data;
+    if (length == 0)
+        length = raw;
+    if (pageNo >= (int)rf.blocks.size())
+        rf.blocks.resize(pageNo + 1, BlockRef{0, 0, 0});
+    BlockRef &block = rf.blocks[pageNo];
+    if (block.length > 0)
+        rf.releasedSectors.push_back({(block.offset - rf.dataOffset) / BLOCK_SECTOR, blockSectors(block.length)});
+    off_t offset = rf.dataOffset + (off_t)allocateSectors(rf, blockSectors(length)) * BLOCK_SECTOR;
+    block = BlockRef{(long long)offset, length, records};
+    return fileWrite(rf, bytes, length, offset) == length;
+}
+
+// Flush of a compressed file: new blocks for the modified pages, then the directory.
+// The file is cut after its last used sector.
+bool writeBlocks(RecordFile &rf) {
+    bool ok = true;
+    rf.sectorHand = 0;
+    size_t pageBytes = rf.recordsPerPage * rf.recSize;
+    forEachDirtyPage(rf, [&](off_t offset, const char* data, size_t bytes) {
+        ok = storeBlock(rf, (offset - rf.dataOffset) / pageBytes, data, bytes / rf.recSize) && ok;
+    });
+    // Drop the blocks of pages past the end
+    size_t pages = (rf.recordCount + rf.recordsPerPage - 1) / rf.recordsPerPage;
+    for (size_t page = pages; page < rf.blocks.size(); page++) {
+        if (rf.blocks[page].length > 0)
+            rf.releasedSectors.push_back({(rf.blocks[page].offset - rf.dataOffset) / BLOCK_SECTOR,
+                                          blockSectors(rf.blocks[page].length)});
+    }
+    if (rf.blocks.size() > pages)
+        rf.blocks.resize(pages);
+    if (!ok || fdatasync(rf.fd) != 0 || !writeDirectory(rf))
+        return false;
+    size_t used = rf.sectorUsed.size();
+    while (used > 0 && !rf.sectorUsed[used - 1])
+        used--;
+    rf.sectorUsed.resize(used);
+    return ftruncate(rf.fd, rf.dataOffset + (off_t)used * BLOCK_SECTOR) == 0;
+}
+
+// Write all modified pages (and the header) to the file and sync it. The pool shrinks back to
+// poolFrames; in a private mapping the copies of the written pages are dropped, so
+// they are read back from the file, and the other pages stay mapped.
+// Pointers returned by fetchRecord into the pool become invalid.
+bool flushRecordFile(RecordFile &rf) {
+    bool ok = true;
+    if (rf.compressed) {
+        ok = writeBlocks(rf);
+    } else {
+        forEachDirtyPage(rf, [&](off_t offset, const char* data, size_t bytes) {
+            ok = fileWrite(rf, data, bytes, offset) == (ssize_t)bytes && ok;
+        });
+    }
+    if (rf.dataOffset > 0)
+        ok = writeFileHeader(rf) && ok;
+    if (!ok)
+        return false;
+    if (rf.map) {
+        if (fdatasync(rf.fd) != 0)
+            return false;
+        size_t pageBytes = sysconf(_SC_PAGESIZE);
+        size_t chunk = rf.recordsPerPage * rf.recSize;
+        for (size_t page = 0; page < rf.mapDirty.size(); page++) {
+            if (!rf.mapDirty[page])
+                continue;
+            // One madvise per run of modified pages, widened to whole memory pages
+            size_t end = page;
+            while (end < rf.mapDirty.size() && rf.mapDirty[end])
+                rf.mapDirty[end++] = 0;
+            size_t from = page * chunk / pageBytes * pageBytes;
+            size_t to = std::min(end * chunk, (size_t)rf.mapCapacity * rf.recSize);
+            to = (to + pageBytes - 1) / pageBytes * pageBytes;
+            if (madvise(rf.map + from, to - from, MADV_DONTNEED) != 0)
+                return false;
+            page = end;
+        }
+        rf.dirtyFrames = 0;
+        return true;
+    }
+    for (auto &f : rf.frames) {
+        if (f.dirty)
+            rf.stats.writeBacks++;
+        f.dirty = false;
+    }
+    rf.dirtyFrames = 0;
+    while (rf.frames.size() > (size_t)poolFrames) {
+        if (rf.frames.back().pageNo != -1)
+            rf.pageTable.erase(rf.frames.back().pageNo);
+        rf.frames.pop_back();
+    }
+    rf.clockHand %= rf.frames.size();
+    if (!rf.compressed && ftruncate(rf.fd, rf.dataOffset + (off_t)rf.recordCount * rf.recSize) != 0)
+        return false;
+    return fdatasync(rf.fd) == 0;
+}
+
+void closeRecordFile(RecordFile &rf) {
+    if (rf.fd < 0)
+        return;
+    if (!flushRecordFile(rf))
+        std::cerr << "Error writing " << rf.fileName << "." << std::endl;
+    if (rf.map) {
+        munmap(rf.map, (size_t)rf.mapCapacity * rf.recSize);
+        rf.map = nullptr;
+        // Drop the unused part of the last extent
+        if (ftruncate(rf.fd, rf.dataOffset + (off_t)rf.recordCount * rf.recSize) != 0)
+            std::cerr << "Error truncating " << rf.fileName << "." << std::endl;
+    }
+    close(rf.fd);
+    rf.fd = -1;
+}
+
+// Pages can be loaded ahead of use by the I/O threads (--io-threads, 0 disables them):
+// code that knows which records it will need soon queues tasks that load their pages
+// (prefetchPages, or a task that looks the records up first) and goes on, so many
+// reads are in flight while it works through the first ones. A task runs with the
+// engine latch shared, so the file cannot change on disk under it (only checkpoints
+// and bulk steps write it, under the exclusive engine latch). It reads a page without
+// the file latch and installs it in a frame unless it became resident meanwhile; for
+// a mapping it asks the kernel to read the page instead.
+const int IO_THREADS = 4;               // Default I/O threads
+const size_t IO_QUEUE_LIMIT = 4096;     // Tasks queued beyond this are dropped
+
+int ioThreadCount = IO_THREADS;         // --io-threads
+std::vector<std::thread> ioThreads;
+std::deque<std::function<void()>> ioQueue;
+std::mutex ioLatch;
+std::condition_variable ioReady;
+bool ioStopping = false;
+
+// Ask the kernel to read pages [from, to) of a mapping, widened to whole memory pages.
+void adviseMapping(RecordFile &rf, size_t from, size_t to) {
+    size_t chunk = rf.recordsPerPage * rf.recSize;
+    size_t pageBytes = sysconf(_SC_PAGESIZE);
+    size_t first = from * chunk / pageBytes * pageBytes;
+    size_t last = std::min((to * chunk + pageBytes - 1) / pageBytes * pageBytes, (size_t)rf.mapCapacity * rf.recSize);
+    if (first < last)
+        madvise(rf.map + first, last - first, MADV_WILLNEED);
+}
+
+// Load a page ahead of use, from an I/O task (see above).
+void loadPage(RecordFile &rf, int pageNo) {
+    if (rf.map) {
+        adviseMapping(rf, pageNo, pageNo + 1);
+        return;
+    }
+    {
+        SharedLatch shared(rf.latch);
+        if (rf.pageTable.count(pageNo) > 0 || pageNo * rf.recordsPerPage >= rf.recordCount)
+            return;
+    }
+    thread_local std::vector<char> buf;
+    buf.resize(rf.recordsPerPage * rf.recSize);
+    if (!readPage(rf, pageNo, buf.data()))
+        return;
+    ExclusiveLatch exclusive(rf.latch);
+    if (rf.pageTable.count(pageNo) > 0 || pageNo * rf.recordsPerPage >= rf.recordCount)
+        return;
+    int frameIdx = victimFrame(rf);
+    Frame &f = rf.frames[frameIdx];
+    f.data.swap(buf);
+    f.pageNo = pageNo;
+    f.dirty = false;
+    f.referenced = true;
+    rf.pageTable[pageNo] = frameIdx;
+    rf.stats.prefetches++;
+}
+
+void ioThreadMain() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(ioLatch);
+            ioReady.wait(lock, [] { return ioStopping || !ioQueue.empty(); });
+            if (ioQueue.empty())
+                return;
+            task = std::move(ioQueue.front());
+            ioQueue.pop_front();
+        }
+        SharedLatch engine(engineLatch);
+        task();
+    }
+}
+
+void startIoThreads() {
+    ioStopping = false;
+    for (int i = 0; i < ioThreadCount; i++)
+        ioThreads.emplace_back(ioThreadMain);
+}
+
+// Drop the queued tasks and wait for the ones running.
+void stopIoThreads() {
+    {
+        std::lock_guard<std::mutex> lock(ioLatch);
+        ioQueue.clear();
+        ioStopping = true;
+    }
+    ioReady.notify_all();
+    for (auto &t : ioThreads)
+        t.join();
+    ioThreads.clear();
+}
+
+// Queue a task for the I/O threads. It is dropped if there are none or too many tasks wait.
+void submitIo(std::function<void()> task) {
+    if (ioThreads.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(ioLatch);
+        if (ioQueue.size() >= IO_QUEUE_LIMIT)
+            return;
+        ioQueue.push_back(std::move(task));
+    }
+    ioReady.notify_one();
+}
+
+// Prefetch pages of rf (see above). Resident pages are skipped; the pages of a
+// mapping are advised right away.
+void prefetchPages(RecordFile &rf, std::vector<int> &pages) {
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    if (rf.map) {
+        for (size_t i = 0; i < pages.size(); ) {
+            size_t end = i + 1;
+            while (end < pages.size() && pages[end] == pages[end - 1] + 1)
+                end++;
+            adviseMapping(rf, pages[i], pages[end - 1] + 1);
+            i = end;
+        }
+        return;
+    }
+    if (ioThreads.empty())
+        return;
+    SharedLatch shared(rf.latch);
+    for (int page : pages) {
+        if (rf.pageTable.count(page) == 0)
+            submitIo([&rf, page] { loadPage(rf, page); });
+    }
+}
+
+// Record access API used by all commands
+// (these also count the records in the thread's tally, see STATISTICS)
+bool readBuyer(int recNum, Buyer &buyer)        { ioTally.recordsRead++; return readRecord(masterFile, recNum, &buyer); }
+bool writeBuyer(int recNum, const Buyer &buyer) { ioTally.recordsWritten++; return writeRecord(masterFile, recNum, &buyer); }
+int  appendBuyer(const Buyer &buyer)            { ioTally.recordsWritten++; return appendRecord(masterFile, &buyer); }
+bool readBook(int recNum, Book &book)           { ioTally.recordsRead++; return readRecord(slaveFile, recNum, &book); }
+bool writeBook(int recNum, const Book &book)    { ioTally.recordsWritten++; return writeRecord(slaveFile, recNum, &book); }
+int  appendBook(const Book &book)               { ioTally.recordsWritten++; return appendRecord(slaveFile, &book); }
+
+// Zero-copy access: fn gets the record where it lies (a pool frame or the mapping)
+// while the file latch is held, so it must not call into the same file.
+template <typename Fn> bool visitBuyer(int recNum, Fn fn) {
+    ioTally.recordsRead++;
+    return visitRecord(masterFile, recNum, [&](const char* p) { fn(*reinterpret_cast<const Buyer*>(p)); });
+}
+template <typename Fn> bool visitBook(int recNum, Fn fn) {
+    ioTally.recordsRead++;
+    return visitRecord(slaveFile, recNum, [&](const char* p) { fn(*reinterpret_cast<const Book*>(p)); });
+}
+template <typename Fn> bool updateBuyer(int recNum, Fn fn) {
+    ioTally.recordsWritten++;
+    return updateRecord(masterFile, recNum, [&](char* p) { fn(*reinterpret_cast<Buyer*>(p)); });
+}
+template <typename Fn> bool updateBook(int recNum, Fn fn) {
+    ioTally.recordsWritten++;
+    return updateRecord(slaveFile, recNum, [&](char* p) { fn(*reinterpret_cast<Book*>(p)); });
+}
+
+// Block scan: call fn(firstRecNum, records, count) for runs of consecutive records
+// without copying them. In mmap mode the whole mapping is one run; otherwise the pool
+// is walked page by page. fn must not access the same file while the scan runs, and
+// the caller holds the engine latch exclusively.
+template <typename Rec, typename Fn>
+bool scanBlocks(RecordFile &rf, Fn fn) {
+    ioTally.recordsRead += rf.recordCount;
+    if (rf.map) {
+        if (rf.recordCount > 0)
+            fn(0, reinterpret_cast<const Rec*>(rf.map), rf.recordCount);
+        return true;
+    }
+    for (int first = 0; first < rf.recordCount; first += rf.recordsPerPage) {
+        const Rec* page = reinterpret_cast<const Rec*>(fetchRecord(rf, first, false));
+        if (!page)
+            return false;
+        fn(first, page, std::min(rf.recordsPerPage, rf.recordCount - first));
+    }
+    return true;
+}
+
+// Full scan: call fn(recNum, record) for every record of the file (same rules).
+template <typename Rec, typename Fn>
+bool scanFile(RecordFile &rf, Fn fn) {
+    return scanBlocks<Rec>(rf, [&](int first, const Rec* recs, int count) {
+        for (int i = 0; i < count; i++)
+            fn(first + i, recs[i]);
+    });
+}
+
+template <typename Fn> bool scanBuyers(Fn fn) { return scanFile<Buyer>(masterFile, fn); }
+template <typename Fn> bool scanBooks(Fn fn)  { return scanFile<Book>(slaveFile, fn); }
+
+// Parallel scans split a range of records into consecutive runs of whole pages, one
+// per worker (--scan-threads, default one per core), and each worker keeps its own
+// partial result. Workers do not load pages into the pool: they read SCAN_READ_PAGES
+// pages at a time from disk, which holds every page that is not resident as is (dirty
+// pages are never evicted), and copy the resident ones over from their frames under
+// the shared file latch. So a report neither serializes on the pool nor flushes its
+// working set.
+const int SCAN_MIN_PAGES = 16;          // Pages per worker below which fewer workers are used
+const int SCAN_READ_PAGES = 32;         // Pages read by one call
+const int SCAN_WINDOW_RECORDS = 65536;  // Records formatted per round by printRecords
+
+int scanThreads = std::max(1, (int)std::thread::hardware_concurrency()); // Scan workers (--scan-threads)
+
+// Run fn(i) for i in [0, count), each on its own thread (fn(0) on the caller's). The
+// tallies of the other threads are added to the caller's.
+template <typename Fn>
+void runParallel(int count, Fn fn) {
+    std::vector<std::thread> threads;
+    std::vector<IoTally> tallies(count);
+    for (int i = 1; i < count; i++) {
+        threads.emplace_back([&, i] {
+            fn(i);
+            tallies[i] = ioTally;
+        });
+    }
+    fn(0);
+    for (auto &t : threads)
+        t.join();
+    for (int i = 1; i < count; i++)
+        addTally(ioTally, tallies[i]);
+}
+
+// Copy records [first, first + count) into buf for a parallel scan. latched: the
+// caller holds the file latch shared (a snapshot scan).
+bool copyRecords(RecordFile &rf, int first, int count, char* buf, bool latched = false) {
+    int perPage = rf.recordsPerPage;
+    if (rf.compressed) {
+        // One decompression per page, into a page buffer of the worker
+        thread_local std::vector<char> page;
+        page.resize(perPage * rf.recSize);
+        for (int recNum = first; recNum < first + count; recNum = (recNum / perPage + 1) * perPage) {
+            if (!readPage(rf, recNum / perPage, page.data()))
+                return false;
+            int inPage = std::min(first + count, (recNum / perPage + 1) * perPage) - recNum;
+            memcpy(buf + (size_t)(recNum - first) * rf.recSize, page.data() + (size_t)(recNum % perPage) * rf.recSize,
+                   (size_t)inPage * rf.recSize);
+        }
+    } else {
+        size_t bytes = (size_t)count * rf.recSize;
+        ssize_t got = fileRead(rf, buf, bytes, rf.dataOffset + (off_t)first * rf.recSize);
+        if (got < 0)
+            return false;
+        // Records past the end of the file on disk are still only in (dirty) frames
+        memset(buf + got, 0, bytes - got);
+    }
+    SharedLatch latch(rf.latch, std::defer_lock);
+    if (!latched)
+        latch.lock();
+    for (int recNum = first; recNum < first + count; recNum = (recNum / perPage + 1) * perPage) {
+        auto it = rf.pageTable.find(recNum / perPage);
+        if (it == rf.pageTable.end())
+            continue;
+        int inPage = std::min(first + count, (recNum / perPage + 1) * perPage) - recNum;
+        memcpy(buf + (size_t)(recNum - first) * rf.recSize,
+               rf.frames[it->second].data.data() + (size_t)(recNum % perPage) * rf.recSize, (size_t)inPage * rf.recSize);
+    }
+    return true;
+}
+
+const SnapshotFile* snapshotFile(const Snapshot &snap, const RecordFile &rf) {
+    for (const SnapshotFile &sf : snap.files)
+        if (sf.file == &rf)
+            return &sf;
+    return nullptr;
+}
+
+// Copy records [first, first + count) of rf as they were in the snapshot: the current
+// ones (under the engine latch, shared, so no checkpoint runs meanwhile), then the
+// saved pages over them. A page changed after it was read has been saved before the
+// change, so it is covered either way.
+bool copySnapshotRecords(const Snapshot &snap, RecordFile &rf, int first, int count, char* buf) {
+    const SnapshotFile* sf = snapshotFile(snap, rf);
+    if (!sf)
+        return false;
+    {
+        SharedLatch engine(engineLatch);
+        SharedLatch latch(rf.latch);
+        int current = std::max(0, std::min(count, rf.recordCount - first));
+        memset(buf + (size_t)current * rf.recSize, 0, (size_t)(count - current) * rf.recSize);
+        if (rf.map)
+            memcpy(buf, rf.map + (size_t)first * rf.recSize, (size_t)current * rf.recSize);
+        else if (current > 0 && !copyRecords(rf, first, current, buf, true))
+            return false;
+    }
+    int perPage = rf.recordsPerPage;
+    std::lock_guard<std::mutex> lock(snapshotLatch);
+    for (int recNum = first; recNum < first + count; recNum = (recNum / perPage + 1) * perPage) {
+        auto it = sf->pages.find(recNum / perPage);
+        if (it == sf->pages.end())
+            continue;
+        int inPage = std::min(first + count, (recNum / perPage + 1) * perPage) - recNum;
+        memcpy(buf + (size_t)(recNum - first) * rf.recSize, it->second.data() + (size_t)(recNum % perPage) * rf.recSize,
+               (size_t)inPage * rf.recSize);
+    }
+    return true;
+}
+
+// Read one record of rf as it was in the snapshot (same order as above).
+bool readSnapshotRecord(const Snapshot &snap, RecordFile &rf, int recNum, void* out) {
+    const SnapshotFile* sf = snapshotFile(snap, rf);
+    if (!sf || recNum < 0 || recNum >= sf->recordCount)
+        return false;
+    bool found;
+    {
+        SharedLatch engine(engineLatch);
+        found = visitRecord(rf, recNum, [&](const char* p) { memcpy(out, p, rf.recSize); });
+    }
+    ioTally.recordsRead++;
+    std::lock_guard<std::mutex> lock(snapshotLatch);
+    auto it = sf->pages.find(recNum / rf.recordsPerPage);
+    if (it == sf->pages.end())
+        return found;
+    memcpy(out, it->second.data() + (size_t)(recNum % rf.recordsPerPage) * rf.recSize, rf.recSize);
+    return true;
+}
+
+// Parallel block scan of records [from, to): fn(worker, firstRecNum, records, count)
+// runs on up to scanThreads workers. Worker w covers a run of records that precedes
+// the run of worker w + 1, so partial results merged in worker order are in record
+// order. The caller holds the engine latch exclusively, or passes a snapshot to read
+// (and then holds no latch); fn must not access the file.
+template <typename Rec, typename Fn>
+bool parallelScan(RecordFile &rf, int from, int to, Fn fn, const Snapshot* snap = nullptr) {
+    int perPage = rf.recordsPerPage;
+    int firstPage = from / perPage;
+    int pages = to > from ? (to + perPage - 1) / perPage - firstPage : 0;
+    int workers = std::max(1, std::min(scanThreads, pages / SCAN_MIN_PAGES));
+    std::atomic<bool> ok(true);
+    runParallel(workers, [&](int w) {
+        int begin = std::max(from, (firstPage + (int)((long long)pages * w / workers)) * perPage);
+        int end = std::min(to, (firstPage + (int)((long long)pages * (w + 1) / workers)) * perPage);
+        if (rf.map && !snap) {
+            if (begin < end) {
+                ioTally.recordsRead += end - begin;
+                fn(w, begin, reinterpret_cast<const Rec*>(rf.map) + begin, end - begin);
+            }
+            return;
+        }
+        int chunk = SCAN_READ_PAGES * perPage;
+        std::vector<char> buf((size_t)chunk * rf.recSize);
+        for (int first = begin; first < end && ok; first = (first / chunk + 1) * chunk) {
+            int count = std::min(end, (first / chunk + 1) * chunk) - first;
+            if (!(snap ? copySnapshotRecords(*snap, rf, first, count, buf.data())
+                       : copyRecords(rf, first, count, buf.data()))) {
+                ok = false;
+                return;
+            }
+            ioTally.recordsRead += count;
+            fn(w, first, reinterpret_cast<const Rec*>(buf.data()), count);
+        }
+    });
+    return ok;
+}
+
+// Print a report line (or nothing) for every record: format(out, recNum, record)
+// runs in parallel over windows of SCAN_WINDOW_RECORDS records, and the text of each
+// window is printed in record order before the next one is formatted.
+// With a snapshot, the records are the ones it holds.
+template <typename Rec, typename Fn>
+bool printRecords(RecordFile &rf, Fn format, const Snapshot* snap = nullptr) {
+    std::vector<std::ostringstream> parts(scanThreads);
+    int records = snap ? snapshotFile(*snap, rf)->recordCount : rf.recordCount;
+    for (int from = 0; from < records; from += SCAN_WINDOW_RECORDS) {
+        bool ok = parallelScan<Rec>(rf, from, std::min(records, from + SCAN_WINDOW_RECORDS),
+                                    [&](int w, int first, const Rec* recs, int count) {
+            for (int i = 0; i < count; i++)
+                format(parts[w], first + i, recs[i]);
+        }, snap);
+        for (auto &part : parts) {
+            std::cout << part.str();
+            part.str("");
+        }
+        if (!ok)
+            return false;
+    }
+    std::cout << std::flush;
+    return true;
+}
+
+
+// ===================== B+-TREE INDEXES =====================
+// Every index is a paged B+-tree with 64-bit keys. Page 0 holds the header and every
+// other page holds one node; pages are cached by the buffer pool like B.fl/BK.fl.
+// Leaves store (key, record number) pairs and are linked left to right for range
+// scans. Deleted keys are removed from their leaf without rebalancing, so every
+// operation stays O(log n); empty leaves are simply skipped by scans.
+//   B.ind    phone          -> record number in B.fl
+//   BK.ind   (phone, ISBN)  -> record number in BK.fl
+//   BK.isbn  (ISBN, phone)  -> record number in BK.fl
+// The btree* functions do not latch; operations go through the tree*/index* wrappers,
+// which take the tree latch. Cursors and bulk loads need the engine latch exclusively.
+const int BTREE_MAGIC = 0x32545042;     // "BPT2" (64-bit keys)
+const int BTREE_MAGIC_V1 = 0x31545042;  // "BPT1" (32-bit keys, rebuilt on open)
+const int BTREE_CAPACITY = 340;         // Keys per node (one node fills a 4 KB page)
+
+struct BTreeNode {
+    int isLeaf;
+    int keyCount;
+    int next;                          // Next leaf page (-1 if last); unused in inner nodes
+    int values[BTREE_CAPACITY + 1];    // Leaf: record numbers; inner: child pages
+    long long keys[BTREE_CAPACITY];
+};
+
+struct BTreeHeader {
+    int magic;
+    int root;        // Root page (-1 if the tree is empty)
+    int keyCount;    // Number of keys in the tree
+    int height;      // Levels from the root to the leaves
+    long long generation;  // Checkpoint that last wrote the tree (see CheckpointStamp)
+};
+
+struct BTree {
+    RecordFile file;
+    BTreeHeader header;  // In-memory copy of page 0
+    std::shared_mutex latch;  // Shared by lookups, exclusive for updates (taken by the wrappers below)
+};
+
+// One (key, value) pair, used for bulk loading and iteration
+struct BTreeEntry {
+    long long key;
+    int value;
+};
+
+// Cursor over the leaf level, used for ordered iteration
+struct IndexCursor {
+    int page;
+    int slot;
+};
+
+BTree masterIndex;   // B.ind
+BTree phoneIsbnIndex;  // BK.ind
+BTree isbnPhoneIndex;  // BK.isbn
+
+// Composite keys: the first field in the high half, so all keys with the same first
+// field are adjacent and ordered by the second one.
+long long compositeKey(int high, int low) {
+    return (long long)(((unsigned long long)(unsigned int)high << 32) | (unsigned int)low);
+}
+
+int compositeHigh(long long key) { return (int)(key >> 32); }
+int compositeLow(long long key)  { return (int)(key & 0xffffffffLL); }
+
+// Direct view of a node, for code that holds the tree latch exclusively.
+const BTreeNode* nodeView(BTree &tree, int page) {
+    return reinterpret_cast<const BTreeNode*>(fetchRecord(tree.file, page, false));
+}
+
+bool saveTreeHeader(BTree &tree) {
+    char* p = fetchRecord(tree.file, 0, true);
+    if (!p)
+        return false;
+    memcpy(p, &tree.header, sizeof(BTreeHeader));
+    return true;
+}
+
+// Return the value stored for key, or -1 if the key is not in the tree.
+// Safe with the tree latch shared: each node is searched under its page latch.
+int btreeFind(BTree &tree, long long key) {
+    int page = tree.header.root;
+    int value = -1;
+    ioTally.indexProbes++;
+    while (page != -1) {
+        ioTally.indexNodes++;
+        bool leaf = false;
+        bool ok = visitRecord(tree.file, page, [&](const char* p) {
+            const BTreeNode* node = reinterpret_cast<const BTreeNode*>(p);
+            if (node->isLeaf) {
+                int pos = std::lower_bound(node->keys, node->keys + node->keyCount, key) - node->keys;
+                if (pos < node->keyCount && node->keys[pos] == key)
+                    value = node->values[pos];
+                leaf = true;
+            } else {
+                page = node->values[std::upper_bound(node->keys, node->keys + node->keyCount, key) - node->keys];
+            }
+        });
+        if (!ok || leaf)
+            break;
+    }
+    return value;
+}
+
+// Append to entries the entries with keys in [low, high], at most limit of them.
+// Safe with the tree latch shared, like btreeFind. Returns false on a read error.
+bool btreeRange(BTree &tree, long long low, long long high, size_t limit, std::vector<BTreeEntry> &entries) {
+    int page = tree.header.root;
+    while (page != -1 && entries.size() < limit) {
+        int next = -1;
+        bool ok = visitRecord(tree.file, page, [&](const char* p) {
+            const BTreeNode* node = reinterpret_cast<const BTreeNode*>(p);
+            if (!node->isLeaf) {
+                next = node->values[std::upper_bound(node->keys, node->keys + node->keyCount, low) - node->keys];
+                return;
+            }
+            int pos = std::lower_bound(node->keys, node->keys + node->keyCount, low) - node->keys;
+            for (; pos < node->keyCount && node->keys[pos] <= high && entries.size() < limit; pos++)
+                entries.push_back(BTreeEntry{node->keys[pos], node->values[pos]});
+            if (pos == node->keyCount)
+                next = node->next;
+        });
+        if (!ok)
+            return false;
+        page = next;
+    }
+    return true;
+}
+
+// Insert into the subtree rooted at page. Returns -1 on error, 0 if the node absorbed
+// the key and 1 if it split, in which case upKey/upPage describe the new right sibling.
+int insertIntoNode(BTree &tree, int page, long long key, int value, long long &upKey, int &upPage) {
+    BTreeNode node;
+    if (!readRecord(tree.file, page, &node))
+        return -1;
+    long long keys[BTREE_CAPACITY + 1];
+    int values[BTREE_CAPACITY + 2];
+    int n = node.keyCount;
+    if (node.isLeaf) {
+        int pos = std::lower_bound(node.keys, node.keys + n, key) - node.keys;
+        std::copy(node.keys, node.keys + pos, keys);
+        std::copy(node.values, node.values + pos, values);
+        keys[pos] = key;
+        values[pos] = value;
+        std::copy(node.keys + pos, node.keys + n, keys + pos + 1);
+        std::copy(node.values + pos, node.values + n, values + pos + 1);
+    } else {
+        int pos = std::upper_bound(node.keys, node.keys + n, key) - node.keys;
+        long long childKey;
+        int childPage;
+        int result = insertIntoNode(tree, node.values[pos], key, value, childKey, childPage);
+        if (result <= 0)
+            return result;
+        std::copy(node.keys, node.keys + pos, keys);
+        std::copy(node.values, node.values + pos + 1, values);
+        keys[pos] = childKey;
+        values[pos + 1] = childPage;
+        std::copy(node.keys + pos, node.keys + n, keys + pos + 1);
+        std::copy(node.values + pos + 1, node.values + n + 1, values + pos + 2);
+    }
+    n++;
+    if (n <= BTREE_CAPACITY) {
+        node.keyCount = n;
+        std::copy(keys, keys + n, node.keys);
+        std::copy(values, values + n + (node.isLeaf ? 0 : 1), node.values);
+        return writeRecord(tree.file, page, &node) ? 0 : -1;
+    }
+    // Split: the lower half stays in this page, the upper half moves to a new page.
+    BTreeNode right;
+    memset(&right, 0, sizeof(BTreeNode));
+    right.isLeaf = node.isLeaf;
+    int mid = n / 2;
+    upKey = keys[mid];
+    if (node.isLeaf) {
+        right.keyCount = n - mid;
+        std::copy(keys + mid, keys + n, right.keys);
+        std::copy(values + mid, values + n, right.values);
+        right.next = node.next;
+    } else {
+        // The middle key moves up and is not kept in either half
+        right.keyCount = n - mid - 1;
+        std::copy(keys + mid + 1, keys + n, right.keys);
+        std::copy(values + mid + 1, values + n + 1, right.values);
+        right.next = -1;
+    }
+    upPage = appendRecord(tree.file, &right);
+    if (upPage == -1)
+        return -1;
+    node.keyCount = mid;
+    std::copy(keys, keys + mid, node.keys);
+    std::copy(values, values + mid + (node.isLeaf ? 0 : 1), node.values);
+    if (node.isLeaf)
+        node.next = upPage;
+    return writeRecord(tree.file, page, &node) ? 1 : -1;
+}
+
+// Add key -> value. Returns false if the key is already present or on I/O error.
+bool btreeInsert(BTree &tree, long long key, int value) {
+    if (btreeFind(tree, key) != -1)
+        return false;
+    if (tree.header.root == -1) {
+        BTreeNode leaf;
+        memset(&leaf, 0, sizeof(BTreeNode));
+        leaf.isLeaf = 1;
+        leaf.keyCount = 1;
+        leaf.next = -1;
+        leaf.keys[0] = key;
+        leaf.values[0] = value;
+        tree.header.root = appendRecord(tree.file, &leaf);
+        if (tree.header.root == -1)
+            return false;
+        tree.header.height = 1;
+    } else {
+        long long upKey;
+        int upPage;
+        int result = insertIntoNode(tree, tree.header.root, key, value, upKey, upPage);
+        if (result == -1)
+            return false;
+        if (result == 1) {
+            // The root split: grow the tree by one level
+            BTreeNode root;
+            memset(&root, 0, sizeof(BTreeNode));
+            root.isLeaf = 0;
+            root.keyCount = 1;
+            root.next = -1;
+            root.keys[0] = upKey;
+            root.values[0] = tree.header.root;
+            root.values[1] = upPage;
+            int rootPage = appendRecord(tree.file, &root);
+            if (rootPage == -1)
+                return false;
+            tree.header.root = rootPage;
+            tree.header.height++;
+        }
+    }
+    tree.header.keyCount++;
+    return saveTreeHeader(tree);
+}
+
+// Remove key from the tree. Returns false if it was not present.
+bool btreeErase(BTree &tree, long long key) {
+    int page = tree.header.root;
+    while (page != -1) {
+        const BTreeNode* view = nodeView(tree, page);
+        if (!view)
+            return false;
+        if (!view->isLeaf) {
+            page = view->values[std::upper_bound(view->keys, view->keys + view->keyCount, key) - view->keys];
+            continue;
+        }
+        BTreeNode node = *view;
+        int pos = std::lower_bound(node.keys, node.keys + node.keyCount, key) - node.keys;
+        if (pos == node.keyCount || node.keys[pos] != key)
+            return false;
+        std::copy(node.keys + pos + 1, node.keys + node.keyCount, node.keys + pos);
+        std::copy(node.values + pos + 1, node.values + node.keyCount, node.values + pos);
+        node.keyCount--;
+        if (!writeRecord(tree.file, page, &node))
+            return false;
+        tree.header.keyCount--;
+        return saveTreeHeader(tree);
+    }
+    return false;
+}
+
+// Point an existing key at a new value. Returns false if the key is not in the tree.
+bool btreeSetValue(BTree &tree, long long key, int value) {
+    int page = tree.header.root;
+    while (page != -1) {
+        const BTreeNode* view = nodeView(tree, page);
+        if (!view)
+            return false;
+        if (!view->isLeaf) {
+            page = view->values[std::upper_bound(view->keys, view->keys + view->keyCount, key) - view->keys];
+            continue;
+        }
+        int pos = std::lower_bound(view->keys, view->keys + view->keyCount, key) - view->keys;
+        if (pos == view->keyCount || view->keys[pos] != key)
+            return false;
+        BTreeNode* node = reinterpret_cast<BTreeNode*>(fetchRecord(tree.file, page, true));
+        if (!node)
+            return false;
+        node->values[pos] = value;
+        return true;
+    }
+    return false;
+}
+
+// Position a cursor on the first entry with a key >= the given one.
+IndexCursor btreeSeek(BTree &tree, long long key) {
+    IndexCursor cursor = {tree.header.root, 0};
+    while (cursor.page != -1) {
+        const BTreeNode* node = nodeView(tree, cursor.page);
+        if (!node) {
+            cursor.page = -1;
+            break;
+        }
+        if (node->isLeaf) {
+            cursor.slot = std::lower_bound(node->keys, node->keys + node->keyCount, key) - node->keys;
+            break;
+        }
+        cursor.page = node->values[std::upper_bound(node->keys, node->keys + node->keyCount, key) - node->keys];
+    }
+    return cursor;
+}
+
+// Return the entry under the cursor and advance it. Returns false at the end of the tree.
+bool btreeNext(BTree &tree, IndexCursor &cursor, BTreeEntry &out) {
+    while (cursor.page != -1) {
+        const BTreeNode* node = nodeView(tree, cursor.page);
+        if (!node)
+            return false;
+        if (cursor.slot < node->keyCount) {
+            out.key = node->keys[cursor.slot];
+            out.value = node->values[cursor.slot];
+            cursor.slot++;
+            return true;
+        }
+        cursor.page = node->next;
+        cursor.slot = 0;
+    }
+    return false;
+}
+
+// Rebuild a tree bottom-up from entries sorted by key (full leaves, then inner levels).
+bool btreeBuild(BTree &tree, const std::vector<BTreeEntry> &entries) {
+    if (!truncateRecordFile(tree.file, 0))
+        return false;
+    tree.header = BTreeHeader{BTREE_MAGIC, -1, (int)entries.size(), 0, 0};
+    BTreeNode node;
+    memset(&node, 0, sizeof(BTreeNode));
+    if (appendRecord(tree.file, &node) != 0)  // Page 0: header
+        return false;
+    if (entries.empty())
+        return saveTreeHeader(tree);
+    // Each level is a list of (smallest key, page) pairs for the level above
+    std::vector<BTreeEntry> level;
+    size_t leafCount = (entries.size() + BTREE_CAPACITY - 1) / BTREE_CAPACITY;
+    for (size_t i = 0; i < leafCount; i++) {
+        size_t first = i * BTREE_CAPACITY;
+        size_t last = std::min(entries.size(), first + BTREE_CAPACITY);
+        memset(&node, 0, sizeof(BTreeNode));
+        node.isLeaf = 1;
+        node.keyCount = last - first;
+        // Leaves are appended one after another, so the next leaf is the next page
+        node.next = (i + 1 < leafCount) ? tree.file.recordCount + 1 : -1;
+        for (size_t j = first; j < last; j++) {
+            node.keys[j - first] = entries[j].key;
+            node.values[j - first] = entries[j].value;
+        }
+        int page = appendRecord(tree.file, &node);
+        if (page == -1)
+            return false;
+        level.push_back(BTreeEntry{entries[first].key, page});
+    }
+    tree.header.height = 1;
+    while (level.size() > 1) {
+        std::vector<BTreeEntry> upper;
+        for (size_t first = 0; first < level.size(); first += BTREE_CAPACITY + 1) {
+            size_t last = std::min(level.size(), first + BTREE_CAPACITY + 1);
+            memset(&node, 0, sizeof(BTreeNode));
+            node.isLeaf = 0;
+            node.keyCount = last - first - 1;
+            node.next = -1;
+            for (size_t j = first; j < last; j++) {
+                node.values[j - first] = level[j].value;
+                if (j > first)
+                    node.keys[j - first - 1] = level[j].key;
+            }
+            int page = appendRecord(tree.file, &node);
+            if (page == -1)
+                return false;
+            upper.push_back(BTreeEntry{level[first].key, page});
+        }
+        level.swap(upper);
+        tree.header.height++;
+    }
+    tree.header.root = level[0].value;
+    return saveTreeHeader(tree);
+}
+
+// A lambda rather than a function, so that sort and merge inline the comparison
+const auto entryLess = [](const BTreeEntry &a, const BTreeEntry &b) { return a.key < b.key; };
+
+void sortEntries(std::vector<BTreeEntry> &entries) {
+    std::sort(entries.begin(), entries.end(), entryLess);
+}
+
+// Sort the per-worker entry lists of a parallel scan, each on its own thread, then
+// merge them pairwise (the pairs of a round in parallel) into one sorted list.
+std::vector<BTreeEntry> sortParts(std::vector<std::vector<BTreeEntry>> &parts) {
+    runParallel(parts.size(), [&](int i) { sortEntries(parts[i]); });
+    while (parts.size() > 1) {
+        std::vector<std::vector<BTreeEntry>> merged((parts.size() + 1) / 2);
+        runParallel(merged.size(), [&](int i) {
+            if (2 * i + 1 == (int)parts.size()) {
+                merged[i].swap(parts[2 * i]);
+                return;
+            }
+            auto &a = parts[2 * i], &b = parts[2 * i + 1];
+            merged[i].resize(a.size() + b.size());
+            std::merge(a.begin(), a.end(), b.begin(), b.end(), merged[i].begin(), entryLess);
+            std::vector<BTreeEntry>().swap(a);
+            std::vector<BTreeEntry>().swap(b);
+        });
+        parts.swap(merged);
+    }
+    std::vector<BTreeEntry> entries;
+    if (!parts.empty())
+        entries.swap(parts[0]);
+    return entries;
+}
+
+// A batch of new keys is merged with one bottom-up rebuild (instead of one insert per
+// key) once it is at least this fraction of the keys already in the tree.
+const int BULK_REBUILD_DIVISOR = 8;
+
+bool isBulkBatch(const BTree &tree, size_t count) {
+    return count * BULK_REBUILD_DIVISOR >= (size_t)tree.header.keyCount;
+}
+
+// Read every entry of the tree in key order.
+std::vector<BTreeEntry> btreeEntries(BTree &tree) {
+    std::vector<BTreeEntry> entries;
+    entries.reserve(tree.header.keyCount);
+    IndexCursor cursor = btreeSeek(tree, LLONG_MIN);
+    BTreeEntry entry;
+    while (btreeNext(tree, cursor, entry))
+        entries.push_back(entry);
+    return entries;
+}
+
+// Add entries sorted by key whose keys are not in the tree yet. Large batches are
+// merged with the existing entries and rebuilt bottom-up; small ones are inserted.
+bool btreeBulkInsert(BTree &tree, const std::vector<BTreeEntry> &entries) {
+    if (!isBulkBatch(tree, entries.size())) {
+        for (auto &entry : entries) {
+            if (!btreeInsert(tree, entry.key, entry.value))
+                return false;
+        }
+        return true;
+    }
+    std::vector<BTreeEntry> existing = btreeEntries(tree);
+    std::vector<BTreeEntry> merged(existing.size() + entries.size());
+    std::merge(existing.begin(), existing.end(), entries.begin(), entries.end(), merged.begin(),
+        [](const BTreeEntry &a, const BTreeEntry &b) { return a.key < b.key; });
+    return btreeBuild(tree, merged);
+}
+
+// Remove sorted keys that are all in the tree. Large batches are rebuilt bottom-up from
+// the remaining entries; small ones are erased one by one.
+bool btreeBulkErase(BTree &tree, const std::vector<long long> &keys) {
+    if (!isBulkBatch(tree, keys.size())) {
+        for (long long key : keys) {
+            if (!btreeErase(tree, key))
+                return false;
+        }
+        return true;
+    }
+    std::vector<BTreeEntry> entries = btreeEntries(tree);
+    size_t kept = 0;
+    size_t k = 0;
+    for (const BTreeEntry &entry : entries) {
+        while (k < keys.size() && keys[k] < entry.key)
+            k++;
+        if (k == keys.size() || keys[k] != entry.key)
+            entries[kept++] = entry;
+    }
+    entries.resize(kept);
+    return btreeBuild(tree, entries);
+}
+
+// Mark which of the sorted keys are already in the tree. Large batches are checked
+// with one merge walk over the leaves instead of one probe per key.
+std::vector<bool> btreeContains(BTree &tree, const std::vector<long long> &keys) {
+    std::vector<bool> found(keys.size(), false);
+    if (!isBulkBatch(tree, keys.size())) {
+        for (size_t i = 0; i < keys.size(); i++)
+            found[i] = btreeFind(tree, keys[i]) != -1;
+        return found;
+    }
+    if (keys.empty())
+        return found;
+    IndexCursor cursor = btreeSeek(tree, keys[0]);
+    BTreeEntry entry;
+    bool more = btreeNext(tree, cursor, entry);
+    for (size_t i = 0; i < keys.size() && more; i++) {
+        while (more && entry.key < keys[i])
+            more = btreeNext(tree, cursor, entry);
+        found[i] = more && entry.key == keys[i];
+    }
+    return found;
+}
+
+// Check that a header with BTREE_MAGIC really starts a tree file: an old sorted-array
+// B.ind whose first phone happens to equal the magic must not be taken for one.
+bool validTreeHeader(BTree &tree, const BTreeHeader &header) {
+    struct stat st;
+    if (fstat(tree.file.fd, &st) != 0 || st.st_size % sizeof(BTreeNode) != 0)
+        return false;
+    int pages = tree.file.recordCount;
+    if (header.root == -1)
+        return header.keyCount == 0 && header.height == 0;
+    if (header.root < 1 || header.root >= pages || header.height < 1 || header.height > 16 ||
+        header.keyCount < 0 || (long long)header.keyCount > (long long)(pages - 1) * BTREE_CAPACITY)
+        return false;
+    const BTreeNode* root = nodeView(tree, header.root);
+    return root && (root->isLeaf == 1) == (header.height == 1) && (root->isLeaf == 0 || root->isLeaf == 1) &&
+           root->keyCount >= 0 && root->keyCount <= BTREE_CAPACITY;
+}
+
+// Open a tree file. Only the header is read; nodes are paged in on demand.
+// Returns the magic found in page 0 (0 if the file is empty or page 0 is not a valid
+// tree header, -1 on error); when it is not BTREE_MAGIC the caller must rebuild the tree.
+int openTree(BTree &tree, const char* fileName) {
+    if (!openRecordFile(tree.file, fileName, sizeof(BTreeNode), 1, false, false))
+        return -1;
+    tree.header = BTreeHeader{0, -1, 0, 0, 0};
+    if (tree.file.recordCount == 0)
+        return 0;
+    const BTreeHeader* header = reinterpret_cast<const BTreeHeader*>(fetchRecord(tree.file, 0, false));
+    if (!header)
+        return -1;
+    if (header->magic != BTREE_MAGIC)
+        return header->magic;
+    BTreeHeader found = *header;
+    if (!validTreeHeader(tree, found))
+        return 0;
+    tree.header = found;
+    return BTREE_MAGIC;
+}
+
+void closeTree(BTree &tree) {
+    saveTreeHeader(tree);
+    closeRecordFile(tree.file);
+}
+
+// Call fn(key) for every key in order. Safe with the tree latch shared, like btreeFind;
+// fn must not access the tree.
+template <typename Fn>
+bool btreeForEachKey(BTree &tree, Fn fn) {
+    int page = tree.header.root;
+    while (page != -1) {
+        int next = -1;
+        bool ok = visitRecord(tree.file, page, [&](const char* p) {
+            const BTreeNode* node = reinterpret_cast<const BTreeNode*>(p);
+            if (!node->isLeaf) {
+                next = node->values[0];
+                return;
+            }
+            for (int i = 0; i < node->keyCount; i++)
+                fn(node->keys[i]);
+            next = node->next;
+        });
+        if (!ok)
+            return false;
+        page = next;
+    }
+    return true;
+}
+
+// Bloom filter over the keys of BK.ind, so that lookups of (phone, ISBN) pairs that do
+// not exist are mostly answered from memory (bookIndexFind). Keys are only added;
+// deleted ones stay set until the filter is rebuilt from BK.ind, after vacuum or at a
+// checkpoint once more keys were added than it was sized for. It is read under the
+// BK.ind latch shared and changed under it exclusively (or the engine latch exclusively).
+// The filter is saved to BK.bloom on exit and the file is removed when it is loaded,
+// so after a crash it is rebuilt instead of trusted.
+const int BLOOM_MAGIC = 0x4d4f4c42;     // "BLOM"
+const int BLOOM_BITS_PER_KEY = 10;      // With BLOOM_HASHES: about 1% false positives
+const int BLOOM_HASHES = 7;
+const long long BLOOM_MIN_KEYS = 65536;
+
+struct BloomHeader {
+    int magic;
+    int hashes;
+    long long words;      // 64-bit words of bits that follow
+    long long capacity;   // Keys the filter was sized for
+    long long added;      // Keys added since it was sized
+    long long keyCount;   // Keys in BK.ind when it was saved
+    unsigned int checksum;  // fnv1a of the bits
+    int reserved;
+};
+
+struct BloomFilter {
+    std::vector<uint64_t> bits;  // Empty: no filter, every key may be present
+    long long capacity;
+    long long added;
+};
+
+BloomFilter bookFilter;
+std::atomic<long long> bookFilterNegatives(0);  // BK.ind probes the filter saved
+
+uint64_t bloomHash(long long key) {
+    uint64_t h = (uint64_t)key + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Size an empty filter for keys keys, with room to double.
+void bloomReset(BloomFilter &filter, long long keys) {
+    filter.capacity = std::max(keys * 2, BLOOM_MIN_KEYS);
+    filter.bits.assign((filter.capacity * BLOOM_BITS_PER_KEY + 63) / 64, 0);
+    filter.added = 0;
+}
+
+void bloomAdd(BloomFilter &filter, long long key) {
+    if (filter.bits.empty())
+        return;
+    uint64_t bitCount = filter.bits.size() * 64;
+    uint64_t h = bloomHash(key);
+    uint64_t step = (h >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, h += step) {
+        uint64_t bit = h % bitCount;
+        filter.bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    filter.added++;
+}
+
+bool bloomMayContain(const BloomFilter &filter, long long key) {
+    if (filter.bits.empty())
+        return true;
+    uint64_t bitCount = filter.bits.size() * 64;
+    uint64_t h = bloomHash(key);
+    uint64_t step = (h >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, h += step) {
+        uint64_t bit = h % bitCount;
+        if ((filter.bits[bit / 64] & (1ULL << (bit % 64))) == 0)
+            return false;
+    }
+    return true;
+}
+
+// Build the filter from the keys in BK.ind. The caller holds the engine latch
+// exclusively (or runs alone, at startup).
+bool rebuildBookFilter() {
+    BloomFilter filter;
+    bloomReset(filter, phoneIsbnIndex.header.keyCount);
+    if (!btreeForEachKey(phoneIsbnIndex, [&](long long key) { bloomAdd(filter, key); })) {
+        bookFilter = BloomFilter{{}, 0, 0};
+        return false;
+    }
+    bookFilter = std::move(filter);
+    return true;
+}
+
+// Load BK.bloom if it was saved for the current BK.ind and remove it (see above).
+bool loadBookFilter() {
+    std::ifstream in(BOOK_FILTER_FILE, std::ios::binary);
+    if (!in)
+        return false;
+    BloomHeader header;
+    std::vector<uint64_t> bits;
+    bool ok = in.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == BLOOM_MAGIC &&
+              header.hashes == BLOOM_HASHES && header.keyCount == phoneIsbnIndex.header.keyCount &&
+              header.words > 0 && header.words <= (header.capacity * BLOOM_BITS_PER_KEY + 63) / 64;
+    if (ok) {
+        bits.resize(header.words);
+        ok = in.read(reinterpret_cast<char*>(bits.data()), bits.size() * sizeof(uint64_t)) &&
+             fnv1a(bits.data(), bits.size() * sizeof(uint64_t)) == header.checksum;
+    }
+    in.close();
+    if (unlink(BOOK_FILTER_FILE) != 0 || !syncDirectory() || !ok)
+        return false;
+    bookFilter = BloomFilter{std::move(bits), header.capacity, header.added};
+    return true;
+}
+
+// Write the filter to BK.bloom, on exit after the last checkpoint.
+bool saveBookFilter() {
+    if (bookFilter.bits.empty())
+        return true;
+    size_t bytes = bookFilter.bits.size() * sizeof(uint64_t);
+    BloomHeader header = {BLOOM_MAGIC, BLOOM_HASHES, (long long)bookFilter.bits.size(), bookFilter.capacity,
+                          bookFilter.added, phoneIsbnIndex.header.keyCount, fnv1a(bookFilter.bits.data(), bytes), 0};
+    std::string temp = std::string(BOOK_FILTER_FILE) + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              write(fd, bookFilter.bits.data(), bytes) == (ssize_t)bytes && fdatasync(fd) == 0;
+    close(fd);
+    return ok && rename(temp.c_str(), BOOK_FILTER_FILE) == 0 && syncDirectory();
+}
+
+// B.ind: phone -> record number in B.fl
+// Latched access to one tree
+int treeFind(BTree &tree, long long key) {
+    SharedLatch shared(tree.latch);
+    return btreeFind(tree, key);
+}
+
+bool treeInsert(BTree &tree, long long key, int value) {
+    ExclusiveLatch exclusive(tree.latch);
+    return btreeInsert(tree, key, value);
+}
+
+bool treeErase(BTree &tree, long long key) {
+    ExclusiveLatch exclusive(tree.latch);
+    return btreeErase(tree, key);
+}
+
+const int QUERY_BATCH = 256;    // Index entries a query reads per latch hold
+
+// Read the next entries of [from, last] of a tree into batch, at most limit of them,
+// and move from past them; done is set once the range is exhausted. The caller holds
+// the engine latch shared, so queries can print each batch with no latch held.
+// Returns false on a read error.
+bool treeRangeBatch(BTree &tree, long long &from, long long last, size_t limit,
+                    std::vector<BTreeEntry> &batch, bool &done) {
+    batch.clear();
+    SharedLatch shared(tree.latch);
+    if (!btreeRange(tree, from, last, limit, batch))
+        return false;
+    done = batch.size() < limit || batch.back().key == last;
+    if (!done)
+        from = batch.back().key + 1;
+    return true;
+}
+
+int indexFind(int phone)              { return treeFind(masterIndex, phone); }
+bool indexInsert(int phone, int recNum) { return treeInsert(masterIndex, phone, recNum); }
+bool indexErase(int phone)            { return treeErase(masterIndex, phone); }
+
+// BK.ind and BK.isbn: (phone, ISBN) -> record number in BK.fl. Pairs the Bloom filter
+// rules out are not looked up.
+bool bookMayExist(int phone, int ISBN) {
+    SharedLatch shared(phoneIsbnIndex.latch);
+    if (bloomMayContain(bookFilter, compositeKey(phone, ISBN)))
+        return true;
+    bookFilterNegatives++;
+    return false;
+}
+
+int bookIndexFind(int phone, int ISBN) {
+    long long key = compositeKey(phone, ISBN);
+    SharedLatch shared(phoneIsbnIndex.latch);
+    if (!bloomMayContain(bookFilter, key)) {
+        bookFilterNegatives++;
+        return -1;
+    }
+    return btreeFind(phoneIsbnIndex, key);
+}
+
+bool bookIndexInsert(int phone, int ISBN, int recNum) {
+    {
+        ExclusiveLatch exclusive(phoneIsbnIndex.latch);
+        bloomAdd(bookFilter, compositeKey(phone, ISBN));
+        if (!btreeInsert(phoneIsbnIndex, compositeKey(phone, ISBN), recNum))
+            return false;
+    }
+    return treeInsert(isbnPhoneIndex, compositeKey(ISBN, phone), recNum);
+}
+
+bool bookIndexErase(int phone, int ISBN) {
+    bool ok = treeErase(phoneIsbnIndex, compositeKey(phone, ISBN));
+    return treeErase(isbnPhoneIndex, compositeKey(ISBN, phone)) && ok;
+}
+
+// ===================== INDEX AND GARBAGE HANDLING =====================
+// Freeing a record sets its bit in the garbage zone. Taking one looks at the words
+// around a hint first (for a book, the first book of its buyer, so a chain stays on
+// few pages) and otherwise takes the lowest free record, found through the summary,
+// so reuse fills the start of the file and checkpoints can cut a free tail. The
+// bitmaps are kept in B.free and BK.free; a checkpoint logs and writes only the
+// blocks that changed since the last one.
+const int GARBAGE_BLOCK_WORDS = 512;  // Words per block of a bitmap file (4 KB)
+const int GARBAGE_NEAR_WORDS = 2;     // Words searched on each side of the hint
+
+// Store a word of the bitmap, keeping the count, the summary and the dirty blocks in step.
+void setGarbageWord(GarbageMap &g, size_t w, uint64_t value) {
+    if (w >= g.words.size()) {
+        if (value == 0)
+            return;
+        size_t words = std::max(w + 1, g.words.size() * 2);
+        g.words.resize(words, 0);
+        g.summary.resize((words + 63) / 64, 0);
+        g.dirtyBlocks.resize((words + GARBAGE_BLOCK_WORDS - 1) / GARBAGE_BLOCK_WORDS, 0);
+    }
+    if (g.words[w] == value)
+        return;
+    g.count += __builtin_popcountll(value) - __builtin_popcountll(g.words[w]);
+    g.words[w] = value;
+    if (value != 0) {
+        g.summary[w / 64] |= 1ULL << (w % 64);
+        g.firstSummary = std::min(g.firstSummary, w / 64);
+    } else {
+        g.summary[w / 64] &= ~(1ULL << (w % 64));
+    }
+    g.dirtyBlocks[w / GARBAGE_BLOCK_WORDS] = 1;
+}
+
+bool isGarbage(const GarbageMap &g, int recNum) {
+    size_t w = recNum / 64;
+    return w < g.words.size() && (g.words[w] >> (recNum % 64) & 1);
+}
+
+void setGarbage(GarbageMap &g, int recNum, bool free) {
+    size_t w = recNum / 64;
+    uint64_t word = w < g.words.size() ? g.words[w] : 0;
+    uint64_t bit = 1ULL << (recNum % 64);
+    setGarbageWord(g, w, free ? word | bit : word & ~bit);
+}
+
+// Take a record number from a garbage zone (-1 if it is empty), near the record
+// number hint if there is one, or give one back.
+int takeGarbage(GarbageMap &g, int hint = -1) {
+    std::lock_guard<std::mutex> lock(garbageLatch);
+    if (g.count == 0)
+        return -1;
+    long w = -1;
+    long words = g.words.size();
+    for (long d = 0; hint >= 0 && d <= GARBAGE_NEAR_WORDS && w == -1; d++) {
+        long center = hint / 64;
+        if (center + d < words && g.words[center + d] != 0)
+            w = center + d;
+        else if (center - d >= 0 && center - d < words && g.words[center - d] != 0)
+            w = center - d;
+    }
+    while (w == -1) {
+        uint64_t bits = g.summary[g.firstSummary];
+        if (bits != 0)
+            w = g.firstSummary * 64 + __builtin_ctzll(bits);
+        else
+            g.firstSummary++;
+    }
+    int recNum = w * 64 + __builtin_ctzll(g.words[w]);
+    setGarbage(g, recNum, false);
+    return recNum;
+}
+
+void addGarbage(GarbageMap &g, int recNum) {
+    std::lock_guard<std::mutex> lock(garbageLatch);
+    setGarbage(g, recNum, true);
+}
+
+// Remove a record that is being reused by vacuum.
+void claimGarbage(GarbageMap &g, int recNum) {
+    std::lock_guard<std::mutex> lock(garbageLatch);
+    setGarbage(g, recNum, false);
+}
+
+// Forget the records from count on, after the file was cut to count records.
+void trimGarbage(GarbageMap &g, int count) {
+    std::lock_guard<std::mutex> lock(garbageLatch);
+    for (size_t w = count / 64; w < g.words.size(); w++) {
+        uint64_t keep = (w == (size_t)count / 64) ? (1ULL << (count % 64)) - 1 : 0;
+        setGarbageWord(g, w, g.words[w] & keep);
+    }
+}
+
+// Call fn(recNum) for every free record, in increasing order.
+template <typename Fn>
+void forEachGarbage(const GarbageMap &g, Fn fn) {
+    for (size_t w = 0; w < g.words.size(); w++) {
+        for (uint64_t bits = g.words[w]; bits != 0; bits &= bits - 1)
+            fn((int)(w * 64 + __builtin_ctzll(bits)));
+    }
+}
+
+// Call fn(offset, data, bytes) for every block of the bitmap file that changed.
+template <typename Fn>
+void forEachDirtyGarbageBlock(const GarbageMap &g, Fn fn) {
+    for (size_t b = 0; b < g.dirtyBlocks.size(); b++) {
+        if (!g.dirtyBlocks[b])
+            continue;
+        size_t first = b * GARBAGE_BLOCK_WORDS;
+        size_t words = std::min((size_t)GARBAGE_BLOCK_WORDS, g.words.size() - first);
+        fn((off_t)(first * sizeof(uint64_t)), reinterpret_cast<const char*>(&g.words[first]), words * sizeof(uint64_t));
+    }
+}
+
+bool writeGarbageBlock(const char* fileName, off_t offset, const char* data, size_t bytes) {
+    int fd = open(fileName, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = pwrite(fd, data, bytes, offset) == (ssize_t)bytes && fdatasync(fd) == 0;
+    close(fd);
+    ioTally.bytesWritten += bytes;
+    return ok;
+}
+
+// Write the changed blocks of a bitmap file and sync it.
+bool saveGarbage(GarbageMap &g) {
+    int fd = open(g.fileName, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = true;
+    forEachDirtyGarbageBlock(g, [&](off_t offset, const char* data, size_t bytes) {
+        ok = pwrite(fd, data, bytes, offset) == (ssize_t)bytes && ok;
+        ioTally.bytesWritten += bytes;
+    });
+    ok = fdatasync(fd) == 0 && ok;
+    close(fd);
+    if (ok)
+        std::fill(g.dirtyBlocks.begin(), g.dirtyBlocks.end(), 0);
+    return ok;
+}
+
+void resetGarbage(GarbageMap &g) {
+    g.words.clear();
+    g.summary.clear();
+    g.dirtyBlocks.clear();
+    g.firstSummary = 0;
+    g.count = 0;
+}
+
+// Load a garbage zone for a file of recordCount records. The record number list
+// written by older versions is converted to a bitmap file and removed.
+bool loadGarbage(GarbageMap &g, const char* listFile, int recordCount) {
+    resetGarbage(g);
+    std::vector<uint64_t> words;
+    std::vector<int> list;
+    bool converted = false;
+    int fd = open(g.fileName, O_RDONLY);
+    if (fd < 0) {
+        fd = open(listFile, O_RDONLY);
+        converted = true;
+    }
+    if (fd < 0)
+        return true;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && converted) {
+        list.resize(st.st_size / sizeof(int));
+        ok = pread(fd, list.data(), list.size() * sizeof(int), 0) == (ssize_t)(list.size() * sizeof(int));
+    } else if (ok) {
+        words.resize(st.st_size / sizeof(uint64_t));
+        ok = pread(fd, words.data(), words.size() * sizeof(uint64_t), 0) == (ssize_t)(words.size() * sizeof(uint64_t));
+    }
+    close(fd);
+    if (!ok)
+        return false;
+    ioTally.bytesRead += st.st_size;
+    for (size_t w = 0; w < words.size(); w++)
+        setGarbageWord(g, w, words[w]);
+    for (int recNum : list)
+        setGarbage(g, recNum, true);
+    trimGarbage(g, recordCount);
+    if (!converted) {
+        std::fill(g.dirtyBlocks.begin(), g.dirtyBlocks.end(), 0);
+        return true;
+    }
+    return saveGarbage(g) && unlink(listFile) == 0;
+}
+
+// Rebuild a garbage zone from a parallel scan of its file: the records for which
+// isFree holds. The bitmap file is cut; the next checkpoint writes all of it.
+template <typename Rec, typename Fn>
+bool rebuildGarbage(RecordFile &rf, GarbageMap &g, Fn isFree) {
+    std::vector<std::vector<int>> parts(scanThreads);
+    bool ok = parallelScan<Rec>(rf, 0, rf.recordCount, [&](int w, int first, const Rec* recs, int count) {
+        for (int i = 0; i < count; i++)
+            if (isFree(recs[i]))
+                parts[w].push_back(first + i);
+    });
+    if (!ok || (truncate(g.fileName, 0) != 0 && errno != ENOENT))
+        return false;
+    resetGarbage(g);
+    for (const std::vector<int> &part : parts)
+        for (int recNum : part)
+            setGarbage(g, recNum, true);
+    filesChanged = true;
+    return true;
+}
+
+// Checksum of a bitmap up to its last free record, so that trailing zero words
+// (in memory but never written) do not count.
+unsigned int garbageChecksum(const GarbageMap &g) {
+    size_t words = g.words.size();
+    while (words > 0 && g.words[words - 1] == 0)
+        words--;
+    return fnv1a(g.words.data(), words * sizeof(uint64_t));
+}
+
+// Cut the free records at the end of a file (on disk at the next flush).
+// Needs the engine latch held exclusively.
+void cutFreeTail(RecordFile &rf, GarbageMap &g) {
+    int count = rf.recordCount;
+    while (count > 0 && isGarbage(g, count - 1))
+        count--;
+    if (count < rf.recordCount) {
+        truncateRecordFile(rf, count);
+        trimGarbage(g, count);
+    }
+}
+
+// Build B.ind from a parallel B.fl scan.
+bool buildMasterIndex() {
+    std::vector<std::vector<BTreeEntry>> parts(scanThreads);
+    bool ok = parallelScan<Buyer>(masterFile, 0, masterFile.recordCount,
+                                  [&](int w, int first, const Buyer* buyers, int count) {
+        for (int i = 0; i < count; i++)
+            if (buyers[i].valid == 1)
+                parts[w].push_back(BTreeEntry{buyers[i].phone, first + i});
+    });
+    if (!ok)
+        return false;
+    std::vector<BTreeEntry> entries = sortParts(parts);
+    return btreeBuild(masterIndex, entries);
+}
+
+// Files written before the book indexes existed may hold the same ISBN twice for one
+// buyer. Keep the copy nearest the chain head, unlink the others from the chain (they
+// go to the garbage zone) and drop them from the entries, so every key is unique.
+void dropDuplicateBooks(std::vector<BTreeEntry> &phoneEntries, std::vector<BTreeEntry> &isbnEntries) {
+    std::vector<int> phones;
+    std::vector<int> dropped;
+    for (size_t i = 1; i < phoneEntries.size(); i++) {
+        if (phoneEntries[i].key != phoneEntries[i - 1].key)
+            continue;
+        int phone = compositeHigh(phoneEntries[i].key);
+        if (phones.empty() || phones.back() != phone)
+            phones.push_back(phone);
+    }
+    for (int phone : phones) {
+        int buyerRecNum = btreeFind(masterIndex, phone);
+        Buyer buyer;
+        if (buyerRecNum == -1 || !readBuyer(buyerRecNum, buyer))
+            continue;
+        std::vector<int> seen;
+        int prev = -1;
+        Book bookRec;
+        for (int recNum = buyer.firstBook; recNum != -1; recNum = bookRec.nextBook) {
+            if (!readBook(recNum, bookRec))
+                break;
+            if (std::find(seen.begin(), seen.end(), bookRec.ISBN) == seen.end()) {
+                seen.push_back(bookRec.ISBN);
+                prev = recNum;
+                continue;
+            }
+            std::cerr << "Duplicate book (phone " << phone << ", ISBN " << bookRec.ISBN
+                      << ") in record " << recNum << " removed." << std::endl;
+            if (prev == -1) {
+                buyer.firstBook = bookRec.nextBook;
+            } else {
+                Book prevRec;
+                readBook(prev, prevRec);
+                prevRec.nextBook = bookRec.nextBook;
+                writeBook(prev, prevRec);
+            }
+            buyer.bookCount--;
+            Book freed = bookRec;
+            freed.valid = 0;
+            freed.nextBook = -1;
+            writeBook(recNum, freed);
+            addGarbage(slaveGarbage, recNum);
+            dropped.push_back(recNum);
+        }
+        writeBuyer(buyerRecNum, buyer);
+    }
+    std::sort(dropped.begin(), dropped.end());
+    auto isDropped = [&](const BTreeEntry &e) { return std::binary_search(dropped.begin(), dropped.end(), e.value); };
+    phoneEntries.erase(std::remove_if(phoneEntries.begin(), phoneEntries.end(), isDropped), phoneEntries.end());
+    // Books without a buyer keep their first index entry
+    size_t kept = 0;
+    for (size_t i = 0; i < phoneEntries.size(); i++) {
+        if (kept > 0 && phoneEntries[i].key == phoneEntries[kept - 1].key)
+            dropped.push_back(phoneEntries[i].value);
+        else
+            phoneEntries[kept++] = phoneEntries[i];
+    }
+    phoneEntries.resize(kept);
+    std::sort(dropped.begin(), dropped.end());
+    isbnEntries.erase(std::remove_if(isbnEntries.begin(), isbnEntries.end(), isDropped), isbnEntries.end());
+}
+
+// Build BK.ind and BK.isbn from a parallel BK.fl scan.
+bool buildBookIndexes() {
+    std::vector<std::vector<BTreeEntry>> phoneParts(scanThreads), isbnParts(scanThreads);
+    bool ok = parallelScan<Book>(slaveFile, 0, slaveFile.recordCount,
+                                 [&](int w, int first, const Book* books, int count) {
+        for (int i = 0; i < count; i++) {
+            if (books[i].valid == 1) {
+                phoneParts[w].push_back(BTreeEntry{compositeKey(books[i].phone, books[i].ISBN), first + i});
+                isbnParts[w].push_back(BTreeEntry{compositeKey(books[i].ISBN, books[i].phone), first + i});
+            }
+        }
+    });
+    if (!ok)
+        return false;
+    std::vector<BTreeEntry> phoneEntries = sortParts(phoneParts);
+    std::vector<BTreeEntry> isbnEntries = sortParts(isbnParts);
+    dropDuplicateBooks(phoneEntries, isbnEntries);
+    return btreeBuild(phoneIsbnIndex, phoneEntries) && btreeBuild(isbnPhoneIndex, isbnEntries);
+}
+
+// Every checkpoint writes a stamp (B.ckpt) of the state it left: its number, the
+// record counts of B.fl and BK.fl, the key counts of the trees and the free record
+// count and checksum of both garbage bitmaps. Each tree header holds the number of
+// the checkpoint that last wrote it. At startup the files are checked against the
+// stamp and only what does not match (a tree or bitmap that is missing or was copied
+// from another state, or the ones of a data file that changed size) is rebuilt from
+// its data file. Without a stamp (files of older versions) they are trusted.
+const int STAMP_MAGIC = 0x54504b43;  // "CKPT"
+
+struct CheckpointStamp {
+    int magic;
+    int reserved;
+    long long generation;          // Checkpoints taken so far
+    int recordCounts[2];           // B.fl, BK.fl
+    int keyCounts[3];              // B.ind, BK.ind, BK.isbn
+    int garbageCounts[2];          // Free records in B.free, BK.free
+    unsigned int garbageSums[2];   // garbageChecksum of each bitmap
+    unsigned int checksum;         // Over the stamp with checksum 0
+};
+
+long long checkpointGeneration = 0;  // Generation of the last checkpoint
+
+unsigned int stampChecksum(const CheckpointStamp &stamp) {
+    CheckpointStamp s = stamp;
+    s.checksum = 0;
+    return fnv1a(&s, sizeof(CheckpointStamp));
+}
+
+// Stamp of the current state, for a checkpoint that is about to write it
+CheckpointStamp makeStamp(long long generation) {
+    CheckpointStamp stamp;
+    memset(&stamp, 0, sizeof(CheckpointStamp));
+    stamp.magic = STAMP_MAGIC;
+    stamp.generation = generation;
+    stamp.recordCounts[0] = masterFile.recordCount;
+    stamp.recordCounts[1] = slaveFile.recordCount;
+    stamp.keyCounts[0] = masterIndex.header.keyCount;
+    stamp.keyCounts[1] = phoneIsbnIndex.header.keyCount;
+    stamp.keyCounts[2] = isbnPhoneIndex.header.keyCount;
+    stamp.garbageCounts[0] = masterGarbage.count;
+    stamp.garbageCounts[1] = slaveGarbage.count;
+    stamp.garbageSums[0] = garbageChecksum(masterGarbage);
+    stamp.garbageSums[1] = garbageChecksum(slaveGarbage);
+    stamp.checksum = stampChecksum(stamp);
+    return stamp;
+}
+
+bool writeStamp(const CheckpointStamp &stamp) {
+    int fd = open(CHECKPOINT_FILE, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = pwrite(fd, &stamp, sizeof(CheckpointStamp), 0) == (ssize_t)sizeof(CheckpointStamp) && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Read B.ckpt; false if it is missing or torn.
+bool readStamp(CheckpointStamp &stamp) {
+    int fd = open(CHECKPOINT_FILE, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = pread(fd, &stamp, sizeof(CheckpointStamp), 0) == (ssize_t)sizeof(CheckpointStamp);
+    close(fd);
+    return ok && stamp.magic == STAMP_MAGIC && stampChecksum(stamp) == stamp.checksum;
+}
+
+// True if garbage zone fileId (0 master, 1 slave) is not the one the stamp describes.
+bool garbageStale(const GarbageMap &g, const CheckpointStamp* stamp, int fileId) {
+    const RecordFile &data = fileId == 0 ? masterFile : slaveFile;
+    return stamp && (data.recordCount != stamp->recordCounts[fileId] || g.count != stamp->garbageCounts[fileId] ||
+                     garbageChecksum(g) != stamp->garbageSums[fileId]);
+}
+
+// True if tree treeId (0 B.ind, 1 BK.ind, 2 BK.isbn) is not the one the stamp describes.
+bool treeStale(const BTree &tree, const CheckpointStamp* stamp, int treeId) {
+    int fileId = treeId == 0 ? 0 : 1;
+    const RecordFile &data = fileId == 0 ? masterFile : slaveFile;
+    return stamp && (data.recordCount != stamp->recordCounts[fileId] || tree.header.generation != stamp->generation ||
+                     tree.header.keyCount != stamp->keyCounts[treeId]);
+}
+
+// Open B.ind. A missing index, one in the old sorted-array format, one with 32-bit
+// keys or one that does not match the stamp is rebuilt in a single pass.
+void loadIndexTable(const CheckpointStamp* stamp) {
+    int magic = openTree(masterIndex, INDEX_FILE);
+    if (magic == -1) {
+        std::cerr << "Error opening index file." << std::endl;
+        return;
+    }
+    if (magic == BTREE_MAGIC && !treeStale(masterIndex, stamp, 0))
+        return;
+    if (magic == BTREE_MAGIC)
+        std::cerr << INDEX_FILE << " does not match the last checkpoint; rebuilding it." << std::endl;
+    std::vector<BTreeEntry> entries;
+    if (magic != BTREE_MAGIC_V1 && magic != BTREE_MAGIC) {
+        // Old format: a sorted array of IndexRecord
+        std::ifstream in(INDEX_FILE, std::ios::binary);
+        IndexRecord temp;
+        while (in.read(reinterpret_cast<char*>(&temp), sizeof(IndexRecord))) {
+            entries.push_back(BTreeEntry{temp.phone, temp.recordNumber});
+        }
+        in.close();
+    }
+    bool ok;
+    if (entries.empty()) {
+        // If there is no index table, scan B.fl to build it.
+        ok = buildMasterIndex();
+    } else {
+        sortEntries(entries);
+        ok = btreeBuild(masterIndex, entries);
+    }
+    if (!ok)
+        std::cerr << "Error building index file." << std::endl;
+}
+
+// Open BK.ind and BK.isbn, rebuilding both from a BK.fl scan if either is missing, in
+// an older format or does not match the stamp.
+void loadBookIndexes(const CheckpointStamp* stamp) {
+    int byPhone = openTree(phoneIsbnIndex, BOOK_INDEX_FILE);
+    int byIsbn = openTree(isbnPhoneIndex, ISBN_INDEX_FILE);
+    if (byPhone == -1 || byIsbn == -1) {
+        std::cerr << "Error opening book index files." << std::endl;
+        return;
+    }
+    if (byPhone == BTREE_MAGIC && byIsbn == BTREE_MAGIC) {
+        if (!treeStale(phoneIsbnIndex, stamp, 1) && !treeStale(isbnPhoneIndex, stamp, 2)) {
+            if (!loadBookFilter())
+                rebuildBookFilter();
+            return;
+        }
+        std::cerr << BOOK_INDEX_FILE << " and " << ISBN_INDEX_FILE
+                  << " do not match the last checkpoint; rebuilding them." << std::endl;
+    }
+    if (!buildBookIndexes())
+        std::cerr << "Error building book index files." << std::endl;
+    rebuildBookFilter();
+}
+
+void saveIndexTable() {
+    if (!saveBookFilter())
+        std::cerr << "Error writing " << BOOK_FILTER_FILE << "." << std::endl;
+    closeTree(masterIndex);
+    closeTree(phoneIsbnIndex);
+    closeTree(isbnPhoneIndex);
+}
+
+// ===================== WRITE-AHEAD LOG =====================
+// Every mutation is logged to B.wal as a logical record (WalOp) before it is
+// applied. Dirty pages stay in memory (see BUFFER POOL), so the files on disk
+// always hold the state of the last checkpoint, and that state plus the log is the
+// current one. Log records are buffered and made durable together by walCommit:
+// one fdatasync covers a whole group of operations. With several threads, the first
+// one to commit writes and syncs the records of all of them (the group leader) while
+// the others wait for it.
+//
+// A checkpoint logs the image of every dirty page, the changed blocks of both
+// garbage bitmaps and its stamp (see CheckpointStamp), closes them with a WAL_END
+// record and syncs the log. Only then
+// are the pages written in place; after that the log is replaced by one holding
+// only a WAL_BASE record with the file sizes (written aside and renamed over B.wal,
+// so some log always has sizes).
+// At startup a log ending in WAL_END has its images applied again (the crash came
+// while they were being written); otherwise the files are cut to the WAL_BASE
+// sizes and the logical records are replayed.
+const int WAL_MAGIC = 0x314c4157;                  // "WAL1"
+const size_t WAL_BUFFER_BYTES = 1 << 20;           // Log bytes buffered before a write (not a sync)
+const long long WAL_CHECKPOINT_BYTES = 64LL << 20; // Checkpoint once the log grows past this
+const int WAL_FILE_COUNT = 5;                      // B.fl, BK.fl, B.ind, BK.ind, BK.isbn
+
+enum WalType { WAL_BASE = 1, WAL_OP, WAL_PAGE, WAL_GARBAGE, WAL_END, WAL_STAMP };
+enum WalOpCode { WAL_INSERT_M = 1, WAL_INSERT_S, WAL_DEL_M, WAL_DEL_S, WAL_UPDATE_M, WAL_UPDATE_S };
+
+struct WalHeader {
+    int magic;
+    int type;               // WalType
+    int fileId;             // WAL_PAGE: file number (see walFileName); WAL_GARBAGE: 0 master, 1 slave
+    int length;             // Payload bytes following the header
+    unsigned int checksum;  // Over the header (with checksum 0) and the payload
+    int reserved;
+    long long offset;       // WAL_PAGE, WAL_GARBAGE: byte offset of the image in its file
+};
+
+// Logical record: the arguments of one mutating operation
+struct WalOp {
+    int opcode;             // WalOpCode
+    int phone;
+    int ISBN;
+    int field;              // update-m, update-s
+    double price;           // insert-s
+    char text1[31];         // insert: name; update: new value
+    char text2[31];         // insert-m: address; insert-s: author
+};
+
+int walFd = -1;
+std::vector<char> walBuffer;   // Records not yet written to the log file
+long long walAppended = 0;     // Bytes ever appended to the log (the position of the next record)
+long long walDurable = 0;      // Bytes ever appended that are known to be synced
+bool walSyncing = false;       // A group leader is writing and syncing outside the mutex
+std::atomic<long long> walSize(0);  // Bytes in the log file, including the buffer
+bool walReplaying = false;     // Replaying the log at startup: nothing is logged again
+std::mutex walLatch;           // Guards all of the above but walFd
+std::condition_variable walSynced;  // Signalled when a group leader finishes
+
+// --crash-checkpoint <n> <log|pages> ends the process in the n-th checkpoint after
+// startup that has pages to write, while their images are being logged or once B.fl
+// alone is written in place, as a crash would (see checks/recovery.sh).
+int crashCheckpoint = 0;
+bool crashWhileLogging = false;
+
+const char* walFileName(int id) {
+    static const char* names[WAL_FILE_COUNT] = {MASTER_FILE, SLAVE_FILE, INDEX_FILE, BOOK_INDEX_FILE, ISBN_INDEX_FILE};
+    return names[id];
+}
+
+RecordFile &walRecordFile(int id) {
+    RecordFile* files[WAL_FILE_COUNT] = {&masterFile, &slaveFile, &masterIndex.file, &phoneIsbnIndex.file, &isbnPhoneIndex.file};
+    return *files[id];
+}
+
+// FNV-1a over the header and the payload
+unsigned int walChecksum(const WalHeader &header, const char* payload) {
+    WalHeader h = header;
+    h.checksum = 0;
+    return fnv1a(payload, header.length, fnv1a(&h, sizeof(WalHeader)));
+}
+
+bool walWrite(const std::vector<char> &buffer) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t n = write(walFd, buffer.data() + done, buffer.size() - done);
+        if (n <= 0)
+            return false;
+        done += n;
+        ioTally.bytesWritten += n;
+    }
+    return true;
+}
+
+bool walAppend(int type, int fileId, long long offset, const void* payload, size_t length) {
+    WalHeader header = {WAL_MAGIC, type, fileId, (int)length, 0, 0, offset};
+    const char* data = static_cast<const char*>(payload);
+    header.checksum = walChecksum(header, data);
+    const char* h = reinterpret_cast<const char*>(&header);
+    std::lock_guard<std::mutex> lock(walLatch);
+    walBuffer.insert(walBuffer.end(), h, h + sizeof(WalHeader));
+    walBuffer.insert(walBuffer.end(), data, data + length);
+    walAppended += sizeof(WalHeader) + length;
+    walSize += sizeof(WalHeader) + length;
+    // A large buffer is written early, unless a group leader is writing
+    if (walBuffer.size() < WAL_BUFFER_BYTES || walSyncing)
+        return true;
+    bool ok = walWrite(walBuffer);
+    walBuffer.clear();
+    return ok;
+}
+
+// Make every record appended so far (by any thread) durable. Records appended by
+// other threads while a sync is running go into the next group.
+bool walCommit() {
+    std::unique_lock<std::mutex> lock(walLatch);
+    long long target = walAppended;
+    while (walDurable < target) {
+        if (walSyncing) {
+            walSynced.wait(lock);
+            continue;
+        }
+        // Become the group leader
+        walSyncing = true;
+        std::vector<char> group;
+        group.swap(walBuffer);
+        long long upTo = walAppended;
+        lock.unlock();
+        bool ok = walWrite(group) && fdatasync(walFd) == 0;
+        lock.lock();
+        walSyncing = false;
+        if (ok)
+            walDurable = upTo;
+        walSynced.notify_all();
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+WalOp walOp(int opcode, int phone, int ISBN) {
+    WalOp op;
+    memset(&op, 0, sizeof(WalOp));
+    op.opcode = opcode;
+    op.phone = phone;
+    op.ISBN = ISBN;
+    return op;
+}
+
+// Log a mutation before it is applied. It is durable after the next walCommit.
+bool walLogOp(const WalOp &op) {
+    if (walReplaying)
+        return true;
+    return walAppend(WAL_OP, 0, 0, &op, sizeof(WalOp));
+}
+
+bool walOpen() {
+    walFd = open(WAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (walFd < 0)
+        return false;
+    struct stat st;
+    if (fstat(walFd, &st) != 0)
+        return false;
+    walSize = st.st_size;
+    return true;
+}
+
+void walFileSizes(long long (&sizes)[WAL_FILE_COUNT]) {
+    for (int id = 0; id < WAL_FILE_COUNT; id++)
+        sizes[id] = walRecordFile(id).dataOffset + (long long)walRecordFile(id).recordCount * walRecordFile(id).recSize;
+}
+
+// Replace the log by one holding only a WAL_BASE record with the given sizes. Cutting
+// B.wal in place would leave an empty log if the process died before the new record
+// was synced, and in mmap mode the files are longer than their records.
+bool walReset(const long long (&sizes)[WAL_FILE_COUNT]) {
+    std::unique_lock<std::mutex> lock(walLatch);
+    walSynced.wait(lock, [] { return !walSyncing; });
+    walBuffer.clear();
+    WalHeader header = {WAL_MAGIC, WAL_BASE, 0, (int)sizeof(sizes), 0, 0, 0};
+    header.checksum = walChecksum(header, reinterpret_cast<const char*>(sizes));
+    int fd = open(WAL_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              write(fd, sizes, sizeof(sizes)) == (ssize_t)sizeof(sizes) &&
+              fdatasync(fd) == 0 && rename(WAL_TEMP_FILE, WAL_FILE) == 0;
+    // The rename must be durable before operations are logged to the new file
+    ok = ok && syncDirectory();
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    close(walFd);
+    walFd = fd;
+    walSize = sizeof(header) + sizeof(sizes);
+    walAppended += sizeof(header) + sizeof(sizes);
+    walDurable = walAppended;
+    return true;
+}
+
+void crashStop() {
+    std::cerr << "Stopping in a checkpoint (--crash-checkpoint)." << std::endl;
+    _exit(3);
+}
+
+// Write all changes to the files and start a new log. The caller holds the engine latch
+// exclusively, so the pages written never hold half an operation.
+bool checkpointLocked() {
+    OpTimer timer(STAT_CHECKPOINT);
+    if (!filesChanged && walSize > 0)
+        return walCommit();
+    bool ok = true;
+    cutFreeTail(masterFile, masterGarbage);
+    cutFreeTail(slaveFile, slaveGarbage);
+    // Every tree is stamped, changed or not; a tree that cannot be is rebuilt at the
+    // next start
+    long long generation = checkpointGeneration + 1;
+    for (BTree* tree : {&masterIndex, &phoneIsbnIndex, &isbnPhoneIndex}) {
+        tree->header.generation = generation;
+        saveTreeHeader(*tree);
+    }
+    // Records appended past the end of a file bypass the pool; they must be on
+    // disk before the log says the file is that long
+    for (int id = 0; id < WAL_FILE_COUNT; id++)
+        ok = fdatasync(walRecordFile(id).fd) == 0 && ok;
+    int pages = 0;
+    for (int id = 0; id < WAL_FILE_COUNT; id++) {
+        forEachDirtyPage(walRecordFile(id), [&](off_t offset, const char* data, size_t bytes) {
+            ok = walAppend(WAL_PAGE, id, offset, data, bytes) && ok;
+            pages++;
+        });
+    }
+    bool crash = pages > 0 && crashCheckpoint > 0 && --crashCheckpoint == 0;
+    if (crash && crashWhileLogging)
+        crashStop();
+    long long sizes[WAL_FILE_COUNT];
+    walFileSizes(sizes);
+    forEachDirtyGarbageBlock(masterGarbage, [&](off_t offset, const char* data, size_t bytes) {
+        ok = walAppend(WAL_GARBAGE, 0, offset, data, bytes) && ok;
+    });
+    forEachDirtyGarbageBlock(slaveGarbage, [&](off_t offset, const char* data, size_t bytes) {
+        ok = walAppend(WAL_GARBAGE, 1, offset, data, bytes) && ok;
+    });
+    CheckpointStamp stamp = makeStamp(generation);
+    ok = ok && walAppend(WAL_STAMP, 0, 0, &stamp, sizeof(stamp)) && walAppend(WAL_END, 0, 0, sizes, sizeof(sizes)) &&
+         walCommit();
+    if (!ok) {
+        std::cerr << "Error writing log file." << std::endl;
+        return false;
+    }
+    for (int id = 0; id < WAL_FILE_COUNT; id++) {
+        ok = flushRecordFile(walRecordFile(id)) && ok;
+        if (crash && id == 0)
+            crashStop();
+    }
+    ok = saveGarbage(masterGarbage) && ok;
+    ok = saveGarbage(slaveGarbage) && ok;
+    ok = writeStamp(stamp) && ok;
+    if (!ok) {
+        std::cerr << "Error writing checkpoint." << std::endl;
+        return false;
+    }
+    checkpointGeneration = generation;
+    checkpointNeeded = false;
+    filesChanged = false;
+    if (bookFilter.added > bookFilter.capacity)
+        rebuildBookFilter();
+    return walReset(sizes);
+}
+
+bool checkpoint() {
+    ExclusiveLatch engine(engineLatch);
+    return checkpointLocked();
+}
+
+// Bulk loads and the set-oriented commands (del-m-range, del-s-where, update-s-where)
+// change the files without logging, between two checkpoints taken with the engine latch
+// held throughout. If the closing one fails, the log does not cover what is in memory
+// and no operation may be committed on top of it: stop as a crash would, and let the
+// next start recover the state of the log.
+void failStop() {
+    std::cerr << "Error saving unlogged changes; stopping." << std::endl;
+    std::cout.flush();
+    _exit(1);
+}
+
+// Called between operations: checkpoint once a pool or the log has grown too much.
+void checkpointIfNeeded() {
+    if (checkpointNeeded || walSize > WAL_CHECKPOINT_BYTES)
+        checkpoint();
+}
+
+// Page image of a compressed file found by recoverFiles
+struct RecoveredPage {
+    int fileId;
+    long long offset;
+    std::vector<char> data;
+};
+
+std::vector<RecoveredPage> recoveredPages;
+long long recoveredSizes[WAL_FILE_COUNT] = {-1, -1, -1, -1, -1}; // Logged sizes of compressed files (-1: none)
+
+// Bring the files back to a consistent state before they are opened. The logical
+// records that still have to be replayed (see replayLog) are returned in ops, the
+// pages and sizes of compressed files are kept for applyRecoveredPages.
+bool recoverFiles(std::vector<WalOp> &ops) {
+    std::ifstream in(WAL_FILE, std::ios::binary | std::ios::ate);
+    if (!in)
+        return true;
+    std::vector<char> log((size_t)in.tellg());
+    in.seekg(0);
+    if (!in.read(log.data(), log.size()))
+        return false;
+    in.close();
+    // Read up to the end of the log or the first torn record
+    std::vector<size_t> records;
+    long long sizes[WAL_FILE_COUNT];
+    int sizesFrom = 0;  // WAL_BASE or WAL_END
+    size_t pos = 0;
+    while (pos + sizeof(WalHeader) <= log.size()) {
+        WalHeader header;
+        memcpy(&header, log.data() + pos, sizeof(WalHeader));
+        const char* payload = log.data() + pos + sizeof(WalHeader);
+        if (header.magic != WAL_MAGIC || header.length < 0 ||
+            (size_t)header.length > log.size() - pos - sizeof(WalHeader) ||
+            walChecksum(header, payload) != header.checksum)
+            break;
+        if ((header.type == WAL_BASE || header.type == WAL_END) && header.length == sizeof(sizes)) {
+            memcpy(sizes, payload, sizeof(sizes));
+            sizesFrom = header.type;
+        }
+        records.push_back(pos);
+        pos += sizeof(WalHeader) + header.length;
+    }
+    if (sizesFrom == 0)
+        return true;
+    if (sizesFrom == WAL_END)
+        std::cerr << "Completing an interrupted checkpoint from the log." << std::endl;
+    int fds[WAL_FILE_COUNT];
+    for (int id = 0; id < WAL_FILE_COUNT; id++) {
+        fds[id] = open(walFileName(id), O_RDWR | O_CREAT, 0644);
+        if (fds[id] < 0)
+            return false;
+    }
+    // Page images of a compressed file are kept for applyRecoveredPages (B.fl and BK.fl
+    // are files 0 and 1)
+    bool compressed[WAL_FILE_COUNT] = {};
+    for (int id = 0; id < 2; id++) {
+        FileHeader fileHeader;
+        compressed[id] = pread(fds[id], &fileHeader, sizeof(fileHeader), 0) == (ssize_t)sizeof(fileHeader) &&
+                         fileHeader.magic == FILE_MAGIC && (fileHeader.flags & FILE_COMPRESSED) != 0;
+    }
+    bool ok = true;
+    for (size_t at : records) {
+        WalHeader header;
+        memcpy(&header, log.data() + at, sizeof(WalHeader));
+        const char* payload = log.data() + at + sizeof(WalHeader);
+        if (sizesFrom == WAL_BASE && header.type == WAL_OP && header.length == sizeof(WalOp)) {
+            WalOp op;
+            memcpy(&op, payload, sizeof(WalOp));
+            ops.push_back(op);
+        } else if (sizesFrom == WAL_END && header.type == WAL_PAGE && header.fileId >= 0 &&
+                   header.fileId < WAL_FILE_COUNT && compressed[header.fileId]) {
+            recoveredPages.push_back({header.fileId, header.offset, std::vector<char>(payload, payload + header.length)});
+        } else if (sizesFrom == WAL_END && header.type == WAL_PAGE && header.fileId >= 0 &&
+                   header.fileId < WAL_FILE_COUNT) {
+            ok = pwrite(fds[header.fileId], payload, header.length, header.offset) == header.length && ok;
+        } else if (sizesFrom == WAL_END && header.type == WAL_GARBAGE) {
+            ok = writeGarbageBlock(header.fileId == 0 ? MASTER_GARBAGE_FILE : SLAVE_GARBAGE_FILE, header.offset,
+                                   payload, header.length) && ok;
+        } else if (sizesFrom == WAL_END && header.type == WAL_STAMP && header.length == sizeof(CheckpointStamp)) {
+            CheckpointStamp stamp;
+            memcpy(&stamp, payload, sizeof(CheckpointStamp));
+            ok = writeStamp(stamp) && ok;
+        }
+    }
+    // Drop whatever was written past the logged sizes (records of an unfinished bulk load)
+    for (int id = 0; id < WAL_FILE_COUNT; id++) {
+        if (compressed[id])
+            recoveredSizes[id] = sizes[id];
+        else
+            ok = ftruncate(fds[id], sizes[id]) == 0 && fdatasync(fds[id]) == 0 && ok;
+        close(fds[id]);
+    }
+    return ok;
+}
+
+// Apply what recoverFiles kept for the compressed files, once they are open: their
+// sizes, then the page images, which stay in the pool until the next checkpoint.
+bool applyRecoveredPages() {
+    for (int id = 0; id < WAL_FILE_COUNT; id++) {
+        if (recoveredSizes[id] < 0)
+            continue;
+        RecordFile &rf = walRecordFile(id);
+        int count = (recoveredSizes[id] - rf.dataOffset) / (long long)rf.recSize;
+        if (count < rf.recordCount)
+            truncateRecordFile(rf, count);
+        rf.recordCount = count;
+        recoveredSizes[id] = -1;
+    }
+    for (const RecoveredPage &page : recoveredPages) {
+        RecordFile &rf = walRecordFile(page.fileId);
+        int first = (page.offset - rf.dataOffset) / (long long)rf.recSize;
+        for (size_t i = 0; i < page.data.size() / rf.recSize; i++) {
+            char* p = fetchRecord(rf, first + i, true);
+            if (!p)
+                return false;
+            memcpy(p, page.data.data() + i * rf.recSize, rf.recSize);
+        }
+    }
+    recoveredPages.clear();
+    return true;
+}
+
+// ===================== SNAPSHOTS =====================
+// The reports (calc-*, ut-*, range-price, join) read a snapshot of the files they need
+// instead of holding engineLatch exclusively, so operations go on while they run and
+// a report still sees every record as it was at one moment. Opening a snapshot waits
+// for the operations in flight (engineLatch exclusive, briefly); after that, each page
+// of its files is saved on its first change (see preservePage), and the saved pages
+// are freed when the report ends.
+
+struct ReportSnapshot {
+    Snapshot snap;
+    BTreeHeader indexHeader;   // B.ind as it was (its nodes are in the snapshot if B.ind is)
+    int bookKeys;              // Keys of BK.ind
+    GarbageMap masterFree;     // The garbage lists as they were
+    GarbageMap slaveFree;
+
+    explicit ReportSnapshot(std::initializer_list<RecordFile*> files) {
+        ExclusiveLatch engine(engineLatch);
+        for (RecordFile* rf : files)
+            snap.files.push_back(SnapshotFile{rf, rf->recordCount, {}});
+        indexHeader = masterIndex.header;
+        bookKeys = phoneIsbnIndex.header.keyCount;
+        masterFree = masterGarbage;
+        slaveFree = slaveGarbage;
+        std::lock_guard<std::mutex> lock(snapshotLatch);
+        openSnapshots.push_back(&snap);
+        snapshotCount++;
+        snapshotsOpened++;
+    }
+
+    ~ReportSnapshot() {
+        std::lock_guard<std::mutex> lock(snapshotLatch);
+        openSnapshots.erase(std::find(openSnapshots.begin(), openSnapshots.end(), &snap));
+        snapshotCount--;
+    }
+
+    ReportSnapshot(const ReportSnapshot&) = delete;
+    ReportSnapshot &operator=(const ReportSnapshot&) = delete;
+
+    int records(const RecordFile &rf) const { return snapshotFile(snap, rf)->recordCount; }
+};
+
+// Call fn(entry) for the keys in [low, high] of B.ind as it was in the snapshot, in
+// key order. Returns false on a read error.
+template <typename Fn>
+bool snapshotIndexRange(const ReportSnapshot &rs, long long low, long long high, Fn fn) {
+    BTreeNode node;
+    int page = rs.indexHeader.root;
+    while (page != -1) {
+        if (!readSnapshotRecord(rs.snap, masterIndex.file, page, &node))
+            return false;
+        if (node.isLeaf)
+            break;
+        page = node.values[std::upper_bound(node.keys, node.keys + node.keyCount, low) - node.keys];
+    }
+    if (page == -1)
+        return true;
+    int slot = std::lower_bound(node.keys, node.keys + node.keyCount, low) - node.keys;
+    while (true) {
+        for (; slot < node.keyCount; slot++) {
+            if (node.keys[slot] > high)
+                return true;
+            fn(BTreeEntry{node.keys[slot], node.values[slot]});
+        }
+        if (node.next == -1)
+            return true;
+        if (!readSnapshotRecord(rs.snap, masterIndex.file, node.next, &node))
+            return false;
+        slot = 0;
+    }
+}
+
+// ===================== OPERATIONS =====================
+// Each command is split into an operation (below), which works on the files and
+// indexes and reports an OpStatus, and a command handler (further down), which
+// prompts for the input and prints the result. Batch mode calls the operations directly.
+
+enum OpStatus {
+    OP_OK,
+    OP_BUYER_NOT_FOUND,
+    OP_BUYER_DELETED,
+    OP_BOOK_NOT_FOUND,
+    OP_DUPLICATE,
+    OP_INVALID_FIELD,
+    OP_IO_ERROR
+};
+
+// Field numbers for update-m / update-s (the same as in the interactive menus)
+const int FIELD_NAME = 1;
+const int FIELD_ADDRESS = 2;   // update-m
+const int FIELD_AUTHOR = 2;    // update-s
+const int FIELD_PRICE = 3;     // update-s
+
+// Copy a string into a fixed-length char field, truncating it if necessary.
+void copyField(char (&dest)[31], const std::string &value) {
+    strncpy(dest, value.c_str(), sizeof(dest) - 1);
+    dest[sizeof(dest) - 1] = '\0';
+}
+
+// With --extents, each buyer's books are placed in runs of consecutive BK.fl records
+// (extents), so that walking a chain reads a few pages instead of one per book. The
+// unused records of an extent are deleted records reserved for the buyer: nextBook is
+// EXTENT_RESERVED and phone is the buyer's. They are not in the garbage zone; vacuum
+// fills or cuts them like any other hole, and deleting the buyer releases them.
+const int EXTENT_MIN_RECORDS = 4;
+const int EXTENT_MAX_RECORDS = RECORDS_PER_PAGE;
+const int EXTENT_RESERVED = -2;
+
+bool extentReserved(const Book &bookRec, int phone) {
+    return bookRec.valid == 0 && bookRec.nextBook == EXTENT_RESERVED && bookRec.phone == phone;
+}
+
+// Take a reserved record of the buyer's extent, or append a new extent twice as large
+// (firstExtent and extentCount are updated). Returns -1 on I/O error.
+int takeExtentRecord(int phone, int &firstExtent, int &extentCount) {
+    int end = std::min(firstExtent + extentCount, fileRecordCount(slaveFile));
+    for (int recNum = std::max(firstExtent, 0); recNum < end; recNum++) {
+        bool reserved = false;
+        if (!visitBook(recNum, [&](const Book &rec) { reserved = extentReserved(rec, phone); }))
+            return -1;
+        if (reserved)
+            return recNum;
+    }
+    int size = std::min(std::max(extentCount * 2, EXTENT_MIN_RECORDS), EXTENT_MAX_RECORDS);
+    std::vector<Book> records(size);
+    for (Book &rec : records) {
+        memset(&rec, 0, sizeof(Book));
+        rec.phone = phone;
+        rec.nextBook = EXTENT_RESERVED;
+    }
+    int first = appendRecord(slaveFile, records.data(), size);
+    if (first == -1)
+        return -1;
+    firstExtent = first;
+    extentCount = size;
+    return first;
+}
+
+// Return the reserved records of a deleted buyer's extent to the garbage zone.
+bool releaseExtent(int phone, int firstExtent, int extentCount) {
+    int end = std::min(firstExtent + extentCount, fileRecordCount(slaveFile));
+    for (int recNum = std::max(firstExtent, 0); recNum < end; recNum++) {
+        bool reserved = false;
+        if (!updateBook(recNum, [&](Book &rec) {
+                reserved = extentReserved(rec, phone);
+                if (reserved)
+                    rec.nextBook = -1;
+            }))
+            return false;
+        if (reserved)
+            addGarbage(slaveGarbage, recNum);
+    }
+    return true;
+}
+
+// Hot buyers are cached as objects keyed by phone: the Buyer and, once a book of it
+// has been asked for, its whole chain of Book records (head first). Lookups on a
+// cached phone touch neither the indexes nor the pool. The cache has CACHE_SHARDS
+// shards (by phone, each with its own latch), each keeping its entries in LRU order
+// within its share of --cache-mb megabytes (0 disables the cache).
+// Filling an entry walks the chain, which costs more than one index lookup, so a
+// phone is only admitted on its second miss in a while: each shard remembers the last
+// phone that missed in each of CACHE_GHOST_SLOTS slots. Traffic without hot phones
+// thus goes the usual way and pays one latch and one probe per lookup.
+// An entry is only filled under its buyer's chain latch, and every mutation drops the
+// entry of its buyer under that latch before it changes anything, so a cached entry
+// always matches the files. Bulk book loads and vacuum, which move records of many
+// buyers, clear the whole cache.
+const int RECORD_CACHE_MB = 16;
+const int CACHE_SHARDS = 16;
+const int CACHE_GHOST_SLOTS = 256;        // Recently missed phones remembered per shard
+const size_t CACHE_ENTRY_OVERHEAD = 64;   // Bytes charged per entry for the map and LRU nodes
+
+struct CachedBuyer {
+    Buyer buyer;
+    bool chainLoaded;
+    std::vector<Book> books;              // The chain, head first (if chainLoaded)
+    std::list<int>::iterator lru;
+};
+
+struct CacheShard {
+    std::mutex latch;
+    std::unordered_map<int, CachedBuyer> entries;
+    std::list<int> lru;                   // Phones, most recently used first
+    std::vector<int> ghosts;              // Last phone that missed, per slot (INT_MIN if none)
+    size_t bytes;
+    long long hits;
+    long long misses;
+};
+
+size_t cacheCapacity = (size_t)RECORD_CACHE_MB << 20;   // Bytes for all shards (--cache-mb)
+CacheShard cacheShards[CACHE_SHARDS];
+
+CacheShard &cacheShard(int phone) {
+    return cacheShards[(unsigned int)phone % CACHE_SHARDS];
+}
+
+size_t cacheEntryBytes(const CachedBuyer &entry) {
+    return sizeof(CachedBuyer) + CACHE_ENTRY_OVERHEAD + entry.books.size() * sizeof(Book);
+}
+
+// Whether an entry with that many books may be cached: one must not take more than a
+// quarter of its shard's share.
+bool cacheFits(size_t books) {
+    return sizeof(CachedBuyer) + CACHE_ENTRY_OVERHEAD + books * sizeof(Book) <= cacheCapacity / CACHE_SHARDS / 4;
+}
+
+void eraseCacheEntry(CacheShard &shard, std::unordered_map<int, CachedBuyer>::iterator it) {
+    shard.bytes -= cacheEntryBytes(it->second);
+    shard.lru.erase(it->second.lru);
+    shard.entries.erase(it);
+}
+
+// Call fn(entry) under the shard latch if phone is cached (with its chain if needChain)
+// and return true. On a miss, admit is set if the phone should now be loaded.
+template <typename Fn>
+bool cacheGet(int phone, bool needChain, bool &admit, Fn fn) {
+    CacheShard &shard = cacheShard(phone);
+    std::lock_guard<std::mutex> latch(shard.latch);
+    auto it = shard.entries.find(phone);
+    if (it != shard.entries.end() && (!needChain || it->second.chainLoaded)) {
+        shard.hits++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+        fn(it->second);
+        return true;
+    }
+    shard.misses++;
+    if (shard.ghosts.empty())
+        shard.ghosts.assign(CACHE_GHOST_SLOTS, INT_MIN);
+    int &ghost = shard.ghosts[((unsigned int)phone / CACHE_SHARDS) % CACHE_GHOST_SLOTS];
+    // A buyer cached without its chain is loaded again only if the chain can be cached
+    admit = it != shard.entries.end() ? cacheFits(it->second.buyer.bookCount) : ghost == phone;
+    ghost = phone;
+    return false;
+}
+
+// Cache an entry (the caller holds the buyer's chain latch), evicting the least
+// recently used ones past the shard's share of the capacity.
+void cachePut(int phone, const CachedBuyer &entry) {
+    size_t capacity = cacheCapacity / CACHE_SHARDS;
+    if (!cacheFits(entry.books.size()))
+        return;
+    CacheShard &shard = cacheShard(phone);
+    std::lock_guard<std::mutex> latch(shard.latch);
+    auto it = shard.entries.find(phone);
+    if (it != shard.entries.end())
+        eraseCacheEntry(shard, it);
+    shard.lru.push_front(phone);
+    CachedBuyer &stored = shard.entries[phone];
+    stored = entry;
+    stored.lru = shard.lru.begin();
+    shard.bytes += cacheEntryBytes(stored);
+    while (shard.bytes > capacity)
+        eraseCacheEntry(shard, shard.entries.find(shard.lru.back()));
+}
+
+// Drop the entry of a buyer about to change (the caller holds its chain latch).
+void cacheErase(int phone) {
+    if (cacheCapacity == 0)
+        return;
+    CacheShard &shard = cacheShard(phone);
+    std::lock_guard<std::mutex> latch(shard.latch);
+    auto it = shard.entries.find(phone);
+    if (it != shard.entries.end())
+        eraseCacheEntry(shard, it);
+}
+
+void cacheClear() {
+    for (CacheShard &shard : cacheShards) {
+        std::lock_guard<std::mutex> latch(shard.latch);
+        shard.entries.clear();
+        shard.lru.clear();
+        shard.bytes = 0;
+    }
+}
+
+const int CHAIN_PREFETCH_MIN = 16;  // Books of a chain from which its pages are prefetched
+
+// Queue the pages holding a buyer's books, found through BK.ind, before its chain is
+// walked. Short chains are left alone: their pages are read as quickly on demand.
+void prefetchChain(int phone, int bookCount) {
+    if (bookCount < CHAIN_PREFETCH_MIN || (ioThreads.empty() && !slaveFile.map))
+        return;
+    std::vector<BTreeEntry> entries;
+    {
+        SharedLatch shared(phoneIsbnIndex.latch);
+        // Unsigned low halves: the keys of the buyer run from (phone, 0) to (phone, -1)
+        btreeRange(phoneIsbnIndex, compositeKey(phone, 0), compositeKey(phone, -1),
+                   (size_t)poolFrames / 4 * RECORDS_PER_PAGE, entries);
+    }
+    std::vector<int> pages;
+    for (const BTreeEntry &entry : entries)
+        pages.push_back(entry.value / RECORDS_PER_PAGE);
+    prefetchPages(slaveFile, pages);
+}
+
+// Read a buyer (and its chain if withChain, unless it is too long to cache) into entry
+// and cache it. The caller holds the engine latch shared; the chain latch is taken here.
+OpStatus loadCachedBuyer(int phone, bool withChain, CachedBuyer &entry) {
+    std::lock_guard<std::mutex> chain(chainLatch(phone));
+    int recNum = indexFind(phone);
+    if (recNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    if (!readBuyer(recNum, entry.buyer))
+        return OP_IO_ERROR;
+    if (entry.buyer.phone != phone)
+        return OP_BUYER_NOT_FOUND;
+    if (entry.buyer.valid == 0)
+        return OP_BUYER_DELETED;
+    entry.chainLoaded = withChain && cacheFits(entry.buyer.bookCount);
+    entry.books.clear();
+    if (entry.chainLoaded) {
+        prefetchChain(phone, entry.buyer.bookCount);
+        Book bookRec;
+        for (int bookNum = entry.buyer.firstBook; bookNum != -1; bookNum = bookRec.nextBook) {
+            if (!readBook(bookNum, bookRec))
+                return OP_IO_ERROR;
+            ioTally.chainHops++;
+            entry.books.push_back(bookRec);
+        }
+    }
+    cachePut(phone, entry);
+    return OP_OK;
+}
+
+// Lookups take no chain latch (except to fill the cache). A record found through the
+// index may have been deleted and reused since, so its key is checked again in place
+// before it is copied out.
+OpStatus opGetMaster(int phone, Buyer &buyer) {
+    OpTimer timer(STAT_GET_M);
+    SharedLatch engine(engineLatch);
+    bool admit = false;
+    if (cacheCapacity > 0 && cacheGet(phone, false, admit, [&](const CachedBuyer &entry) { buyer = entry.buyer; }))
+        return OP_OK;
+    if (admit) {
+        CachedBuyer entry;
+        OpStatus status = loadCachedBuyer(phone, false, entry);
+        if (status == OP_OK)
+            buyer = entry.buyer;
+        return status;
+    }
+    int recNum = indexFind(phone);
+    if (recNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    OpStatus status = OP_OK;
+    bool ok = visitBuyer(recNum, [&](const Buyer &rec) {
+        if (rec.phone != phone)
+            status = OP_BUYER_NOT_FOUND;
+        else if (rec.valid == 0)
+            status = OP_BUYER_DELETED;
+        else
+            buyer = rec;
+    });
+    return ok ? status : OP_IO_ERROR;
+}
+
+OpStatus opGetSlave(int phone, int ISBN, Book &bookRec) {
+    OpTimer timer(STAT_GET_S);
+    SharedLatch engine(engineLatch);
+    auto findBook = [&](const CachedBuyer &entry) {
+        for (const Book &rec : entry.books) {
+            if (rec.ISBN == ISBN) {
+                bookRec = rec;
+                return OP_OK;
+            }
+        }
+        return OP_BOOK_NOT_FOUND;
+    };
+    bool admit = false;
+    OpStatus status = OP_OK;
+    if (cacheCapacity > 0 && cacheGet(phone, true, admit, [&](const CachedBuyer &entry) { status = findBook(entry); }))
+        return status;
+    if (admit) {
+        CachedBuyer entry;
+        status = loadCachedBuyer(phone, true, entry);
+        // A deleted buyer found in place counts as absent, as through the index below
+        if (status != OP_OK)
+            return status == OP_BUYER_DELETED ? OP_BUYER_NOT_FOUND : status;
+        if (entry.chainLoaded)
+            return findBook(entry);
+        // The chain is too long to cache: look the book up through the index
+    }
+    // Deleted buyers are removed from the index, so this also covers them
+    if (indexFind(phone) == -1)
+        return OP_BUYER_NOT_FOUND;
+    int recNum = bookIndexFind(phone, ISBN);
+    if (recNum == -1)
+        return OP_BOOK_NOT_FOUND;
+    status = OP_OK;
+    bool ok = visitBook(recNum, [&](const Book &rec) {
+        if (rec.valid == 0 || rec.phone != phone || rec.ISBN != ISBN)
+            status = OP_BOOK_NOT_FOUND;
+        else
+            bookRec = rec;
+    });
+    return ok ? status : OP_IO_ERROR;
+}
+
+// Delete a buyer and all of its books.
+OpStatus opDelMaster(int phone) {
+    OpTimer timer(STAT_DEL_M);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(phone));
+    cacheErase(phone);
+    int buyerRecNum = indexFind(phone);
+    if (buyerRecNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    bool valid = false;
+    int bookIndex = -1;
+    int bookCount = 0;
+    int firstExtent = -1;
+    int extentCount = 0;
+    if (!visitBuyer(buyerRecNum, [&](const Buyer &rec) {
+            valid = rec.valid == 1;
+            bookIndex = rec.firstBook;
+            bookCount = rec.bookCount;
+            firstExtent = rec.firstExtent;
+            extentCount = rec.extentCount;
+        }))
+        return OP_IO_ERROR;
+    if (!valid)
+        return OP_BUYER_DELETED;
+    prefetchChain(phone, bookCount);
+    if (!walLogOp(walOp(WAL_DEL_M, phone, 0)))
+        return OP_IO_ERROR;
+    // Delete all subordinate book records
+    while (bookIndex != -1) {
+        bool live = false;
+        int ISBN = 0;
+        int next = -1;
+        if (!updateBook(bookIndex, [&](Book &rec) {
+                live = rec.valid == 1;
+                rec.valid = 0;
+                ISBN = rec.ISBN;
+                next = rec.nextBook;
+            }))
+            return OP_IO_ERROR;
+        ioTally.chainHops++;
+        if (live) {
+            bookIndexErase(phone, ISBN);
+            addGarbage(slaveGarbage, bookIndex);
+        }
+        bookIndex = next;
+    }
+    if (!releaseExtent(phone, firstExtent, extentCount))
+        return OP_IO_ERROR;
+    // Mark buyer record as deleted and remove it from the index
+    updateBuyer(buyerRecNum, [](Buyer &rec) { rec.valid = 0; });
+    indexErase(phone);
+    addGarbage(masterGarbage, buyerRecNum);
+    return OP_OK;
+}
+
+// Delete one book and unlink it from its buyer's chain.
+OpStatus opDelSlave(int phone, int ISBN) {
+    OpTimer timer(STAT_DEL_S);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(phone));
+    cacheErase(phone);
+    int buyerRecNum = indexFind(phone);
+    if (buyerRecNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    // Deleted buyers are removed from the index, so a missing book is all that is left
+    if (!bookMayExist(phone, ISBN))
+        return OP_BOOK_NOT_FOUND;
+    bool valid = false;
+    int firstBook = -1;
+    int bookCount = 0;
+    if (!visitBuyer(buyerRecNum, [&](const Buyer &rec) {
+            valid = rec.valid == 1;
+            firstBook = rec.firstBook;
+            bookCount = rec.bookCount;
+        }))
+        return OP_IO_ERROR;
+    if (!valid)
+        return OP_BUYER_DELETED;
+    int targetIndex = bookIndexFind(phone, ISBN);
+    if (targetIndex == -1)
+        return OP_BOOK_NOT_FOUND;
+    prefetchChain(phone, bookCount);
+    int targetNext = -1;
+    if (!visitBook(targetIndex, [&](const Book &rec) { targetNext = rec.nextBook; }))
+        return OP_IO_ERROR;
+    if (!walLogOp(walOp(WAL_DEL_S, phone, ISBN)))
+        return OP_IO_ERROR;
+    // The chain is singly linked, so the predecessor still has to be found by walking it
+    int currentIndex = firstBook;
+    int prevIndex = -1;
+    while (currentIndex != -1 && currentIndex != targetIndex) {
+        int nextIndex;
+        if (!visitBook(currentIndex, [&](const Book &rec) { nextIndex = rec.nextBook; }))
+            return OP_IO_ERROR;
+        ioTally.chainHops++;
+        prevIndex = currentIndex;
+        currentIndex = nextIndex;
+    }
+    // Unlink it from the buyer (first record in the chain) or from the previous record
+    if (prevIndex != -1 && !updateBook(prevIndex, [&](Book &rec) { rec.nextBook = targetNext; }))
+        return OP_IO_ERROR;
+    updateBuyer(buyerRecNum, [&](Buyer &rec) {
+        if (prevIndex == -1)
+            rec.firstBook = targetNext;
+        rec.bookCount--;
+    });
+    updateBook(targetIndex, [](Book &rec) { rec.valid = 0; });
+    bookIndexErase(phone, ISBN);
+    addGarbage(slaveGarbage, targetIndex);
+    return OP_OK;
+}
+
+// Set one non-key field of a buyer (FIELD_NAME or FIELD_ADDRESS).
+OpStatus opUpdateMaster(int phone, int field, const std::string &value) {
+    OpTimer timer(STAT_UPDATE_M);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(phone));
+    cacheErase(phone);
+    int recNum = indexFind(phone);
+    if (recNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    bool valid = false;
+    if (!visitBuyer(recNum, [&](const Buyer &rec) { valid = rec.valid == 1; }))
+        return OP_IO_ERROR;
+    if (!valid)
+        return OP_BUYER_DELETED;
+    if (field != FIELD_NAME && field != FIELD_ADDRESS)
+        return OP_INVALID_FIELD;
+    WalOp op = walOp(WAL_UPDATE_M, phone, 0);
+    op.field = field;
+    copyField(op.text1, value);
+    if (!walLogOp(op))
+        return OP_IO_ERROR;
+    bool ok = updateBuyer(recNum, [&](Buyer &rec) {
+        copyField(field == FIELD_NAME ? rec.name : rec.address, value);
+    });
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Set one non-key field of a book (FIELD_NAME, FIELD_AUTHOR or FIELD_PRICE).
+OpStatus opUpdateSlave(int phone, int ISBN, int field, const std::string &value) {
+    OpTimer timer(STAT_UPDATE_S);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(phone));
+    cacheErase(phone);
+    if (indexFind(phone) == -1)
+        return OP_BUYER_NOT_FOUND;
+    int recNum = bookIndexFind(phone, ISBN);
+    if (recNum == -1)
+        return OP_BOOK_NOT_FOUND;
+    if (field != FIELD_NAME && field != FIELD_AUTHOR && field != FIELD_PRICE)
+        return OP_INVALID_FIELD;
+    WalOp op = walOp(WAL_UPDATE_S, phone, ISBN);
+    op.field = field;
+    copyField(op.text1, value);
+    if (!walLogOp(op))
+        return OP_IO_ERROR;
+    bool ok = updateBook(recNum, [&](Book &rec) {
+        switch (field) {
+            case FIELD_NAME:   copyField(rec.name, value); break;
+            case FIELD_AUTHOR: copyField(rec.author, value); break;
+            case FIELD_PRICE:  rec.price = atof(value.c_str()); break;
+        }
+    });
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Insert a buyer (phone, name and address must be set), using the master garbage zone if available.
+OpStatus opInsertMaster(Buyer &buyer, int &recNum) {
+    OpTimer timer(STAT_INSERT_M);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(buyer.phone));
+    if (indexFind(buyer.phone) != -1)
+        return OP_DUPLICATE;
+    WalOp op = walOp(WAL_INSERT_M, buyer.phone, 0);
+    memcpy(op.text1, buyer.name, sizeof(op.text1));
+    memcpy(op.text2, buyer.address, sizeof(op.text2));
+    if (!walLogOp(op))
+        return OP_IO_ERROR;
+    buyer.firstBook = -1;
+    buyer.bookCount = 0;
+    buyer.firstExtent = -1;
+    buyer.extentCount = 0;
+    buyer.valid = 1;
+    // Use a free record from masterGarbage if available.
+    recNum = takeGarbage(masterGarbage);
+    if (recNum != -1) {
+        if (!writeBuyer(recNum, buyer)) {
+            addGarbage(masterGarbage, recNum);
+            return OP_IO_ERROR;
+        }
+    } else {
+        recNum = appendBuyer(buyer);
+        if (recNum == -1)
+            return OP_IO_ERROR;
+    }
+    // Update the index.
+    return indexInsert(buyer.phone, recNum) ? OP_OK : OP_IO_ERROR;
+}
+
+// Insert a book (phone, ISBN, name, author and price must be set) as the first record
+// in its buyer's chain, in the buyer's extent with --extents, otherwise using the
+// slave garbage zone if available.
+OpStatus opInsertSlave(Book &bookRec, int &recNum) {
+    OpTimer timer(STAT_INSERT_S);
+    SharedLatch engine(engineLatch);
+    std::lock_guard<std::mutex> chain(chainLatch(bookRec.phone));
+    cacheErase(bookRec.phone);
+    int buyerRecNum = indexFind(bookRec.phone);
+    if (buyerRecNum == -1)
+        return OP_BUYER_NOT_FOUND;
+    bool valid = false;
+    int firstBook = -1;
+    int firstExtent = -1;
+    int extentCount = 0;
+    if (!visitBuyer(buyerRecNum, [&](const Buyer &rec) {
+            valid = rec.valid == 1;
+            firstBook = rec.firstBook;
+            firstExtent = rec.firstExtent;
+            extentCount = rec.extentCount;
+        }))
+        return OP_IO_ERROR;
+    if (!valid)
+        return OP_BUYER_DELETED;
+    if (bookIndexFind(bookRec.phone, bookRec.ISBN) != -1)
+        return OP_DUPLICATE;
+    WalOp op = walOp(WAL_INSERT_S, bookRec.phone, bookRec.ISBN);
+    memcpy(op.text1, bookRec.name, sizeof(op.text1));
+    memcpy(op.text2, bookRec.author, sizeof(op.text2));
+    op.price = bookRec.price;
+    if (!walLogOp(op))
+        return OP_IO_ERROR;
+    bookRec.nextBook = firstBook; // New record becomes the first in the chain.
+    bookRec.valid = 1;
+    if (useExtents) {
+        recNum = takeExtentRecord(bookRec.phone, firstExtent, extentCount);
+        if (recNum == -1 || !writeBook(recNum, bookRec))
+            return OP_IO_ERROR;
+    } else if ((recNum = takeGarbage(slaveGarbage, firstBook)) != -1) {
+        if (!writeBook(recNum, bookRec)) {
+            addGarbage(slaveGarbage, recNum);
+            return OP_IO_ERROR;
+        }
+    } else {
+        recNum = appendBook(bookRec);
+        if (recNum == -1)
+            return OP_IO_ERROR;
+    }
+    if (!bookIndexInsert(bookRec.phone, bookRec.ISBN, recNum))
+        return OP_IO_ERROR;
+    // Update the buyer record: new book becomes the first, increment bookCount.
+    bool ok = updateBuyer(buyerRecNum, [&](Buyer &rec) {
+        rec.firstBook = recNum;
+        rec.bookCount++;
+        rec.firstExtent = firstExtent;
+        rec.extentCount = extentCount;
+    });
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Set-oriented commands change every record that matches a predicate in one pass:
+// del-m-range deletes the buyers in a phone range with their books, del-s-where and
+// update-s-where delete or change the books whose field equals a value. The records
+// are found by index range scans (B.ind and BK.ind) or by one parallel BK.fl scan,
+// then changed in record order, so each page is fetched and written once, and the
+// indexes drop their keys in one bulk step. Like the batch bulk loads, they are not
+// logged: each runs between two checkpoints with the engine latch held exclusively,
+// so after a crash it has happened completely or not at all.
+
+// Predicate on one field of a book (FIELD_NAME, FIELD_AUTHOR or FIELD_PRICE)
+struct BookMatch {
+    int field;
+    char text[31];   // FIELD_NAME, FIELD_AUTHOR: truncated like a stored field
+    double price;    // FIELD_PRICE
+};
+
+bool makeBookMatch(int field, const std::string &value, BookMatch &match) {
+    if (field != FIELD_NAME && field != FIELD_AUTHOR && field != FIELD_PRICE)
+        return false;
+    match.field = field;
+    copyField(match.text, value);
+    match.price = atof(value.c_str());
+    return true;
+}
+
+bool bookMatches(const Book &rec, const BookMatch &match) {
+    if (rec.valid != 1)
+        return false;
+    switch (match.field) {
+        case FIELD_NAME:   return strcmp(rec.name, match.text) == 0;
+        case FIELD_AUTHOR: return strcmp(rec.author, match.text) == 0;
+        default:           return rec.price == match.price;
+    }
+}
+
+// The (phone, ISBN) keys and record numbers of the matching books, in key order.
+bool findBooks(const BookMatch &match, std::vector<BTreeEntry> &found) {
+    std::vector<std::vector<BTreeEntry>> parts(scanThreads);
+    bool ok = parallelScan<Book>(slaveFile, 0, slaveFile.recordCount,
+                                 [&](int w, int first, const Book* books, int count) {
+        for (int i = 0; i < count; i++)
+            if (bookMatches(books[i], match))
+                parts[w].push_back(BTreeEntry{compositeKey(books[i].phone, books[i].ISBN), first + i});
+    });
+    if (ok)
+        found = sortParts(parts);
+    return ok;
+}
+
+// Delete books, given as (phone, ISBN) keys with their record numbers in key order,
+// and drop their keys from BK.ind and BK.isbn. The caller has unlinked them.
+bool eraseBooks(const std::vector<BTreeEntry> &books) {
+    std::vector<BTreeEntry> byRecord = books;
+    std::sort(byRecord.begin(), byRecord.end(), [](const BTreeEntry &a, const BTreeEntry &b) {
+        return a.value < b.value;
+    });
+    bool ok = true;
+    for (const BTreeEntry &entry : byRecord) {
+        ok = updateBook(entry.value, [](Book &rec) { rec.valid = 0; }) && ok;
+        addGarbage(slaveGarbage, entry.value);
+    }
+    std::vector<long long> phoneKeys, isbnKeys;
+    for (const BTreeEntry &entry : books) {
+        phoneKeys.push_back(entry.key);
+        isbnKeys.push_back(compositeKey(compositeLow(entry.key), compositeHigh(entry.key)));
+    }
+    std::sort(isbnKeys.begin(), isbnKeys.end());
+    ok = btreeBulkErase(phoneIsbnIndex, phoneKeys) && ok;
+    return btreeBulkErase(isbnPhoneIndex, isbnKeys) && ok;
+}
+
+// Delete the buyers with phone in [low, high] and all their books.
+OpStatus opDelMasterRange(int low, int high, int &buyers, int &books) {
+    OpTimer timer(STAT_DEL_M_RANGE);
+    buyers = 0;
+    books = 0;
+    ExclusiveLatch engine(engineLatch);
+    if (!checkpointLocked())
+        return OP_IO_ERROR;
+    std::vector<BTreeEntry> buyerEntries, bookEntries;
+    BTreeEntry entry;
+    IndexCursor cursor = btreeSeek(masterIndex, low);
+    while (btreeNext(masterIndex, cursor, entry) && entry.key <= high)
+        buyerEntries.push_back(entry);
+    // Unsigned low halves: the keys of phones low..high run from (low, 0) to (high, -1)
+    cursor = btreeSeek(phoneIsbnIndex, compositeKey(low, 0));
+    while (btreeNext(phoneIsbnIndex, cursor, entry) && entry.key <= compositeKey(high, -1))
+        bookEntries.push_back(entry);
+    bool ok = eraseBooks(bookEntries);
+    std::vector<BTreeEntry> byRecord = buyerEntries;
+    std::sort(byRecord.begin(), byRecord.end(), [](const BTreeEntry &a, const BTreeEntry &b) {
+        return a.value < b.value;
+    });
+    for (const BTreeEntry &buyer : byRecord) {
+        int phone = (int)buyer.key;
+        int firstExtent = -1;
+        int extentCount = 0;
+        ok = updateBuyer(buyer.value, [&](Buyer &rec) {
+            firstExtent = rec.firstExtent;
+            extentCount = rec.extentCount;
+            rec.valid = 0;
+        }) && ok;
+        ok = releaseExtent(phone, firstExtent, extentCount) && ok;
+        addGarbage(masterGarbage, buyer.value);
+        cacheErase(phone);
+    }
+    std::vector<long long> phones;
+    for (const BTreeEntry &buyer : buyerEntries)
+        phones.push_back(buyer.key);
+    ok = btreeBulkErase(masterIndex, phones) && ok;
+    buyers = buyerEntries.size();
+    books = bookEntries.size();
+    if (!checkpointLocked())
+        failStop();
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Delete the books whose field equals value, unlinking them from their buyers' chains
+// (each chain is walked and each buyer rewritten once).
+OpStatus opDelSlaveWhere(int field, const std::string &value, int &books) {
+    OpTimer timer(STAT_DEL_S_WHERE);
+    books = 0;
+    BookMatch match;
+    if (!makeBookMatch(field, value, match))
+        return OP_INVALID_FIELD;
+    ExclusiveLatch engine(engineLatch);
+    if (!checkpointLocked())
+        return OP_IO_ERROR;
+    std::vector<BTreeEntry> found;
+    if (!findBooks(match, found))
+        return OP_IO_ERROR;
+    bool ok = true;
+    // The keys are ordered by phone, so each buyer's books are adjacent
+    for (size_t first = 0; first < found.size(); ) {
+        int phone = compositeHigh(found[first].key);
+        size_t last = first;
+        std::vector<int> removed;
+        while (last < found.size() && compositeHigh(found[last].key) == phone)
+            removed.push_back(found[last++].value);
+        std::sort(removed.begin(), removed.end());
+        first = last;
+        cacheErase(phone);
+        int buyerRecNum = btreeFind(masterIndex, phone);
+        int firstBook = -1;
+        if (buyerRecNum == -1 || !visitBuyer(buyerRecNum, [&](const Buyer &rec) { firstBook = rec.firstBook; }))
+            continue;
+        int prev = -1;
+        int unlinked = 0;
+        for (int recNum = firstBook; recNum != -1; ) {
+            int next = -1;
+            if (!visitBook(recNum, [&](const Book &rec) { next = rec.nextBook; })) {
+                ok = false;
+                break;
+            }
+            ioTally.chainHops++;
+            if (!std::binary_search(removed.begin(), removed.end(), recNum)) {
+                prev = recNum;
+            } else if (prev == -1) {
+                firstBook = next;
+                unlinked++;
+            } else {
+                ok = updateBook(prev, [&](Book &rec) { rec.nextBook = next; }) && ok;
+                unlinked++;
+            }
+            recNum = next;
+        }
+        ok = updateBuyer(buyerRecNum, [&](Buyer &rec) {
+            rec.firstBook = firstBook;
+            rec.bookCount -= unlinked;
+        }) && ok;
+    }
+    ok = eraseBooks(found) && ok;
+    books = found.size();
+    if (!checkpointLocked())
+        failStop();
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Set newField to newValue in the books whose field equals value.
+OpStatus opUpdateSlaveWhere(int field, const std::string &value, int newField, const std::string &newValue,
+                            int &books) {
+    OpTimer timer(STAT_UPDATE_S_WHERE);
+    books = 0;
+    BookMatch match;
+    if (!makeBookMatch(field, value, match) ||
+        (newField != FIELD_NAME && newField != FIELD_AUTHOR && newField != FIELD_PRICE))
+        return OP_INVALID_FIELD;
+    ExclusiveLatch engine(engineLatch);
+    if (!checkpointLocked())
+        return OP_IO_ERROR;
+    std::vector<BTreeEntry> found;
+    if (!findBooks(match, found))
+        return OP_IO_ERROR;
+    std::sort(found.begin(), found.end(), [](const BTreeEntry &a, const BTreeEntry &b) { return a.value < b.value; });
+    cacheClear();
+    bool ok = true;
+    for (const BTreeEntry &entry : found) {
+        ok = updateBook(entry.value, [&](Book &rec) {
+            switch (newField) {
+                case FIELD_NAME:   copyField(rec.name, newValue); break;
+                case FIELD_AUTHOR: copyField(rec.author, newValue); break;
+                case FIELD_PRICE:  rec.price = atof(newValue.c_str()); break;
+            }
+        }) && ok;
+    }
+    books = found.size();
+    if (!checkpointLocked())
+        failStop();
+    return ok ? OP_OK : OP_IO_ERROR;
+}
+
+// Re-run the operations left in the log by a crash (see recoverFiles). They see
+// the same files, indexes and garbage lists as the first time, so they have the same effect.
+void replayLog(const std::vector<WalOp> &ops) {
+    walReplaying = true;
+    for (const WalOp &op : ops) {
+        int recNum;
+        if (op.opcode == WAL_INSERT_M) {
+            Buyer buyer;
+            memset(&buyer, 0, sizeof(Buyer));
+            buyer.phone = op.phone;
+            memcpy(buyer.name, op.text1, sizeof(buyer.name));
+            memcpy(buyer.address, op.text2, sizeof(buyer.address));
+            opInsertMaster(buyer, recNum);
+        } else if (op.opcode == WAL_INSERT_S) {
+            Book bookRec;
+            memset(&bookRec, 0, sizeof(Book));
+            bookRec.phone = op.phone;
+            bookRec.ISBN = op.ISBN;
+            memcpy(bookRec.name, op.text1, sizeof(bookRec.name));
+            memcpy(bookRec.author, op.text2, sizeof(bookRec.author));
+            bookRec.price = op.price;
+            opInsertSlave(bookRec, recNum);
+        } else if (op.opcode == WAL_DEL_M) {
+            opDelMaster(op.phone);
+        } else if (op.opcode == WAL_DEL_S) {
+            opDelSlave(op.phone, op.ISBN);
+        } else if (op.opcode == WAL_UPDATE_M) {
+            opUpdateMaster(op.phone, op.field, op.text1);
+        } else if (op.opcode == WAL_UPDATE_S) {
+            opUpdateSlave(op.phone, op.ISBN, op.field, op.text1);
+        }
+    }
+    walReplaying = false;
+    if (!ops.empty())
+        std::cerr << "Recovered " << ops.size() << " operations from the log." << std::endl;
+}
+
+// Commit a successful mutation on its own (the interactive prompt reports each one as it completes).
+OpStatus commitOp(OpStatus status) {
+    if (status == OP_OK && !walCommit())
+        return OP_IO_ERROR;
+    return status;
+}
+
+// Print the message for an operation that did not succeed.
+void printStatus(OpStatus status) {
+    switch (status) {
+        case OP_OK:
+            break;
+        case OP_BUYER_NOT_FOUND:
+            std::cout << "Buyer not found." << std::endl;
+            break;
+        case OP_BUYER_DELETED:
+            std::cout << "Buyer record is deleted." << std::endl;
+            break;
+        case OP_BOOK_NOT_FOUND:
+            std::cout << "Book record not found." << std::endl;
+            break;
+        case OP_DUPLICATE:
+            std::cout << "Record with this key already exists." << std::endl;
+            break;
+        case OP_INVALID_FIELD:
+            std::cout << "Invalid choice." << std::endl;
+            break;
+        case OP_IO_ERROR:
+            std::cerr << "Error accessing data files." << std::endl;
+            break;
+    }
+}
+
+// ===================== GET FUNCTIONS =====================
+
+// get-m: Read master record by phone and display its fields.
+void getMaster() {
+    int phone;
+    std::cout << "Enter Phone: ";
+    std::cin >> phone;
+    
+    Buyer buyer;
+    OpStatus status = opGetMaster(phone, buyer);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "\nBuyer Record:" << std::endl;
+    std::cout << "Phone: " << buyer.phone << std::endl;
+    std::cout << "Name: " << buyer.name << std::endl;
+    std::cout << "Address: " << buyer.address << std::endl;
+    std::cout << "First Book Index: " << buyer.firstBook << std::endl;
+    std::cout << "Book Count: " << buyer.bookCount << std::endl;
+}
+
+// get-s: Read slave record (book) by phone and ISBN via the (phone, ISBN) index.
+void getSlave() {
+    int phone, ISBN;
+    std::cout << "Enter Phone: ";
+    std::cin >> phone;
+    std::cout << "Enter ISBN: ";
+    std::cin >> ISBN;
+    
+    Book bookRec;
+    OpStatus status = opGetSlave(phone, ISBN, bookRec);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "\nBook Record:" << std::endl;
+    std::cout << "Phone: " << bookRec.phone << std::endl;
+    std::cout << "ISBN: " << bookRec.ISBN << std::endl;
+    std::cout << "Name: " << bookRec.name << std::endl;
+    std::cout << "Author: " << bookRec.author << std::endl;
+    std::cout << "Price: " << bookRec.price << std::endl;
+    std::cout << "Next Book Index: " << bookRec.nextBook << std::endl;
+}
+
+// get-isbn: List the buyers that own a given ISBN via the (ISBN, phone) index. The
+// index is read a batch at a time and each batch is printed with no latch held.
+// Returns the number of buyers listed, or -1 on a read error.
+long long listIsbnOwners(int ISBN) {
+    OpTimer timer(STAT_GET_ISBN);
+    long long count = 0;
+    // Unsigned low halves: phones 0..INT_MAX come first, then the negative ones
+    long long from = compositeKey(ISBN, 0);
+    std::vector<BTreeEntry> batch;
+    for (bool done = false; !done; ) {
+        {
+            SharedLatch engine(engineLatch);
+            if (!treeRangeBatch(isbnPhoneIndex, from, compositeKey(ISBN, -1), QUERY_BATCH, batch, done)) {
+                std::cerr << "Error reading index file." << std::endl;
+                return -1;
+            }
+        }
+        for (const BTreeEntry &entry : batch)
+            std::cout << "Phone: " << compositeLow(entry.key) << ", Book Record Number: " << entry.value << "\n";
+        count += batch.size();
+    }
+    std::cout.flush();
+    return count;
+}
+
+void printIsbnOwnerCount(int ISBN, long long count) {
+    if (count == 0)
+        std::cout << "No buyers own this ISBN." << std::endl;
+    else
+        std::cout << "Buyers owning ISBN " << ISBN << ": " << count << std::endl;
+}
+
+void getIsbnOwners() {
+    int ISBN;
+    std::cout << "Enter ISBN: ";
+    std::cin >> ISBN;
+    long long count = listIsbnOwners(ISBN);
+    if (count >= 0)
+        printIsbnOwnerCount(ISBN, count);
+}
+
+// ===================== RANGE QUERIES =====================
+// Range queries stream their results through a RecordCursor: the index is read in key
+// order QUERY_BATCH entries at a time, and the pages holding the records of a batch
+// are prefetched (readahead of the runs not in the pool, or of the mapping) before the
+// records are read. Only one batch is held in memory, however large the result.
+// A batch is read under the engine latch held shared and returned with no latch held,
+// so writers run between batches. As in lookups, a record found through the index is
+// checked again in place and skipped if it was deleted (or reused) since.
+template <typename Rec>
+struct RecordCursor {
+    BTree* tree;
+    RecordFile* file;
+    long long from;                  // Next key to read
+    long long lastKey;               // Inclusive end of the key range
+    bool done;                       // The index holds no more keys of the range
+    std::vector<Rec> batch;          // Records read, not returned yet
+    size_t next;
+};
+
+// Cursor over the records whose keys in tree are in [firstKey, lastKey].
+template <typename Rec>
+RecordCursor<Rec> openRecordCursor(BTree &tree, RecordFile &rf, long long firstKey, long long lastKey) {
+    RecordCursor<Rec> cursor;
+    cursor.tree = &tree;
+    cursor.file = &rf;
+    cursor.from = firstKey;
+    cursor.lastKey = lastKey;
+    cursor.done = firstKey > lastKey;
+    cursor.next = 0;
+    return cursor;
+}
+
+// The index key of a record
+long long cursorKey(const Buyer &buyer) { return buyer.phone; }
+long long cursorKey(const Book &bookRec) { return compositeKey(bookRec.phone, bookRec.ISBN); }
+
+// Ask the kernel to read the pages holding the records of a batch, one call per run of
+// consecutive pages. Pages cached by the pool are skipped.
+void prefetchRecords(RecordFile &rf, const std::vector<BTreeEntry> &batch) {
+    std::vector<int> pages;
+    for (const BTreeEntry &entry : batch)
+        pages.push_back(entry.value / rf.recordsPerPage);
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    if (!rf.map) {
+        SharedLatch latch(rf.latch);
+        pages.erase(std::remove_if(pages.begin(), pages.end(), [&](int page) { return rf.pageTable.count(page) > 0; }),
+                    pages.end());
+    }
+    size_t chunk = rf.recordsPerPage * rf.recSize;
+    for (size_t i = 0; i < pages.size(); ) {
+        size_t end = i + 1;
+        while (end < pages.size() && pages[end] == pages[end - 1] + 1)
+            end++;
+        size_t from = pages[i] * chunk;
+        size_t to = (pages[end - 1] + 1) * chunk;
+        if (rf.map) {
+            adviseMapping(rf, pages[i], pages[end - 1] + 1);
+        } else if (rf.compressed) {
+            for (size_t k = i; k < end; k++) {
+                if (pages[k] < (int)rf.blocks.size() && rf.blocks[pages[k]].length > 0)
+                    posix_fadvise(rf.fd, rf.blocks[pages[k]].offset, rf.blocks[pages[k]].length, POSIX_FADV_WILLNEED);
+            }
+        } else {
+            posix_fadvise(rf.fd, rf.dataOffset + from, to - from, POSIX_FADV_WILLNEED);
+        }
+        i = end;
+    }
+}
+
+// Read the next batch of records of the range, under the engine latch held shared.
+// Returns false on a read error.
+template <typename Rec>
+bool readCursorBatch(RecordCursor<Rec> &cursor) {
+    SharedLatch engine(engineLatch);
+    std::vector<BTreeEntry> entries;
+    if (!treeRangeBatch(*cursor.tree, cursor.from, cursor.lastKey, QUERY_BATCH, entries, cursor.done))
+        return false;
+    prefetchRecords(*cursor.file, entries);
+    Rec rec;
+    for (const BTreeEntry &entry : entries) {
+        ioTally.recordsRead++;
+        if (!readRecord(*cursor.file, entry.value, &rec))
+            return false;
+        if (rec.valid == 1 && cursorKey(rec) == entry.key)
+            cursor.batch.push_back(rec);
+    }
+    return true;
+}
+
+// Read the next record of the range into out. Returns 1 for a record, 0 at the end of
+// the range and -1 on a read error.
+template <typename Rec>
+int cursorNext(RecordCursor<Rec> &cursor, Rec &out) {
+    if (cursor.next == cursor.batch.size()) {
+        cursor.batch.clear();
+        cursor.next = 0;
+        while (cursor.batch.empty()) {
+            if (cursor.done)
+                return 0;
+            if (!readCursorBatch(cursor))
+                return -1;
+        }
+    }
+    out = cursor.batch[cursor.next++];
+    return 1;
+}
+
+// range-m: List the buyers with phone in [low, high] in phone order via B.ind.
+// Returns the number of buyers listed, or -1 on a read error.
+long long listBuyerRange(int low, int high) {
+    OpTimer timer(STAT_RANGE_M);
+    RecordCursor<Buyer> cursor = openRecordCursor<Buyer>(masterIndex, masterFile, low, high);
+    Buyer buyer;
+    long long count = 0;
+    int more;
+    while ((more = cursorNext(cursor, buyer)) == 1) {
+        std::cout << "Phone: " << buyer.phone << ", Name: " << buyer.name << ", Address: " << buyer.address
+                  << ", Book Count: " << buyer.bookCount << "\n";
+        count++;
+    }
+    std::cout.flush();
+    if (more < 0) {
+        std::cerr << "Error reading master file." << std::endl;
+        return -1;
+    }
+    return count;
+}
+
+void rangeMaster() {
+    int low, high;
+    std::cout << "Enter low Phone: ";
+    std::cin >> low;
+    std::cout << "Enter high Phone: ";
+    std::cin >> high;
+    long long count = listBuyerRange(low, high);
+    if (count >= 0)
+        std::cout << "Buyers with phone in [" << low << ", " << high << "]: " << count << std::endl;
+}
+
+// books-m: List all books of a buyer in ISBN order via the (phone, ISBN) index.
+// Returns false on a read error.
+bool listBuyerBooks(int phone) {
+    OpTimer timer(STAT_BOOKS_M);
+    bool found;
+    {
+        SharedLatch engine(engineLatch);
+        found = indexFind(phone) != -1;
+    }
+    if (!found) {
+        printStatus(OP_BUYER_NOT_FOUND);
+        return true;
+    }
+    // Unsigned low halves: ISBNs 0..INT_MAX come first, then the negative ones
+    RecordCursor<Book> cursor = openRecordCursor<Book>(phoneIsbnIndex, slaveFile, compositeKey(phone, 0),
+                                                       compositeKey(phone, -1));
+    Book bookRec;
+    int count = 0;
+    int more;
+    while ((more = cursorNext(cursor, bookRec)) == 1) {
+        std::cout << "ISBN: " << bookRec.ISBN << ", Name: " << bookRec.name << ", Author: " << bookRec.author
+                  << ", Price: " << bookRec.price << "\n";
+        count++;
+    }
+    std::cout.flush();
+    if (more < 0) {
+        std::cerr << "Error reading slave file." << std::endl;
+        return false;
+    }
+    std::cout << "Books of buyer " << phone << ": " << count << std::endl;
+    return true;
+}
+
+void buyerBooks() {
+    int phone;
+    std::cout << "Enter Phone: ";
+    std::cin >> phone;
+    listBuyerBooks(phone);
+}
+
+// range-price: List the books with price in [low, high]. There is no price index, so
+// this is a parallel BK.fl scan (see printRecords), streamed in record order.
+// Returns the number of books listed, or -1 on a read error.
+long long listPriceRange(double low, double high) {
+    OpTimer timer(STAT_RANGE_PRICE);
+    ReportSnapshot rs({&slaveFile});
+    std::atomic<long long> count(0);
+    bool ok = printRecords<Book>(slaveFile, [&](std::ostream &out, int, const Book &bookRec) {
+        if (bookRec.valid == 1 && bookRec.price >= low && bookRec.price <= high) {
+            out << "Phone: " << bookRec.phone << ", ISBN: " << bookRec.ISBN << ", Name: " << bookRec.name
+                << ", Price: " << bookRec.price << "\n";
+            count++;
+        }
+    }, &rs.snap);
+    if (!ok) {
+        std::cerr << "Error reading slave file." << std::endl;
+        return -1;
+    }
+    return count;
+}
+
+void rangePrice() {
+    double low, high;
+    std::cout << "Enter low Price: ";
+    std::cin >> low;
+    std::cout << "Enter high Price: ";
+    std::cin >> high;
+    long long count = listPriceRange(low, high);
+    if (count >= 0)
+        std::cout << "Books with price in [" << low << ", " << high << "]: " << count << std::endl;
+}
+
+// join: Export every (buyer, book) pair of the buyers with phone in [low, high], one CSV
+// line each. The plan depends on how many books the range is expected to hold:
+//   chain-following  few books: the buyers in phone order (B.ind of the snapshot),
+//                    each followed by its chain; output grouped by buyer;
+//   hash join        otherwise: the buyers of the range are loaded into a hash table
+//                    by a B.fl scan, then BK.fl is scanned once (in parallel, see
+//                    printRecords) and each book is matched by phone; output in BK.fl
+//                    order. Both files are read sequentially.
+// Both read a snapshot (see SNAPSHOTS). A chain step is a random read, counted as
+// JOIN_RANDOM_READ_PAGES pages of a scan.
+const int JOIN_RANDOM_READ_PAGES = 4;
+
+void printJoinPair(std::ostream &out, const Buyer &buyer, const Book &bookRec) {
+    out << buyer.phone << "," << buyer.name << "," << buyer.address << "," << bookRec.ISBN << ","
+        << bookRec.name << "," << bookRec.author << "," << bookRec.price << "\n";
+}
+
+// Print the pairs (after the header line) and return their number; chains tells the plan.
+long long joinRange(int low, int high, bool &chains) {
+    OpTimer timer(STAT_JOIN);
+    ReportSnapshot rs({&masterFile, &slaveFile, &masterIndex.file});
+    std::vector<BTreeEntry> inRange;
+    bool ok = snapshotIndexRange(rs, low, high, [&](const BTreeEntry &entry) { inRange.push_back(entry); });
+    long long buyers = inRange.size();
+    long long books = buyers * rs.bookKeys / std::max(1, rs.indexHeader.keyCount);
+    long long pages = (rs.records(slaveFile) + slaveFile.recordsPerPage - 1) / slaveFile.recordsPerPage;
+    chains = books * JOIN_RANDOM_READ_PAGES < pages;
+    std::atomic<long long> pairs(0);
+    if (chains) {
+        Buyer buyer;
+        Book bookRec;
+        for (size_t i = 0; ok && i < inRange.size(); i++) {
+            if (!readSnapshotRecord(rs.snap, masterFile, inRange[i].value, &buyer)) {
+                ok = false;
+                break;
+            }
+            for (int recNum = buyer.firstBook; recNum != -1; recNum = bookRec.nextBook) {
+                if (!readSnapshotRecord(rs.snap, slaveFile, recNum, &bookRec)) {
+                    ok = false;
+                    break;
+                }
+                printJoinPair(std::cout, buyer, bookRec);
+                pairs++;
+            }
+        }
+    } else {
+        std::vector<std::vector<Buyer>> parts(scanThreads);
+        ok = ok && parallelScan<Buyer>(masterFile, 0, rs.records(masterFile), [&](int w, int, const Buyer* recs, int n) {
+            for (int i = 0; i < n; i++)
+                if (recs[i].valid == 1 && recs[i].phone >= low && recs[i].phone <= high)
+                    parts[w].push_back(recs[i]);
+        }, &rs.snap);
+        std::unordered_map<int, Buyer> byPhone;
+        byPhone.reserve(buyers);
+        for (auto &part : parts) {
+            for (const Buyer &buyer : part)
+                byPhone[buyer.phone] = buyer;
+            std::vector<Buyer>().swap(part);
+        }
+        ok = ok && printRecords<Book>(slaveFile, [&](std::ostream &out, int, const Book &bookRec) {
+            if (bookRec.valid != 1)
+                return;
+            auto it = byPhone.find(bookRec.phone);
+            if (it != byPhone.end()) {
+                printJoinPair(out, it->second, bookRec);
+                pairs++;
+            }
+        }, &rs.snap);
+    }
+    if (!ok)
+        std::cerr << "Error reading data files." << std::endl;
+    return pairs;
+}
+
+void joinBuyersBooks() {
+    int low, high;
+    std::cout << "Enter low Phone: ";
+    std::cin >> low;
+    std::cout << "Enter high Phone: ";
+    std::cin >> high;
+    std::cout << "\nPhone,Name,Address,ISBN,Title,Author,Price\n";
+    bool chains;
+    long long pairs = joinRange(low, high, chains);
+    std::cout << "Pairs: " << pairs << " (" << (chains ? "chain-following" : "hash join") << ")" << std::endl;
+}
+
+// ===================== DELETE FUNCTIONS =====================
+
+// del-m: Delete a master record (buyer) by phone and all its subordinate book records.
+void delMaster() {
+    int phone;
+    std::cout << "Enter Phone to delete: ";
+    std::cin >> phone;
+    
+    OpStatus status = commitOp(opDelMaster(phone));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Buyer and their books have been deleted." << std::endl;
+}
+
+// del-s: Delete a subordinate book record (by phone and ISBN).
+void delSlave() {
+    int phone, ISBN;
+    std::cout << "Enter Phone for book deletion: ";
+    std::cin >> phone;
+    std::cout << "Enter ISBN of the book to delete: ";
+    std::cin >> ISBN;
+    
+    OpStatus status = commitOp(opDelSlave(phone, ISBN));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Book record deleted." << std::endl;
+}
+
+// del-m-range: Delete the buyers with phone in [low, high] and all their books.
+void delMasterRange() {
+    int low, high;
+    std::cout << "Enter low Phone: ";
+    std::cin >> low;
+    std::cout << "Enter high Phone: ";
+    std::cin >> high;
+
+    int buyers, books;
+    OpStatus status = opDelMasterRange(low, high, buyers, books);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Deleted " << buyers << " buyers and " << books << " books." << std::endl;
+}
+
+// Ask for a book field and a value to compare it with (the whole line, so names
+// and authors may hold spaces). Returns false after an invalid choice.
+bool readBookMatch(const char* verb, int &field, std::string &value) {
+    std::cout << "Select field to match for " << verb << ":\n1. Name\n2. Author\n3. Price\nChoice: ";
+    std::cin >> field;
+    if (field != FIELD_NAME && field != FIELD_AUTHOR && field != FIELD_PRICE) {
+        printStatus(OP_INVALID_FIELD);
+        return false;
+    }
+    std::cout << "Enter value to match: ";
+    std::getline(std::cin >> std::ws, value);
+    return true;
+}
+
+// del-s-where: Delete every book whose name, author or price equals a value.
+void delSlaveWhere() {
+    int field;
+    std::string value;
+    if (!readBookMatch("deletion", field, value))
+        return;
+
+    int books;
+    OpStatus status = opDelSlaveWhere(field, value, books);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Deleted " << books << " books." << std::endl;
+}
+
+// ===================== UPDATE FUNCTIONS =====================
+
+// update-m: Update a non-key field (name, address) of a buyer record.
+void updateMaster() {
+    int phone;
+    std::cout << "Enter Phone to update: ";
+    std::cin >> phone;
+    
+    Buyer buyer;
+    OpStatus status = opGetMaster(phone, buyer);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    int choice;
+    std::cout << "Select field to update:\n1. Name\n2. Address\nChoice: ";
+    std::cin >> choice;
+    switch(choice) {
+        case FIELD_NAME:
+            std::cout << "Enter new Name: ";
+            break;
+        case FIELD_ADDRESS:
+            std::cout << "Enter new Address: ";
+            break;
+        default:
+            std::cout << "Invalid choice." << std::endl;
+            return;
+    }
+    std::string value;
+    std::cin >> value;
+    status = commitOp(opUpdateMaster(phone, choice, value));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Buyer record updated." << std::endl;
+}
+
+// update-s: Update a non-key field (name, author, price) of a book record.
+void updateSlave() {
+    int phone, ISBN;
+    std::cout << "Enter Phone for book update: ";
+    std::cin >> phone;
+    std::cout << "Enter ISBN of book to update: ";
+    std::cin >> ISBN;
+    
+    Book bookRec;
+    OpStatus status = opGetSlave(phone, ISBN, bookRec);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    int choice;
+    std::cout << "Select field to update:\n1. Name\n2. Author\n3. Price\nChoice: ";
+    std::cin >> choice;
+    switch(choice) {
+        case FIELD_NAME:
+            std::cout << "Enter new Name: ";
+            break;
+        case FIELD_AUTHOR:
+            std::cout << "Enter new Author: ";
+            break;
+        case FIELD_PRICE:
+            std::cout << "Enter new Price: ";
+            break;
+        default:
+            std::cout << "Invalid choice." << std::endl;
+            return;
+    }
+    std::string value;
+    std::cin >> value;
+    status = commitOp(opUpdateSlave(phone, ISBN, choice, value));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Book record updated." << std::endl;
+}
+
+// update-s-where: Set a non-key field (name, author, price) of every book whose name,
+// author or price equals a value.
+void updateSlaveWhere() {
+    int field;
+    std::string value;
+    if (!readBookMatch("update", field, value))
+        return;
+    int choice;
+    std::cout << "Select field to update:\n1. Name\n2. Author\n3. Price\nChoice: ";
+    std::cin >> choice;
+    if (choice != FIELD_NAME && choice != FIELD_AUTHOR && choice != FIELD_PRICE) {
+        printStatus(OP_INVALID_FIELD);
+        return;
+    }
+    std::string newValue;
+    std::cout << "Enter new value: ";
+    std::getline(std::cin >> std::ws, newValue);
+
+    int books;
+    OpStatus status = opUpdateSlaveWhere(field, value, choice, newValue, books);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Updated " << books << " books." << std::endl;
+}
+
+// ===================== INSERT FUNCTIONS =====================
+
+// insert-m: Insert a new buyer record into B.fl, using the master garbage zone if available.
+void insertMaster() {
+    Buyer buyer;
+    std::string name, address;
+    std::cout << "Enter Phone: ";
+    std::cin >> buyer.phone;
+    std::cout << "Enter Name: ";
+    std::cin >> name;
+    std::cout << "Enter Address: ";
+    std::cin >> address;
+    copyField(buyer.name, name);
+    copyField(buyer.address, address);
+    
+    int recNum;
+    OpStatus status = commitOp(opInsertMaster(buyer, recNum));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Buyer record inserted." << std::endl;
+}
+
+// insert-s: Insert a new book record into BK.fl and link it as the first record in the buyer's chain.
+void insertSlave() {
+    Book bookRec;
+    std::cout << "Enter Phone for the book: ";
+    std::cin >> bookRec.phone;
+    // Find the buyer.
+    Buyer buyer;
+    OpStatus status = opGetMaster(bookRec.phone, buyer);
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    // Prepare the book record.
+    std::string name, author;
+    std::cout << "Enter ISBN: ";
+    std::cin >> bookRec.ISBN;
+    std::cout << "Enter Name: ";
+    std::cin >> name;
+    std::cout << "Enter Author: ";
+    std::cin >> author;
+    std::cout << "Enter Price: ";
+    std::cin >> bookRec.price;
+    copyField(bookRec.name, name);
+    copyField(bookRec.author, author);
+    
+    int recNum;
+    status = commitOp(opInsertSlave(bookRec, recNum));
+    if (status != OP_OK) {
+        printStatus(status);
+        return;
+    }
+    std::cout << "Book record inserted." << std::endl;
+}
+
+// ===================== CALC FUNCTIONS =====================
+// The reports run over whole blocks of records (parallelScan), one partial result per
+// worker. The kernels below have no data-dependent branches, so the compiler can turn
+// their selects into conditional moves or vector blends and each block is one tight
+// pass over the array.
+
+struct PriceTotals {
+    long long count;
+    double sum;
+    double min;
+    double max;
+};
+
+template <typename Rec>
+long long countValid(const Rec* recs, int count) {
+    long long valid = 0;
+    for (int i = 0; i < count; i++)
+        valid += recs[i].valid == 1;
+    return valid;
+}
+
+void addPrices(const Book* books, int count, PriceTotals &totals) {
+    long long valid = 0;
+    double sum = 0, lo = totals.min, hi = totals.max;
+    for (int i = 0; i < count; i++) {
+        bool isValid = books[i].valid == 1;
+        double price = books[i].price;
+        valid += isValid;
+        sum += isValid ? price : 0.0;
+        lo = isValid && price < lo ? price : lo;
+        hi = isValid && price > hi ? price : hi;
+    }
+    totals.count += valid;
+    totals.sum += sum;
+    totals.min = lo;
+    totals.max = hi;
+}
+
+// calc-m: Count valid buyer records.
+bool countBuyers(long long &count) {
+    OpTimer timer(STAT_CALC_M);
+    ReportSnapshot rs({&masterFile});
+    std::vector<long long> counts(scanThreads, 0);
+    if (!parallelScan<Buyer>(masterFile, 0, rs.records(masterFile),
+                             [&](int w, int, const Buyer* buyers, int n) { counts[w] += countValid(buyers, n); },
+                             &rs.snap)) {
+        std::cerr << "Error reading master file." << std::endl;
+        return false;
+    }
+    count = 0;
+    for (long long c : counts)
+        count += c;
+    return true;
+}
+
+void calcMaster() {
+    long long count;
+    if (countBuyers(count))
+        std::cout << "Total valid buyer records: " << count << std::endl;
+}
+
+// Per-buyer price totals. Phones are usually a dense range, so the totals live in
+// an array indexed by phone - low; a sparse set of phones falls back to a hash map.
+struct BuyerPrices {
+    long long low;
+    std::vector<double> dense;
+    std::unordered_map<int, double> sparse;
+};
+
+bool initBuyerPrices(BuyerPrices &prices, const ReportSnapshot &rs) {
+    std::vector<long long> lows(scanThreads, LLONG_MAX), highs(scanThreads, LLONG_MIN), counts(scanThreads, 0);
+    bool ok = parallelScan<Buyer>(masterFile, 0, rs.records(masterFile), [&](int w, int, const Buyer* buyers, int n) {
+        for (int i = 0; i < n; i++) {
+            if (buyers[i].valid == 1) {
+                lows[w] = std::min<long long>(lows[w], buyers[i].phone);
+                highs[w] = std::max<long long>(highs[w], buyers[i].phone);
+                counts[w]++;
+            }
+        }
+    }, &rs.snap);
+    long long low = LLONG_MAX, high = LLONG_MIN, count = 0;
+    for (int w = 0; w < scanThreads; w++) {
+        low = std::min(low, lows[w]);
+        high = std::max(high, highs[w]);
+        count += counts[w];
+    }
+    prices.low = low;
+    if (count > 0 && high - low < 4 * count + 1024)
+        prices.dense.assign(high - low + 1, 0.0);
+    else
+        prices.sparse.reserve(count);
+    return ok;
+}
+
+void addBuyerPrices(BuyerPrices &prices, const Book* books, int count) {
+    if (!prices.dense.empty()) {
+        long long size = prices.dense.size();
+        for (int i = 0; i < count; i++) {
+            long long slot = books[i].phone - prices.low;
+            if (books[i].valid == 1 && slot >= 0 && slot < size)
+                prices.dense[slot] += books[i].price;
+        }
+    } else {
+        for (int i = 0; i < count; i++)
+            if (books[i].valid == 1)
+                prices.sparse[books[i].phone] += books[i].price;
+    }
+}
+
+void mergeBuyerPrices(BuyerPrices &into, const BuyerPrices &from) {
+    for (size_t i = 0; i < from.dense.size(); i++)
+        into.dense[i] += from.dense[i];
+    for (const auto &entry : from.sparse)
+        into.sparse[entry.first] += entry.second;
+}
+
+double buyerPrice(const BuyerPrices &prices, int phone) {
+    if (!prices.dense.empty())
+        return prices.dense[phone - prices.low];
+    auto it = prices.sparse.find(phone);
+    return it == prices.sparse.end() ? 0.0 : it->second;
+}
+
+void printPriceTotals(const PriceTotals &totals) {
+    std::cout << "Total valid book records: " << totals.count << std::endl;
+    if (totals.count > 0)
+        std::cout << "Book prices: sum " << totals.sum << ", average " << totals.sum / totals.count
+                  << ", min " << totals.min << ", max " << totals.max << std::endl;
+    std::cout << "Book counts for each buyer (from master records):" << std::endl;
+}
+
+// calc-s: Count valid book records and aggregate their prices overall, then display
+// bookCount and the total price for each buyer. onTotals(totals) runs before the
+// buyers are listed.
+template <typename Fn>
+bool sumBooks(Fn onTotals) {
+    OpTimer timer(STAT_CALC_S);
+    ReportSnapshot rs({&masterFile, &slaveFile});
+    BuyerPrices prices;
+    bool ok = initBuyerPrices(prices, rs);
+    std::vector<PriceTotals> partTotals(scanThreads, PriceTotals{0, 0, std::numeric_limits<double>::infinity(),
+                                                                -std::numeric_limits<double>::infinity()});
+    std::vector<BuyerPrices> partPrices(scanThreads, prices);
+    ok = ok && parallelScan<Book>(slaveFile, 0, rs.records(slaveFile), [&](int w, int, const Book* books, int n) {
+        addPrices(books, n, partTotals[w]);
+        addBuyerPrices(partPrices[w], books, n);
+    }, &rs.snap);
+    if (!ok) {
+        std::cerr << "Error reading slave file." << std::endl;
+        return false;
+    }
+    PriceTotals totals = partTotals[0];
+    prices = std::move(partPrices[0]);
+    for (int w = 1; w < scanThreads; w++) {
+        totals.count += partTotals[w].count;
+        totals.sum += partTotals[w].sum;
+        totals.min = std::min(totals.min, partTotals[w].min);
+        totals.max = std::max(totals.max, partTotals[w].max);
+        mergeBuyerPrices(prices, partPrices[w]);
+    }
+    onTotals(totals);
+    return printRecords<Buyer>(masterFile, [&](std::ostream &out, int, const Buyer &buyer) {
+        if (buyer.valid == 1)
+            out << "Phone " << buyer.phone << ": " << buyer.bookCount << " books. Total price: "
+                << buyerPrice(prices, buyer.phone) << '\n';
+    }, &rs.snap);
+}
+
+void calcSlave() {
+    sumBooks(printPriceTotals);
+}
+
+// ===================== UTILITY FUNCTIONS =====================
+
+// ut-m: Print all master records (including service fields), index table and master garbage list.
+void utMaster() {
+    OpTimer timer(STAT_UT_M);
+    ReportSnapshot rs({&masterFile, &masterIndex.file});
+    std::cout << "\n--- Master File Contents ---\n";
+    bool ok = printRecords<Buyer>(masterFile, [](std::ostream &out, int recNum, const Buyer &buyer) {
+        out << "Record " << recNum << ":\n";
+        out << "  Phone: " << buyer.phone << "\n";
+        out << "  Name: " << buyer.name << "\n";
+        out << "  Address: " << buyer.address << "\n";
+        out << "  First Book Index: " << buyer.firstBook << "\n";
+        out << "  Book Count: " << buyer.bookCount << "\n";
+        out << "  Extent: " << buyer.firstExtent << " (" << buyer.extentCount << " records)\n";
+        out << "  Valid: " << buyer.valid << "\n";
+    }, &rs.snap);
+    if (!ok)
+        std::cerr << "Error reading master file." << std::endl;
+    std::cout << "--- End of Master File ---\n";
+    std::cout << "Index Table (" << rs.indexHeader.keyCount << " keys, height " << rs.indexHeader.height << "):\n";
+    if (!snapshotIndexRange(rs, LLONG_MIN, LLONG_MAX, [](const BTreeEntry &entry) {
+            std::cout << "  Phone: " << entry.key << ", Record Number: " << entry.value << "\n";
+        }))
+        std::cerr << "Error reading index file." << std::endl;
+    std::cout << "Master Garbage List: ";
+    forEachGarbage(rs.masterFree, [](int recNum) { std::cout << recNum << " "; });
+    std::cout << "\n";
+}
+
+// ut-s: Print all slave records (including service fields) and slave garbage list.
+void utSlave() {
+    OpTimer timer(STAT_UT_S);
+    ReportSnapshot rs({&slaveFile});
+    std::cout << "\n--- Slave File Contents ---\n";
+    bool ok = printRecords<Book>(slaveFile, [](std::ostream &out, int recNum, const Book &bookRec) {
+        out << "Record " << recNum << ":\n";
+        out << "  Phone: " << bookRec.phone << "\n";
+        out << "  ISBN: " << bookRec.ISBN << "\n";
+        out << "  Name: " << bookRec.name << "\n";
+        out << "  Author: " << bookRec.author << "\n";
+        out << "  Price: " << bookRec.price << "\n";
+        out << "  Next Book Index: " << bookRec.nextBook << "\n";
+        out << "  Valid: " << bookRec.valid << "\n";
+    }, &rs.snap);
+    if (!ok)
+        std::cerr << "Error reading slave file." << std::endl;
+    std::cout << "--- End of Slave File ---\n";
+    std::cout << "Slave Garbage List: ";
+    forEachGarbage(rs.slaveFree, [](int recNum) { std::cout << recNum << " "; });
+    std::cout << "\n";
+}
+
+// pool-stats: Print the record cache and buffer pool counters.
+void printPoolStats(const RecordFile &rf, std::ostream &out = std::cout) {
+    long long lookups = rf.stats.hits + rf.stats.misses;
+    out << rf.fileName << ": hits " << rf.stats.hits
+        << ", misses " << rf.stats.misses
+        << ", evictions " << rf.stats.evictions
+        << ", write-backs " << rf.stats.writeBacks
+        << ", prefetched " << rf.stats.prefetches;
+    if (lookups > 0)
+        out << ", hit ratio " << (double)rf.stats.hits / lookups;
+    out << ", " << rf.stats.bytesRead / 1024 << " KB read, " << rf.stats.bytesWritten / 1024 << " KB written, "
+        << rf.stats.seeks << " seeks" << std::endl;
+}
+
+// Space taken by the blocks of a compressed file, against the plain records
+void printBlockStats(const RecordFile &rf) {
+    if (!rf.compressed)
+        return;
+    long long stored = 0;
+    for (const BlockRef &block : rf.blocks)
+        stored += block.length;
+    long long raw = (long long)rf.recordCount * rf.recSize;
+    std::cout << rf.fileName << ": " << rf.blocks.size() << " compressed blocks, " << stored / 1024 << " KB for "
+              << raw / 1024 << " KB of records";
+    if (stored > 0)
+        std::cout << ", ratio " << (double)raw / stored;
+    std::cout << ", file " << (rf.dataOffset + (long long)rf.sectorUsed.size() * BLOCK_SECTOR) / 1024 << " KB" << std::endl;
+}
+
+void printFilterStats() {
+    std::cout << "Book filter: " << bookFilter.bits.size() * 8 / 1024 << " KB for " << bookFilter.capacity
+              << " keys, " << bookFilter.added << " added, " << bookFilterNegatives << " index probes saved" << std::endl;
+}
+
+void printCacheStats() {
+    size_t entries = 0, bytes = 0;
+    long long hits = 0, misses = 0;
+    for (CacheShard &shard : cacheShards) {
+        std::lock_guard<std::mutex> latch(shard.latch);
+        entries += shard.entries.size();
+        bytes += shard.bytes;
+        hits += shard.hits;
+        misses += shard.misses;
+    }
+    std::cout << "Record cache: " << entries << " buyers, " << bytes / 1024 << " of " << cacheCapacity / 1024
+              << " KB, hits " << hits << ", misses " << misses;
+    if (hits + misses > 0)
+        std::cout << ", hit ratio " << (double)hits / (hits + misses);
+    std::cout << std::endl;
+}
+
+void poolStats() {
+    ExclusiveLatch engine(engineLatch);
+    printCacheStats();
+    printFilterStats();
+    printBlockStats(slaveFile);
+    std::cout << "Report snapshots: " << snapshotsOpened << " opened, " << snapshotPages
+              << " pages saved for them" << std::endl;
+    if (useMmap) {
+        std::cout << "Memory-mapped mode: " << masterFile.fileName << " " << masterFile.recordCount << "/" << masterFile.mapCapacity;
+        if (slaveFile.map)
+            std::cout << " records, " << slaveFile.fileName << " " << slaveFile.recordCount << "/" << slaveFile.mapCapacity;
+        std::cout << " records mapped" << std::endl;
+        if (!slaveFile.map)
+            printPoolStats(slaveFile);
+        printPoolStats(masterIndex.file);
+        printPoolStats(phoneIsbnIndex.file);
+        printPoolStats(isbnPhoneIndex.file);
+        return;
+    }
+    std::cout << "Buffer pool: " << poolFrames << " frames per file (" << poolFrames * RECORDS_PER_PAGE
+              << " B.fl/BK.fl records)" << std::endl;
+    printPoolStats(masterFile);
+    printPoolStats(slaveFile);
+    printPoolStats(masterIndex.file);
+    printPoolStats(phoneIsbnIndex.file);
+    printPoolStats(isbnPhoneIndex.file);
+}
+
+// stats: Print the operation stats (see STATISTICS) and the counters of every file.
+// Records are per operation, bytes and seeks totals; depth is the average number of
+// index nodes per probe.
+void printStats(std::ostream &out) {
+    out << "operation  count  p50 us  p99 us  p999 us  max us  records read/op  written/op  KB read  KB written  "
+           "seeks  index depth  chain hops p99  max" << std::endl;
+    for (int op = 0; op < STAT_OPS; op++) {
+        const OpStats &s = opStats[op];
+        long long count = s.latency.total;
+        if (count == 0)
+            continue;
+        out << STAT_NAMES[op] << "  " << count << "  " << histogramPercentile(s.latency, 0.5) / 1000.0 << "  "
+            << histogramPercentile(s.latency, 0.99) / 1000.0 << "  " << histogramPercentile(s.latency, 0.999) / 1000.0
+            << "  " << s.latency.max / 1000.0 << "  " << (double)s.recordsRead / count << "  "
+            << (double)s.recordsWritten / count << "  " << s.bytesRead / 1024 << "  " << s.bytesWritten / 1024 << "  "
+            << s.seeks << "  ";
+        if (s.indexProbes > 0)
+            out << (double)s.indexNodes / s.indexProbes;
+        else
+            out << "-";
+        if (s.chainHops.total > 0)
+            out << "  " << histogramPercentile(s.chainHops, 0.99) << "  " << s.chainHops.max;
+        else
+            out << "  -  -";
+        out << "\n";
+    }
+    for (const RecordFile* rf : {&masterFile, &slaveFile, &masterIndex.file, &phoneIsbnIndex.file, &isbnPhoneIndex.file})
+        printPoolStats(*rf, out);
+    std::lock_guard<std::mutex> lock(walLatch);
+    out << "Log: " << walAppended / 1024 << " KB written" << std::endl;
+}
+
+// stats-json: The same as one JSON object (latencies in nanoseconds).
+void printStatsJson(std::ostream &out) {
+    out << "{\"time\":" << (long long)std::time(nullptr) << ",\"ops\":{";
+    bool first = true;
+    for (int op = 0; op < STAT_OPS; op++) {
+        const OpStats &s = opStats[op];
+        if (s.latency.total == 0)
+            continue;
+        out << (first ? "" : ",") << "\"" << STAT_NAMES[op] << "\":{\"count\":" << s.latency.total
+            << ",\"p50_ns\":" << histogramPercentile(s.latency, 0.5)
+            << ",\"p99_ns\":" << histogramPercentile(s.latency, 0.99)
+            << ",\"p999_ns\":" << histogramPercentile(s.latency, 0.999) << ",\"max_ns\":" << s.latency.max
+            << ",\"records_read\":" << s.recordsRead << ",\"records_written\":" << s.recordsWritten
+            << ",\"bytes_read\":" << s.bytesRead << ",\"bytes_written\":" << s.bytesWritten
+            << ",\"seeks\":" << s.seeks << ",\"index_probes\":" << s.indexProbes
+            << ",\"index_nodes\":" << s.indexNodes;
+        if (s.chainHops.total > 0)
+            out << ",\"chain_hops_p99\":" << histogramPercentile(s.chainHops, 0.99)
+                << ",\"chain_hops_max\":" << s.chainHops.max;
+        out << "}";
+        first = false;
+    }
+    out << "},\"files\":{";
+    first = true;
+    for (const RecordFile* rf : {&masterFile, &slaveFile, &masterIndex.file, &phoneIsbnIndex.file, &isbnPhoneIndex.file}) {
+        const PoolStats &p = rf->stats;
+        out << (first ? "" : ",") << "\"" << rf->fileName << "\":{\"hits\":" << p.hits << ",\"misses\":" << p.misses
+            << ",\"evictions\":" << p.evictions << ",\"write_backs\":" << p.writeBacks
+            << ",\"prefetches\":" << p.prefetches << ",\"bytes_read\":" << p.bytesRead
+            << ",\"bytes_written\":" << p.bytesWritten << ",\"seeks\":" << p.seeks << "}";
+        first = false;
+    }
+    std::lock_guard<std::mutex> lock(walLatch);
+    out << "},\"log_bytes\":" << walAppended << "}";
+}
+
+// --stats-interval: a thread appends the JSON stats to B.stats and rewrites the text
+// report in B.stats.txt every statsInterval seconds, and once more on exit.
+int statsInterval = 0;
+std::thread statsThread;
+std::mutex statsLatch;
+std::condition_variable statsWake;
+bool statsStopping = false;
+
+void dumpStats() {
+    std::ofstream json(STATS_FILE, std::ios::app);
+    printStatsJson(json);
+    json << "\n";
+    std::ofstream text(STATS_TEXT_FILE, std::ios::trunc);
+    printStats(text);
+    if (!json || !text)
+        std::cerr << "Error writing " << STATS_FILE << "." << std::endl;
+}
+
+void startStatsDump() {
+    if (statsInterval <= 0)
+        return;
+    statsThread = std::thread([] {
+        std::unique_lock<std::mutex> lock(statsLatch);
+        while (!statsWake.wait_for(lock, std::chrono::seconds(statsInterval), [] { return statsStopping; }))
+            dumpStats();
+    });
+}
+
+void stopStatsDump() {
+    if (!statsThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(statsLatch);
+        statsStopping = true;
+    }
+    statsWake.notify_all();
+    statsThread.join();
+    dumpStats();
+}
+
+// ===================== VACUUM =====================
+// vacuum rewrites B.fl and BK.fl without deleted records, with the books of every
+// buyer stored contiguously in chain order, so that walking a chain reads consecutive
+// records. It works in steps that hold the engine latch exclusively for at most
+// VACUUM_STEP_RECORDS records; other commands run between the steps.
+//   1. Buyers from the end of B.fl are moved into the holes at its start.
+//   2. Buyers are visited in B.fl order and each one's books are moved, one at a time,
+//      to the next records of BK.fl, which become the buyer's extent; books of other
+//      buyers in the way go to the end.
+//   3. Books left at the end of BK.fl (inserted while vacuum ran) are moved into holes.
+//   4. Both files are cut after their last record and the holes vacuum still holds
+//      go back to the garbage zones.
+// Moves are not logged: each step leaves the files consistent, and the logged
+// operations replayed after a crash do not depend on where the records are stored.
+// The indexes are updated as records move, and the garbage zones too: vacuum claims
+// the free records it fills and frees the ones it empties, so checkpoints between
+// the steps save them exactly.
+const int VACUUM_STEP_RECORDS = 256;
+
+enum VacuumPhase { VACUUM_BUYERS, VACUUM_BOOKS, VACUUM_TAIL, VACUUM_DONE };
+
+struct VacuumState {
+    VacuumPhase phase;
+    int hole;        // VACUUM_BUYERS, VACUUM_TAIL: no holes before this record
+    int nextBuyer;   // VACUUM_BOOKS: B.fl record being visited
+    int prevBook;    // VACUUM_BOOKS: last book of that buyer already moved (-1 if none)
+    int chainStart;  // VACUUM_BOOKS: where that buyer's books start
+    int nextBook;    // VACUUM_BOOKS: BK.fl records before this one are in place
+};
+
+std::thread vacuumThread;
+std::atomic<bool> vacuumRunning(false);
+
+// Cut the deleted records at the end of a file. Returns the new record count.
+template <typename Rec>
+int trimFile(RecordFile &rf, GarbageMap &garbage) {
+    int count = rf.recordCount;
+    Rec rec;
+    while (count > 0 && readRecord(rf, count - 1, &rec) && rec.valid == 0)
+        count--;
+    if (count < rf.recordCount) {
+        truncateRecordFile(rf, count);
+        trimGarbage(garbage, count);
+    }
+    return count;
+}
+
+// Move records from the end of a file into its holes, calling relink(rec, from, to) for
+// each one. Returns 1 when no hole is left, 0 when the budget ran out and -1 on error.
+template <typename Rec, typename Fn>
+int fillHoles(RecordFile &rf, GarbageMap &garbage, int &hole, int &budget, Fn relink) {
+    Rec rec;
+    while (budget > 0) {
+        int count = trimFile<Rec>(rf, garbage);
+        while (hole < count && readRecord(rf, hole, &rec) && rec.valid == 1)
+            hole++;
+        if (hole >= count)
+            return 1;
+        if (!readRecord(rf, count - 1, &rec) || !writeRecord(rf, hole, &rec))
+            return -1;
+        claimGarbage(garbage, hole);
+        if (!relink(rec, count - 1, hole))
+            return -1;
+        rec.valid = 0;
+        if (!writeRecord(rf, count - 1, &rec))
+            return -1;
+        addGarbage(garbage, count - 1);
+        budget--;
+    }
+    return 0;
+}
+
+// Step 1: fill the holes of B.fl with buyers from its end.
+bool vacuumBuyers(VacuumState &st, int &budget) {
+    int result = fillHoles<Buyer>(masterFile, masterGarbage, st.hole, budget, [](const Buyer &buyer, int, int to) {
+        return btreeSetValue(masterIndex, buyer.phone, to);
+    });
+    if (result == 1)
+        st.phase = VACUUM_BOOKS;
+    return result != -1;
+}
 
-// ===================== INDEX AND GARBAGE HANDLING =====================
-void loadIndexTable() {
-    indexTable.clear();
-    std::ifstream in(INDEX_FILE, std::ios::binary);
-    if (!in) {
-        // If the index table file does not exist, scan B.fl to build it.
-        std::ifstream master(MASTER_FILE, std::ios::binary);
-        if (!master) return;
-        Buyer buyer;
-        int recNum = 0;
-        while (master.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer))) {
-            if (buyer.valid == 1) {
-                IndexRecord ir;
-                ir.phone = buyer.phone;
-                ir.recordNumber = recNum;
-                indexTable.push_back(ir);
-            }
-            recNum++;
-        }
-        master.close();
-        std::sort(indexTable.begin(), indexTable.end(), [](const IndexRecord &a, const IndexRecord &b) {
-            return a.phone < b.phone;
-        });
+// Point the chain link (or the buyer's firstBook) that refers to BK.fl record from at to.
+bool relinkBook(const Book &bookRec, int from, int to) {
+    int buyerRecNum = btreeFind(masterIndex, bookRec.phone);
+    int recNum = -1;
+    if (buyerRecNum == -1 || !visitBuyer(buyerRecNum, [&](const Buyer &buyer) { recNum = buyer.firstBook; }))
+        return false;
+    if (recNum == from) {
+        if (!updateBuyer(buyerRecNum, [&](Buyer &buyer) { buyer.firstBook = to; }))
+            return false;
+    } else {
+        int next = -1;
+        while (recNum != -1 && visitBook(recNum, [&](const Book &prev) { next = prev.nextBook; }) && next != from)
+            recNum = next;
+        if (recNum == -1 || next != from || !updateBook(recNum, [&](Book &prev) { prev.nextBook = to; }))
+            return false;
+    }
+    btreeSetValue(phoneIsbnIndex, compositeKey(bookRec.phone, bookRec.ISBN), to);
+    btreeSetValue(isbnPhoneIndex, compositeKey(bookRec.ISBN, bookRec.phone), to);
+    return true;
+}
+
+// Step 2 for buyer nextBuyer: move its books after prevBook to BK.fl records nextBook,
+// nextBook + 1, ... Returns 1 when the chain is done, 0 when the budget ran out and
+// -1 on error. A long chain is spread over several steps; prevBook is checked again
+// at the start of each, since it may have been deleted in between.
+int clusterChain(VacuumState &st, int &budget) {
+    Buyer buyer;
+    if (!readBuyer(st.nextBuyer, buyer))
+        return -1;
+    if (buyer.valid == 0)
+        return 1;
+    Book bookRec;
+    int recNum = buyer.firstBook;
+    if (st.prevBook != -1) {
+        if (!readBook(st.prevBook, bookRec))
+            return -1;
+        if (bookRec.valid == 1 && bookRec.phone == buyer.phone)
+            recNum = bookRec.nextBook;
+        else
+            st.prevBook = -1;
+    }
+    if (st.prevBook == -1)
+        st.chainStart = st.nextBook;
+    while (recNum != -1) {
+        if (budget <= 0)
+            return 0;
+        int target = st.nextBook;
+        budget--;
+        if (recNum != target) {
+            // Make room at target: extend the file or move the book there to the end
+            if (target >= slaveFile.recordCount) {
+                memset(&bookRec, 0, sizeof(Book));
+                bookRec.nextBook = -1;
+                while (slaveFile.recordCount <= target) {
+                    if (appendBook(bookRec) == -1)
+                        return -1;
+                }
+            } else {
+                if (!readBook(target, bookRec))
+                    return -1;
+                if (bookRec.valid == 1) {
+                    int to = appendBook(bookRec);
+                    if (to == -1 || !relinkBook(bookRec, target, to))
+                        return -1;
+                    budget--;
+                } else {
+                    claimGarbage(slaveGarbage, target);
+                }
+            }
+            // Move the book and link it from its predecessor
+            if (!readBook(recNum, bookRec) || !writeBook(target, bookRec))
+                return -1;
+            bool linked = st.prevBook == -1
+                ? updateBuyer(st.nextBuyer, [&](Buyer &rec) { rec.firstBook = target; })
+                : updateBook(st.prevBook, [&](Book &rec) { rec.nextBook = target; });
+            if (!linked || !updateBook(recNum, [](Book &rec) {
+                    rec.valid = 0;
+                    rec.nextBook = -1;
+                }))
+                return -1;
+            btreeSetValue(phoneIsbnIndex, compositeKey(bookRec.phone, bookRec.ISBN), target);
+            btreeSetValue(isbnPhoneIndex, compositeKey(bookRec.ISBN, bookRec.phone), target);
+            addGarbage(slaveGarbage, recNum);
+        } else if (!readBook(recNum, bookRec)) {
+            return -1;
+        }
+        st.prevBook = target;
+        st.nextBook++;
+        recNum = bookRec.nextBook;
+    }
+    // The chain is now the buyer's extent
+    bool ok = updateBuyer(st.nextBuyer, [&](Buyer &rec) {
+        rec.firstExtent = st.nextBook > st.chainStart ? st.chainStart : -1;
+        rec.extentCount = st.nextBook - st.chainStart;
+    });
+    return ok ? 1 : -1;
+}
+
+// Step 2: cluster the chains of the next buyers.
+bool vacuumBooks(VacuumState &st, int &budget) {
+    while (budget > 0) {
+        if (st.nextBuyer >= masterFile.recordCount) {
+            st.phase = VACUUM_TAIL;
+            st.hole = st.nextBook;
+            return true;
+        }
+        int result = clusterChain(st, budget);
+        if (result == -1)
+            return false;
+        if (result == 1) {
+            st.nextBuyer++;
+            st.prevBook = -1;
+        }
+    }
+    return true;
+}
+
+// Step 3: fill the holes of BK.fl with books from its end.
+bool vacuumTail(VacuumState &st, int &budget) {
+    int result = fillHoles<Book>(slaveFile, slaveGarbage, st.hole, budget, relinkBook);
+    if (result == 1)
+        st.phase = VACUUM_DONE;
+    return result != -1;
+}
+
+// Step 4: cut both files.
+void vacuumFinish() {
+    trimFile<Buyer>(masterFile, masterGarbage);
+    trimFile<Book>(slaveFile, slaveGarbage);
+}
+
+// Run vacuum to the end, printing the file sizes if report is set. Returns false on I/O error.
+bool runVacuum(bool report) {
+    OpTimer timer(STAT_VACUUM);
+    int buyersBefore, booksBefore;
+    VacuumState st = {VACUUM_BUYERS, 0, 0, -1, 0, 0};
+    {
+        ExclusiveLatch engine(engineLatch);
+        buyersBefore = masterFile.recordCount;
+        booksBefore = slaveFile.recordCount;
+    }
+    bool ok = true;
+    while (ok && st.phase != VACUUM_DONE) {
+        {
+            ExclusiveLatch engine(engineLatch);
+            cacheClear();
+            int budget = VACUUM_STEP_RECORDS;
+            if (st.phase == VACUUM_BUYERS)
+                ok = vacuumBuyers(st, budget);
+            else if (st.phase == VACUUM_BOOKS)
+                ok = vacuumBooks(st, budget);
+            else
+                ok = vacuumTail(st, budget);
+        }
+        checkpointIfNeeded();
+        std::this_thread::yield();
+    }
+    int buyersAfter, booksAfter;
+    {
+        ExclusiveLatch engine(engineLatch);
+        if (ok) {
+            vacuumFinish();
+            rebuildBookFilter();
+        }
+        buyersAfter = masterFile.recordCount;
+        booksAfter = slaveFile.recordCount;
+    }
+    if (!checkpoint() || !ok) {
+        std::cerr << "Error during vacuum." << std::endl;
+        return false;
+    }
+    if (report)
+        std::cout << "Vacuum finished: " << MASTER_FILE << " " << buyersBefore << " -> " << buyersAfter << " records, "
+                  << SLAVE_FILE << " " << booksBefore << " -> " << booksAfter << " records." << std::endl;
+    return true;
+}
+
+// vacuum: start vacuum in the background.
+void vacuum() {
+    if (vacuumRunning) {
+        std::cout << "Vacuum is already running." << std::endl;
         return;
     }
-    IndexRecord temp;
-    while (in.read(reinterpret_cast<char*>(&temp), sizeof(IndexRecord))) {
-        indexTable.push_back(temp);
+    if (vacuumThread.joinable())
+        vacuumThread.join();
+    vacuumRunning = true;
+    vacuumThread = std::thread([] {
+        runVacuum(true);
+        vacuumRunning = false;
+    });
+    std::cout << "Vacuum started." << std::endl;
+}
+
+// ===================== BATCH MODE =====================
+// --batch <file> (- for stdin) runs a script instead of the interactive prompt.
+// One command per line, fields separated by commas or spaces; empty lines and
+// lines starting with '#' are skipped:
+//   get-m,phone                     get-s,phone,ISBN
+//   del-m,phone                     del-s,phone,ISBN
+//   update-m,phone,field,value      update-s,phone,ISBN,field,value
+//   insert-m,phone,name,address     insert-s,phone,ISBN,name,author,price
+//   del-m-range,low,high            del-s-where,field,value
+//   update-s-where,field,value,new field,new value
+//   vacuum                          (runs to the end before the next line)
+// A field in double quotes may hold spaces and commas ("Author 7").
+// Every command prints one CSV line: line,command,status[,result fields].
+// Runs of consecutive insert-m (or insert-s) lines are bulk loaded: the records are
+// appended with one sequential write and the indexes are merged in one pass. A bulk
+// step is not logged; it runs between two checkpoints instead.
+// Results are held back and printed once the log group they belong to is committed
+// (group commit: one fdatasync per BATCH_COMMIT_GROUP lines). The pages of the next
+// BATCH_PREFETCH_LINES lookups and updates are prefetched while earlier lines run.
+const int BATCH_RUN_LIMIT = 1 << 20;   // Max inserts loaded in one bulk step
+const int BULK_MIN_RUN = 4096;         // Shorter runs of inserts go through the logged operations
+const int BATCH_COMMIT_GROUP = 1024;   // Lines per log commit
+const int BATCH_PREFETCH_LINES = 128;  // Lines read ahead for prefetching (with I/O threads)
+
+std::ostringstream batchOut;           // Results of the lines not yet committed
+
+const char* statusCode(OpStatus status) {
+    switch (status) {
+        case OP_OK:              return "ok";
+        case OP_BUYER_NOT_FOUND: return "buyer_not_found";
+        case OP_BUYER_DELETED:   return "buyer_deleted";
+        case OP_BOOK_NOT_FOUND:  return "book_not_found";
+        case OP_DUPLICATE:       return "duplicate";
+        case OP_INVALID_FIELD:   return "invalid_field";
+        case OP_IO_ERROR:        return "io_error";
     }
-    in.close();
+    return "unknown";
 }
 
-void saveIndexTable() {
-    std::ofstream out(INDEX_FILE, std::ios::binary | std::ios::trunc);
-    for (auto &ir : indexTable)
-        out.write(reinterpret_cast<char*>(&ir), sizeof(IndexRecord));
-    out.close();
-}
-
-void loadMasterGarbage() {
-    masterGarbage.clear();
-    std::ifstream in(MASTER_GARBAGE_FILE, std::ios::binary);
-    if (!in) return;
-    int rec;
-    while (in.read(reinterpret_cast<char*>(&rec), sizeof(int)))
-        masterGarbage.push_back(rec);
-    in.close();
+struct BatchBuyer {
+    int lineNo;
+    Buyer buyer;
+};
+
+struct BatchBook {
+    int lineNo;
+    Book book;
+};
+
+std::vector<BatchBuyer> pendingBuyers;  // Current run of insert-m lines
+std::vector<BatchBook> pendingBooks;    // Current run of insert-s lines
+
+std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (c == ',' || c == ' ' || c == '\t' || c == '\r')) {
+            if (!field.empty())
+                fields.push_back(field);
+            field.clear();
+        } else {
+            field += c;
+        }
+    }
+    if (!field.empty())
+        fields.push_back(field);
+    return fields;
 }
 
-void loadSlaveGarbage() {
-    slaveGarbage.clear();
-    std::ifstream in(SLAVE_GARBAGE_FILE, std::ios::binary);
-    if (!in) return;
-    int rec;
-    while (in.read(reinterpret_cast<char*>(&rec), sizeof(int)))
-        slaveGarbage.push_back(rec);
-    in.close();
+bool parseInt(const std::string &text, int &value) {
+    char* end;
+    long v = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || v < INT_MIN || v > INT_MAX)
+        return false;
+    value = (int)v;
+    return true;
 }
 
-void saveMasterGarbage() {
-    std::ofstream out(MASTER_GARBAGE_FILE, std::ios::binary | std::ios::trunc);
-    for (auto &rec : masterGarbage)
-        out.write(reinterpret_cast<char*>(&rec), sizeof(int));
-    out.close();
+bool parseDouble(const std::string &text, double &value) {
+    char* end;
+    value = strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
 }
 
-void saveSlaveGarbage() {
-    std::ofstream out(SLAVE_GARBAGE_FILE, std::ios::binary | std::ios::trunc);
-    for (auto &rec : slaveGarbage)
-        out.write(reinterpret_cast<char*>(&rec), sizeof(int));
-    out.close();
+void printBatchResult(int lineNo, const std::string &command, OpStatus status) {
+    batchOut << lineNo << "," << command << "," << statusCode(status) << "\n";
 }
 
-// ===================== GET FUNCTIONS =====================
+void printInsertResult(int lineNo, const char* command, OpStatus status, int recNum) {
+    batchOut << lineNo << "," << command << "," << statusCode(status);
+    if (status == OP_OK)
+        batchOut << "," << recNum;
+    batchOut << "\n";
+}
 
-// get-m: Read master record by phone and display its fields.
-void getMaster() {
-    int phone;
-    std::cout << "Enter Phone: ";
-    std::cin >> phone;
-    
-    // Binary search in the index table (index table is sorted by phone)
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
+// Commit the log and print the results it covers.
+void releaseBatchOutput() {
+    if (!walCommit())
+        std::cerr << "Error writing log file." << std::endl;
+    std::cout << batchOut.str();
+    batchOut.str("");
+}
+
+// Insert the queued buyers one at a time, each one logged.
+void insertPendingBuyers() {
+    for (auto &item : pendingBuyers) {
+        int recNum = -1;
+        OpStatus status = opInsertMaster(item.buyer, recNum);
+        printInsertResult(item.lineNo, "insert-m", status, recNum);
     }
-    int recNum = it->recordNumber;
-    std::fstream file(MASTER_FILE, std::ios::binary | std::ios::in);
-    if (!file) {
-        std::cerr << "Error opening master file." << std::endl;
+    pendingBuyers.clear();
+}
+
+// Append a run of new buyers to B.fl in one write and merge them into B.ind.
+void flushPendingBuyers() {
+    size_t n = pendingBuyers.size();
+    if (n == 0)
+        return;
+    if (n < (size_t)BULK_MIN_RUN) {
+        insertPendingBuyers();
         return;
     }
-    file.seekg(recNum * sizeof(Buyer));
-    Buyer buyer;
-    file.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    file.close();
-    
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
+    OpTimer timer(STAT_BULK_LOAD);
+    ExclusiveLatch engine(engineLatch);
+    // The run is not logged, so it must start from a checkpoint
+    if (!checkpointLocked()) {
+        engine.unlock();
+        insertPendingBuyers();
         return;
     }
-    std::cout << "\nBuyer Record:" << std::endl;
-    std::cout << "Phone: " << buyer.phone << std::endl;
-    std::cout << "Name: " << buyer.name << std::endl;
-    std::cout << "Address: " << buyer.address << std::endl;
-    std::cout << "First Book Index: " << buyer.firstBook << std::endl;
-    std::cout << "Book Count: " << buyer.bookCount << std::endl;
+    std::vector<OpStatus> status(n, OP_OK);
+    // Sort by phone (stable, so the first of several equal phones wins)
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) {
+        return pendingBuyers[a].buyer.phone < pendingBuyers[b].buyer.phone;
+    });
+    std::vector<long long> keys(n);
+    for (size_t i = 0; i < n; i++)
+        keys[i] = pendingBuyers[order[i]].buyer.phone;
+    std::vector<bool> exists = btreeContains(masterIndex, keys);
+    for (size_t i = 0; i < n; i++) {
+        if (exists[i] || (i > 0 && keys[i] == keys[i - 1]))
+            status[order[i]] = OP_DUPLICATE;
+    }
+    // Append the accepted buyers in line order
+    std::vector<Buyer> records;
+    std::vector<int> recNums(n, -1);
+    for (size_t i = 0; i < n; i++) {
+        if (status[i] != OP_OK)
+            continue;
+        Buyer &buyer = pendingBuyers[i].buyer;
+        buyer.firstBook = -1;
+        buyer.bookCount = 0;
+        buyer.firstExtent = -1;
+        buyer.extentCount = 0;
+        buyer.valid = 1;
+        recNums[i] = masterFile.recordCount + records.size();
+        records.push_back(buyer);
+    }
+    ioTally.recordsWritten += records.size();
+    bool ok = records.empty() || appendRecords(masterFile, records.data(), records.size()) != -1;
+    if (ok) {
+        std::vector<BTreeEntry> entries;
+        for (size_t i = 0; i < n; i++) {
+            if (status[order[i]] == OP_OK)
+                entries.push_back(BTreeEntry{keys[i], recNums[order[i]]});
+        }
+        ok = btreeBulkInsert(masterIndex, entries);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (status[i] == OP_OK && !ok)
+            status[i] = OP_IO_ERROR;
+        printInsertResult(pendingBuyers[i].lineNo, "insert-m", status[i], recNums[i]);
+    }
+    pendingBuyers.clear();
+    if (!checkpointLocked())
+        failStop();
 }
 
-// get-s: Read slave record (book) by phone and ISBN by traversing the linked list.
-void getSlave() {
-    int phone, ISBN;
-    std::cout << "Enter Phone: ";
-    std::cin >> phone;
-    std::cout << "Enter ISBN: ";
-    std::cin >> ISBN;
-    
-    // Find the buyer via the index table
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
+// Insert the queued books one at a time, each one logged.
+void insertPendingBooks() {
+    for (auto &item : pendingBooks) {
+        int recNum = -1;
+        OpStatus status = opInsertSlave(item.book, recNum);
+        printInsertResult(item.lineNo, "insert-s", status, recNum);
     }
-    int buyerRecNum = it->recordNumber;
-    std::fstream bfile(MASTER_FILE, std::ios::binary | std::ios::in);
-    if (!bfile) {
-        std::cerr << "Error opening master file." << std::endl;
+    pendingBooks.clear();
+}
+
+// Append a run of new books to BK.fl in one write, link them into their buyers'
+// chains (each buyer record is rewritten once) and merge them into BK.ind/BK.isbn.
+void flushPendingBooks() {
+    size_t n = pendingBooks.size();
+    if (n == 0)
+        return;
+    if (n < (size_t)BULK_MIN_RUN) {
+        insertPendingBooks();
         return;
     }
-    bfile.seekg(buyerRecNum * sizeof(Buyer));
-    Buyer buyer;
-    bfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    bfile.close();
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
+    OpTimer timer(STAT_BULK_LOAD);
+    ExclusiveLatch engine(engineLatch);
+    // The run is not logged, so it must start from a checkpoint
+    if (!checkpointLocked()) {
+        engine.unlock();
+        insertPendingBooks();
         return;
     }
-    
-    int bookIndex = buyer.firstBook;
-    std::fstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::in);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
+    cacheClear();
+    std::vector<OpStatus> status(n, OP_OK);
+    // Resolve each buyer once
+    std::unordered_map<int, int> buyerRecNums;
+    for (size_t i = 0; i < n; i++) {
+        int phone = pendingBooks[i].book.phone;
+        auto it = buyerRecNums.find(phone);
+        if (it == buyerRecNums.end())
+            it = buyerRecNums.emplace(phone, indexFind(phone)).first;
+        if (it->second == -1)
+            status[i] = OP_BUYER_NOT_FOUND;
+    }
+    // Duplicate (phone, ISBN) pairs, against the index and within the run
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) {
+        return compositeKey(pendingBooks[a].book.phone, pendingBooks[a].book.ISBN) <
+               compositeKey(pendingBooks[b].book.phone, pendingBooks[b].book.ISBN);
+    });
+    std::vector<long long> keys(n);
+    for (size_t i = 0; i < n; i++)
+        keys[i] = compositeKey(pendingBooks[order[i]].book.phone, pendingBooks[order[i]].book.ISBN);
+    std::vector<bool> exists = btreeContains(phoneIsbnIndex, keys);
+    for (size_t i = 0; i < n; i++) {
+        if (status[order[i]] == OP_OK && (exists[i] || (i > 0 && keys[i] == keys[i - 1])))
+            status[order[i]] = OP_DUPLICATE;
+    }
+    // Read the buyers, chain the new books in line order (each one becomes the
+    // first in its buyer's chain) and append them. With --extents the books of each
+    // buyer are appended together and become its new extent.
+    std::vector<size_t> place(n);
+    for (size_t i = 0; i < n; i++)
+        place[i] = i;
+    if (useExtents) {
+        std::unordered_map<int, size_t> firstLine;
+        for (size_t i = 0; i < n; i++)
+            firstLine.emplace(pendingBooks[i].book.phone, i);
+        std::stable_sort(place.begin(), place.end(), [&](size_t a, size_t b) {
+            return firstLine[pendingBooks[a].book.phone] < firstLine[pendingBooks[b].book.phone];
+        });
+    }
+    std::unordered_map<int, Buyer> buyers;
+    std::vector<Book> records;
+    std::vector<int> recNums(n, -1);
+    bool ok = true;
+    for (size_t k = 0; k < n && ok; k++) {
+        size_t i = place[k];
+        if (status[i] != OP_OK)
+            continue;
+        Book &bookRec = pendingBooks[i].book;
+        recNums[i] = slaveFile.recordCount + records.size();
+        auto it = buyers.find(bookRec.phone);
+        if (it == buyers.end()) {
+            Buyer buyer;
+            ok = readBuyer(buyerRecNums[bookRec.phone], buyer);
+            if (useExtents) {
+                ok = ok && releaseExtent(bookRec.phone, buyer.firstExtent, buyer.extentCount);
+                buyer.firstExtent = recNums[i];
+                buyer.extentCount = 0;
+            }
+            it = buyers.emplace(bookRec.phone, buyer).first;
+        }
+        bookRec.nextBook = it->second.firstBook;
+        bookRec.valid = 1;
+        it->second.firstBook = recNums[i];
+        it->second.bookCount++;
+        if (useExtents)
+            it->second.extentCount++;
+        records.push_back(bookRec);
+    }
+    ioTally.recordsWritten += records.size();
+    ok = ok && (records.empty() || appendRecords(slaveFile, records.data(), records.size()) != -1);
+    if (ok) {
+        // Rewrite the buyers in file order so the pool sees sequential pages
+        std::vector<std::pair<int, const Buyer*>> updates;
+        for (auto &b : buyers)
+            updates.push_back(std::make_pair(buyerRecNums[b.first], &b.second));
+        std::sort(updates.begin(), updates.end());
+        for (auto &u : updates)
+            ok = writeBuyer(u.first, *u.second) && ok;
+        std::vector<BTreeEntry> byPhone, byIsbn;
+        for (size_t i = 0; i < n; i++) {
+            const Book &bookRec = pendingBooks[order[i]].book;
+            if (status[order[i]] == OP_OK) {
+                byPhone.push_back(BTreeEntry{keys[i], recNums[order[i]]});
+                byIsbn.push_back(BTreeEntry{compositeKey(bookRec.ISBN, bookRec.phone), recNums[order[i]]});
+            }
+        }
+        sortEntries(byIsbn);
+        for (auto &entry : byPhone)
+            bloomAdd(bookFilter, entry.key);
+        ok = btreeBulkInsert(phoneIsbnIndex, byPhone) && ok;
+        ok = btreeBulkInsert(isbnPhoneIndex, byIsbn) && ok;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (status[i] == OP_OK && !ok)
+            status[i] = OP_IO_ERROR;
+        printInsertResult(pendingBooks[i].lineNo, "insert-s", status[i], recNums[i]);
+    }
+    pendingBooks.clear();
+    if (!checkpointLocked())
+        failStop();
+}
+
+void flushPendingInserts() {
+    flushPendingBuyers();
+    flushPendingBooks();
+}
+
+// Run one batch line. Inserts are queued; anything else flushes the queue first.
+void runBatchLine(int lineNo, const std::vector<std::string> &f) {
+    const std::string &command = f[0];
+    int phone, ISBN, field, high, newField;
+    if (command == "insert-m" && f.size() == 4 && parseInt(f[1], phone)) {
+        flushPendingBooks();
+        BatchBuyer item;
+        memset(&item.buyer, 0, sizeof(Buyer));
+        item.lineNo = lineNo;
+        item.buyer.phone = phone;
+        copyField(item.buyer.name, f[2]);
+        copyField(item.buyer.address, f[3]);
+        pendingBuyers.push_back(item);
+        if (pendingBuyers.size() >= (size_t)BATCH_RUN_LIMIT)
+            flushPendingBuyers();
         return;
     }
-    bool found = false;
-    while (bookIndex != -1) {
-        bkfile.seekg(bookIndex * sizeof(Book));
+    if (command == "insert-s" && f.size() == 6 && parseInt(f[1], phone) && parseInt(f[2], ISBN)) {
+        BatchBook item;
+        memset(&item.book, 0, sizeof(Book));
+        item.lineNo = lineNo;
+        item.book.phone = phone;
+        item.book.ISBN = ISBN;
+        copyField(item.book.name, f[3]);
+        copyField(item.book.author, f[4]);
+        if (parseDouble(f[5], item.book.price)) {
+            flushPendingBuyers();
+            pendingBooks.push_back(item);
+            if (pendingBooks.size() >= (size_t)BATCH_RUN_LIMIT)
+                flushPendingBooks();
+            return;
+        }
+    }
+    flushPendingInserts();
+    if (command == "get-m" && f.size() == 2 && parseInt(f[1], phone)) {
+        Buyer buyer;
+        OpStatus status = opGetMaster(phone, buyer);
+        batchOut << lineNo << ",get-m," << statusCode(status);
+        if (status == OP_OK)
+            batchOut << "," << buyer.phone << "," << buyer.name << "," << buyer.address
+                      << "," << buyer.firstBook << "," << buyer.bookCount;
+        batchOut << "\n";
+    } else if (command == "get-s" && f.size() == 3 && parseInt(f[1], phone) && parseInt(f[2], ISBN)) {
         Book bookRec;
-        bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        if (bookRec.valid == 1 && bookRec.ISBN == ISBN) {
-            std::cout << "\nBook Record:" << std::endl;
-            std::cout << "Phone: " << bookRec.phone << std::endl;
-            std::cout << "ISBN: " << bookRec.ISBN << std::endl;
-            std::cout << "Name: " << bookRec.name << std::endl;
-            std::cout << "Author: " << bookRec.author << std::endl;
-            std::cout << "Price: " << bookRec.price << std::endl;
-            std::cout << "Next Book Index: " << bookRec.nextBook << std::endl;
-            found = true;
+        OpStatus status = opGetSlave(phone, ISBN, bookRec);
+        batchOut << lineNo << ",get-s," << statusCode(status);
+        if (status == OP_OK)
+            batchOut << "," << bookRec.phone << "," << bookRec.ISBN << "," << bookRec.name << ","
+                      << bookRec.author << "," << bookRec.price << "," << bookRec.nextBook;
+        batchOut << "\n";
+    } else if (command == "del-m" && f.size() == 2 && parseInt(f[1], phone)) {
+        printBatchResult(lineNo, command, opDelMaster(phone));
+    } else if (command == "del-s" && f.size() == 3 && parseInt(f[1], phone) && parseInt(f[2], ISBN)) {
+        printBatchResult(lineNo, command, opDelSlave(phone, ISBN));
+    } else if (command == "update-m" && f.size() == 4 && parseInt(f[1], phone) && parseInt(f[2], field)) {
+        printBatchResult(lineNo, command, opUpdateMaster(phone, field, f[3]));
+    } else if (command == "update-s" && f.size() == 5 && parseInt(f[1], phone) && parseInt(f[2], ISBN) &&
+               parseInt(f[3], field)) {
+        printBatchResult(lineNo, command, opUpdateSlave(phone, ISBN, field, f[4]));
+    } else if (command == "del-m-range" && f.size() == 3 && parseInt(f[1], phone) && parseInt(f[2], high)) {
+        int buyers, books;
+        OpStatus status = opDelMasterRange(phone, high, buyers, books);
+        batchOut << lineNo << ",del-m-range," << statusCode(status);
+        if (status == OP_OK)
+            batchOut << "," << buyers << "," << books;
+        batchOut << "\n";
+    } else if (command == "del-s-where" && f.size() == 3 && parseInt(f[1], field)) {
+        int books;
+        OpStatus status = opDelSlaveWhere(field, f[2], books);
+        batchOut << lineNo << ",del-s-where," << statusCode(status);
+        if (status == OP_OK)
+            batchOut << "," << books;
+        batchOut << "\n";
+    } else if (command == "update-s-where" && f.size() == 5 && parseInt(f[1], field) && parseInt(f[3], newField)) {
+        int books;
+        OpStatus status = opUpdateSlaveWhere(field, f[2], newField, f[4], books);
+        batchOut << lineNo << ",update-s-where," << statusCode(status);
+        if (status == OP_OK)
+            batchOut << "," << books;
+        batchOut << "\n";
+    } else if (command == "vacuum" && f.size() == 1) {
+        releaseBatchOutput();
+        printBatchResult(lineNo, command, runVacuum(false) ? OP_OK : OP_IO_ERROR);
+    } else {
+        batchOut << lineNo << "," << command << ",invalid_command\n";
+    }
+}
+
+// Have an I/O thread look up the records a lookup, update or delete line will need
+// and load their pages: the index pages on the way, the buyer's page if the command
+// reads the buyer and the book's page for the book commands.
+void prefetchBatchLine(const std::vector<std::string> &f) {
+    const std::string &command = f[0];
+    bool book = command == "get-s" || command == "del-s" || command == "update-s";
+    bool buyer = command == "get-m" || command == "del-m" || command == "update-m" || command == "del-s";
+    int phone, ISBN = 0;
+    if ((!book && !buyer) || f.size() < 2 || !parseInt(f[1], phone) ||
+        (book && (f.size() < 3 || !parseInt(f[2], ISBN))))
+        return;
+    submitIo([=] {
+        int recNum = indexFind(phone);
+        int bookRecNum = book ? bookIndexFind(phone, ISBN) : -1;
+        // A book command for a missing book reads nothing more
+        if (book && bookRecNum == -1)
+            return;
+        if (buyer && recNum != -1)
+            loadPage(masterFile, recNum / RECORDS_PER_PAGE);
+        if (bookRecNum != -1)
+            loadPage(slaveFile, bookRecNum / RECORDS_PER_PAGE);
+    });
+}
+
+// Run a batch script from fileName ("-" for stdin). Returns false if it cannot be opened.
+bool runBatch(const std::string &fileName) {
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (fileName != "-") {
+        file.open(fileName);
+        if (!file)
+            return false;
+        in = &file;
+    }
+    std::ios::sync_with_stdio(false);
+    std::string line;
+    int lineNo = 0;
+    int groupLines = 0;
+    // Lines are read ahead of the one running, so their pages can be prefetched
+    bool prefetch = !ioThreads.empty();
+    size_t window = prefetch ? BATCH_PREFETCH_LINES : 1;
+    std::deque<std::pair<int, std::vector<std::string>>> ahead;
+    bool more = true;
+    for (;;) {
+        while (more && ahead.size() < window) {
+            if (!std::getline(*in, line)) {
+                more = false;
+                break;
+            }
+            lineNo++;
+            std::vector<std::string> fields = splitFields(line);
+            if (fields.empty() || fields[0][0] == '#')
+                continue;
+            if (prefetch)
+                prefetchBatchLine(fields);
+            ahead.emplace_back(lineNo, std::move(fields));
+        }
+        if (ahead.empty())
             break;
+        runBatchLine(ahead.front().first, ahead.front().second);
+        ahead.pop_front();
+        checkpointIfNeeded();
+        if (++groupLines == BATCH_COMMIT_GROUP) {
+            releaseBatchOutput();
+            groupLines = 0;
         }
-        bookIndex = bookRec.nextBook;
     }
-    bkfile.close();
-    if (!found)
-        std::cout << "Book record not found." << std::endl;
+    flushPendingInserts();
+    releaseBatchOutput();
+    std::cout.flush();
+    return true;
 }
 
-// ===================== DELETE FUNCTIONS =====================
+// ===================== SHARDING =====================
+// --shards <n> [--shard-dirs <dir>,<dir>,...] partitions the buyers over n shards by
+// a hash of the phone. Shard i is a complete set of files (B.fl, BK.fl, their indexes,
+// garbage zones, log and checkpoint stamp) in <dir>/shard<i>, the directories taken in
+// turn from --shard-dirs (default: the current one), so the shards can sit on
+// different disks. Each shard runs in a process of its own, forked at startup with the
+// same options; this process becomes the router. It reads batch lines (--batch, or
+// the prompt, where each line is committed before the next one is read) and sends
+// each line to the shard of its phone, or to every shard for del-m-range, del-s-where,
+// update-s-where and vacuum, whose results are added up. The shards run their lines
+// in parallel and the results are printed in line order.
+// The reports are lines too in this mode: calc-m, calc-s, ut-m, ut-s, get-isbn,ISBN,
+// range-m,low,high, books-m,phone, range-price,low,high, join,low,high, pool-stats,
+// stats and stats-json. A report waits for the lines before it and runs on every shard
+// at once (books-m on its buyer's shard). Totals are merged and range-m is printed in
+// phone order; the dumps (ut-*, pool-stats, stats*) are printed shard by shard. Record
+// numbers are those within the shard. B.shards keeps the layout, which must not change.
+//
+// The router writes request lines to a pipe of each shard; a shard answers with
+// frames (RouteFrame) on another pipe: the text it prints, the totals of a report and
+// the end of a report or of a sync request.
+const int ROUTER_PIPE_BYTES = 1 << 20;      // Pipe buffer asked for in each direction
+const size_t ROUTER_SEND_BYTES = 1 << 16;   // Request or text bytes collected before a write
+const size_t ROUTER_QUEUE_LINES = 1 << 16;  // Lines of a report buffered per shard
 
-// del-m: Delete a master record (buyer) by phone and all its subordinate book records.
-void delMaster() {
-    int phone;
-    std::cout << "Enter Phone to delete: ";
-    std::cin >> phone;
-    
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
+int shardCount = 0;                  // --shards (0: one set of files in the current directory)
+int shardIndex = -1;                 // The shard this process serves (-1: the router, or not sharded)
+std::vector<std::string> shardDirs;  // --shard-dirs
+
+int shardOf(int phone) {
+    return (int)((((uint64_t)(uint32_t)phone * 0x9E3779B97F4A7C15ULL) >> 32) % shardCount);
+}
+
+std::string shardPath(int shard) {
+    std::string dir = shardDirs.empty() ? "." : shardDirs[shard % shardDirs.size()];
+    return dir + "/shard" + std::to_string(shard);
+}
+
+enum RouteFrameKind { ROUTE_TEXT, ROUTE_SUMMARY, ROUTE_DONE, ROUTE_STOPPED };
+
+struct RouteFrame {
+    int kind;
+    int length;   // Bytes that follow
+};
+
+// The totals of a report on one shard
+struct RouteSummary {
+    int ok;
+    int chains;          // join: the plan was chain-following
+    long long count;     // Records listed or counted
+    PriceTotals totals;  // calc-s
+};
+
+bool writeFully(int fd, const void* data, size_t bytes) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t done = write(fd, p, bytes);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        p += done;
+        bytes -= done;
     }
-    int buyerRecNum = it->recordNumber;
-    std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+    return true;
+}
+
+bool readFully(int fd, void* data, size_t bytes) {
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t got = read(fd, p, bytes);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        bytes -= got;
     }
-    mfile.seekg(buyerRecNum * sizeof(Buyer));
-    Buyer buyer;
-    mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    if (buyer.valid == 0) {
-        std::cout << "Buyer already deleted." << std::endl;
-        mfile.close();
-        return;
+    return true;
+}
+
+// In a shard process std::cout goes to the router as text frames.
+struct RouteOutput : std::streambuf {
+    int fd = -1;
+    std::vector<char> buffer = std::vector<char>(ROUTER_SEND_BYTES);
+
+    RouteOutput() { setp(buffer.data(), buffer.data() + buffer.size()); }
+
+    bool send(int kind, const void* data, size_t length) {
+        RouteFrame frame = {kind, (int)length};
+        return writeFully(fd, &frame, sizeof(frame)) && writeFully(fd, data, length);
     }
-    // Delete all subordinate book records
-    int bookIndex = buyer.firstBook;
-    std::fstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
-        mfile.close();
-        return;
+
+    int sync() override {
+        size_t length = pptr() - pbase();
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return length == 0 || send(ROUTE_TEXT, buffer.data(), length) ? 0 : -1;
     }
-    while (bookIndex != -1) {
-        bkfile.seekg(bookIndex * sizeof(Book));
-        Book bookRec;
-        bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        if (bookRec.valid == 1) {
-            bookRec.valid = 0;
-            bkfile.seekp(bookIndex * sizeof(Book));
-            bkfile.write(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-            slaveGarbage.push_back(bookIndex);
-        }
-        bookIndex = bookRec.nextBook;
-    }
-    bkfile.close();
-    // Mark buyer record as deleted
-    buyer.valid = 0;
-    mfile.seekp(buyerRecNum * sizeof(Buyer));
-    mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    mfile.close();
-    masterGarbage.push_back(buyerRecNum);
-    // Remove from index table
-    indexTable.erase(it);
-    std::cout << "Buyer and their books have been deleted." << std::endl;
+
+    int overflow(int c) override {
+        if (sync() != 0)
+            return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+};
+
+RouteOutput* routeOutput = nullptr;   // In a shard process: std::cout (never freed, cout is flushed at exit)
+FILE* routeRequests = nullptr;   // In a shard process: the requests of the router
+
+void sendRouteFrame(int kind, const void* data = nullptr, size_t length = 0) {
+    std::cout.flush();
+    if (!routeOutput->send(kind, data, length))
+        std::cerr << "Error writing to the router." << std::endl;
 }
 
-// del-s: Delete a subordinate book record (by phone and ISBN).
-void delSlave() {
-    int phone, ISBN;
-    std::cout << "Enter Phone for book deletion: ";
-    std::cin >> phone;
-    std::cout << "Enter ISBN of the book to delete: ";
-    std::cin >> ISBN;
-    
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
+// Run a report line of the router on this shard (see SHARDING). The arguments have
+// been checked by the router.
+void runShardReport(const std::vector<std::string> &f) {
+    const std::string &command = f[0];
+    RouteSummary summary = {1, 0, 0, {0, 0, 0, 0}};
+    int a = 0, b = 0;
+    double low = 0, high = 0;
+    if (f.size() >= 2) {
+        parseInt(f[1], a);
+        parseDouble(f[1], low);
+    }
+    if (f.size() >= 3) {
+        parseInt(f[2], b);
+        parseDouble(f[2], high);
+    }
+    if (command == "calc-m") {
+        summary.ok = countBuyers(summary.count);
+    } else if (command == "calc-s") {
+        // The totals go first, as they are printed before the buyers
+        bool sent = false;
+        summary.ok = sumBooks([&](const PriceTotals &totals) {
+            summary.totals = totals;
+            sendRouteFrame(ROUTE_SUMMARY, &summary, sizeof(summary));
+            sent = true;
+        });
+        if (!sent) {
+            summary.ok = 0;
+            sendRouteFrame(ROUTE_SUMMARY, &summary, sizeof(summary));
+        }
         return;
+    } else if (command == "ut-m") {
+        utMaster();
+    } else if (command == "ut-s") {
+        utSlave();
+    } else if (command == "get-isbn") {
+        summary.count = listIsbnOwners(a);
+        summary.ok = summary.count >= 0;
+    } else if (command == "range-m") {
+        summary.count = listBuyerRange(a, b);
+        summary.ok = summary.count >= 0;
+    } else if (command == "books-m") {
+        summary.ok = listBuyerBooks(a);
+    } else if (command == "range-price") {
+        summary.count = listPriceRange(low, high);
+        summary.ok = summary.count >= 0;
+    } else if (command == "join") {
+        bool chains;
+        summary.count = joinRange(a, b, chains);
+        summary.chains = chains;
+    } else if (command == "pool-stats") {
+        poolStats();
+    } else if (command == "stats") {
+        printStats(std::cout);
+    } else if (command == "stats-json") {
+        printStatsJson(std::cout);
+        std::cout << std::endl;
+    } else if (command != "sync") {
+        return;
+    }
+    if (command != "sync")
+        sendRouteFrame(ROUTE_SUMMARY, &summary, sizeof(summary));
+}
+
+// The request loop of a shard process. A line that starts with a line number is a
+// batch line; results are committed and released in groups as in runBatch, and all
+// of them before a report or a sync request, which end with ROUTE_DONE.
+void serveRouter() {
+    char* text = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    int groupLines = 0;
+    while ((length = getline(&text, &capacity, routeRequests)) > 0) {
+        std::vector<std::string> f = splitFields(std::string(text, text[length - 1] == '\n' ? length - 1 : length));
+        int lineNo;
+        if (f.size() >= 2 && parseInt(f[0], lineNo)) {
+            f.erase(f.begin());
+            runBatchLine(lineNo, f);
+            checkpointIfNeeded();
+            if (++groupLines == BATCH_COMMIT_GROUP) {
+                releaseBatchOutput();
+                groupLines = 0;
+            }
+            continue;
+        }
+        flushPendingInserts();
+        releaseBatchOutput();
+        groupLines = 0;
+        if (f.empty() || f[0] == "exit")
+            break;
+        runShardReport(f);
+        sendRouteFrame(ROUTE_DONE);
+        checkpointIfNeeded();
+    }
+    free(text);
+}
+
+// The router's end of the pipes of a shard. A reader thread turns the frames of the
+// shard into items: one per text line, then the summary and the end of a report.
+struct RouteItem {
+    int kind;              // RouteFrameKind (ROUTE_TEXT: one line)
+    std::string line;
+    RouteSummary summary;
+};
+
+struct ShardLink {
+    int shard;
+    pid_t pid = -1;
+    int requestFd = -1;
+    int replyFd = -1;
+    std::string outgoing;               // Requests not yet written
+    std::thread reader;
+    std::mutex latch;                   // Guards items
+    std::condition_variable changed;
+    std::deque<RouteItem> items;
+};
+
+std::deque<ShardLink> shardLinks;
+std::atomic<bool> routerReporting(false);   // A report is collected: the readers keep ROUTER_QUEUE_LINES lines at most
+
+void pushRouteItem(ShardLink &link, RouteItem item) {
+    std::unique_lock<std::mutex> lock(link.latch);
+    // Batch results are never held back: the router may be writing to the shard
+    link.changed.wait(lock, [&] { return link.items.size() < ROUTER_QUEUE_LINES || !routerReporting; });
+    link.items.push_back(std::move(item));
+    link.changed.notify_all();
+}
+
+void shardReader(ShardLink &link) {
+    std::string partial;
+    std::vector<char> data;
+    RouteFrame frame;
+    while (readFully(link.replyFd, &frame, sizeof(frame))) {
+        data.resize(frame.length);
+        if (!readFully(link.replyFd, data.data(), data.size()))
+            break;
+        if (frame.kind == ROUTE_TEXT) {
+            partial.append(data.data(), data.size());
+            size_t start = 0, end;
+            while ((end = partial.find('\n', start)) != std::string::npos) {
+                pushRouteItem(link, RouteItem{ROUTE_TEXT, partial.substr(start, end - start), {}});
+                start = end + 1;
+            }
+            partial.erase(0, start);
+            continue;
+        }
+        if (!partial.empty())
+            pushRouteItem(link, RouteItem{ROUTE_TEXT, partial, {}});
+        partial.clear();
+        RouteItem item = {frame.kind, "", {}};
+        if (frame.kind == ROUTE_SUMMARY && data.size() == sizeof(RouteSummary))
+            memcpy(&item.summary, data.data(), sizeof(RouteSummary));
+        pushRouteItem(link, item);
+    }
+    pushRouteItem(link, RouteItem{ROUTE_STOPPED, "", {}});
+}
+
+// Wait for the next item of a shard and take it. The end of a stopped shard stays.
+bool takeRouteItem(ShardLink &link, RouteItem &item) {
+    std::unique_lock<std::mutex> lock(link.latch);
+    link.changed.wait(lock, [&] { return !link.items.empty(); });
+    item = std::move(link.items.front());
+    if (item.kind != ROUTE_STOPPED)
+        link.items.pop_front();
+    link.changed.notify_all();
+    return true;
+}
+
+bool flushRequests(ShardLink &link) {
+    bool ok = writeFully(link.requestFd, link.outgoing.data(), link.outgoing.size());
+    link.outgoing.clear();
+    return ok;
+}
+
+bool sendRequest(ShardLink &link, const std::string &line) {
+    link.outgoing += line;
+    link.outgoing += '\n';
+    return link.outgoing.size() < ROUTER_SEND_BYTES || flushRequests(link);
+}
+
+// Create the shard directories, check them against B.shards (written on the first
+// run) and fork the shard processes. Returns false on error; in a shard process it
+// returns with shardIndex set, and the caller goes on to open the shard's files.
+bool startShards() {
+    std::string layout = std::to_string(shardCount) + "\n";
+    for (int i = 0; i < shardCount; i++)
+        layout += shardPath(i) + "\n";
+    std::ifstream in(SHARDS_FILE);
+    if (in) {
+        std::stringstream found;
+        found << in.rdbuf();
+        if (found.str() != layout) {
+            std::cerr << SHARDS_FILE << " lists other shards; run with the --shards and --shard-dirs that created them:\n"
+                      << found.str();
+            return false;
+        }
+    } else {
+        std::ofstream out(SHARDS_FILE);
+        out << layout;
+        if (!out.flush() || !syncDirectory()) {
+            std::cerr << "Error writing " << SHARDS_FILE << "." << std::endl;
+            return false;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::cout.flush();
+    for (int i = 0; i < shardCount; i++) {
+        std::string dir = shardPath(i);
+        std::string parent = dir.substr(0, dir.rfind('/'));
+        if ((mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) || (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)) {
+            std::cerr << "Error creating " << dir << "." << std::endl;
+            return false;
+        }
+        int requests[2], replies[2];
+        if (pipe(requests) != 0 || pipe(replies) != 0) {
+            std::cerr << "Error creating pipes." << std::endl;
+            return false;
+        }
+        fcntl(requests[1], F_SETPIPE_SZ, ROUTER_PIPE_BYTES);
+        fcntl(replies[1], F_SETPIPE_SZ, ROUTER_PIPE_BYTES);
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Error starting shard " << i << "." << std::endl;
+            return false;
+        }
+        if (pid == 0) {
+            for (ShardLink &link : shardLinks) {
+                close(link.requestFd);
+                close(link.replyFd);
+            }
+            shardLinks.clear();
+            close(requests[1]);
+            close(replies[0]);
+            if (chdir(dir.c_str()) != 0) {
+                std::cerr << "Error opening " << dir << "." << std::endl;
+                _exit(1);
+            }
+            shardIndex = i;
+            routeRequests = fdopen(requests[0], "r");
+            routeOutput = new RouteOutput();
+            routeOutput->fd = replies[1];
+            std::cout.rdbuf(routeOutput);
+            return true;
+        }
+        close(requests[0]);
+        close(replies[1]);
+        shardLinks.emplace_back();
+        ShardLink &link = shardLinks.back();
+        link.shard = i;
+        link.pid = pid;
+        link.requestFd = requests[1];
+        link.replyFd = replies[0];
+    }
+    for (ShardLink &link : shardLinks)
+        link.reader = std::thread(shardReader, std::ref(link));
+    return true;
+}
+
+// Ask every shard to stop and wait for them. Returns false if one failed.
+bool stopShards() {
+    bool ok = true;
+    for (ShardLink &link : shardLinks) {
+        sendRequest(link, "exit");
+        flushRequests(link);
+        close(link.requestFd);
+    }
+    for (ShardLink &link : shardLinks) {
+        // Drain the items so that the reader can reach the end of the pipe
+        {
+            std::lock_guard<std::mutex> lock(link.latch);
+            routerReporting = false;
+            link.items.clear();
+            link.changed.notify_all();
+        }
+        int status;
+        if (waitpid(link.pid, &status, 0) != link.pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+        link.reader.join();
+        close(link.replyFd);
+    }
+    shardLinks.clear();
+    return ok;
+}
+
+bool shardStopped(const ShardLink &link) {
+    std::cerr << "Shard " << link.shard << " (" << shardPath(link.shard) << ") stopped." << std::endl;
+    return false;
+}
+
+// Combine the results of a line run on every shard: the first one that is not ok, or
+// the sums of the counts.
+std::string combineResults(const std::vector<std::string> &lines) {
+    std::vector<std::vector<std::string>> results;
+    for (const std::string &line : lines) {
+        results.push_back({});
+        std::stringstream in(line);
+        std::string field;
+        while (std::getline(in, field, ','))
+            results.back().push_back(field);
+        if (results.back().size() < 3 || results.back()[2] != "ok")
+            return line;
+    }
+    std::string combined = results[0][0] + "," + results[0][1] + ",ok";
+    for (size_t i = 3; i < results[0].size(); i++) {
+        long long sum = 0;
+        for (const auto &result : results)
+            sum += i < result.size() ? atoll(result[i].c_str()) : 0;
+        combined += "," + std::to_string(sum);
+    }
+    return combined;
+}
+
+// Batch lines sent and not printed yet: the shard of each, -1 for all of them.
+std::deque<int> routedLines;
+
+// Print the results of the routed lines in line order, as far as they have arrived
+// (wait false) or all of them (wait true, after a sync request).
+bool printRoutedResults(bool wait) {
+    RouteItem item;
+    while (!routedLines.empty()) {
+        int target = routedLines.front();
+        std::vector<std::string> lines;
+        for (ShardLink &link : shardLinks) {
+            if (target != -1 && link.shard != target)
+                continue;
+            // A fan-out line is taken only once every shard has its result
+            if (!wait) {
+                std::lock_guard<std::mutex> lock(link.latch);
+                if (link.items.empty())
+                    return true;
+            }
+        }
+        for (ShardLink &link : shardLinks) {
+            if (target != -1 && link.shard != target)
+                continue;
+            takeRouteItem(link, item);
+            if (item.kind != ROUTE_TEXT)
+                return shardStopped(link);
+            lines.push_back(item.line);
+        }
+        std::cout << (target == -1 ? combineResults(lines) : lines[0]) << "\n";
+        routedLines.pop_front();
+    }
+    return true;
+}
+
+// Send a request (a report or a sync) to the given shards; the results of the lines
+// before it are printed first.
+bool sendReport(const std::string &request, int target = -1) {
+    for (ShardLink &link : shardLinks) {
+        if ((target == -1 || link.shard == target) && !(sendRequest(link, request) && flushRequests(link)))
+            return shardStopped(link);
+    }
+    return printRoutedResults(true);
+}
+
+// Print the text a shard sends until its summary or the end of the report (kind),
+// keeping the last summary in summary.
+bool relayShardText(ShardLink &link, int kind, RouteSummary* summary = nullptr) {
+    RouteItem item;
+    while (takeRouteItem(link, item)) {
+        if (item.kind == ROUTE_TEXT) {
+            std::cout << item.line << "\n";
+            continue;
+        }
+        if (item.kind == ROUTE_STOPPED)
+            return shardStopped(link);
+        if (item.kind == ROUTE_SUMMARY && summary)
+            *summary = item.summary;
+        if (item.kind == kind)
+            return true;
+    }
+    return false;
+}
+
+// Wait for the lines sent so far and print their results (and anything else the
+// shards printed, such as the output of --generate at startup).
+bool syncShards() {
+    if (!sendReport("sync"))
+        return false;
+    for (ShardLink &link : shardLinks) {
+        if (!relayShardText(link, ROUTE_DONE))
+            return false;
+    }
+    std::cout.flush();
+    return true;
+}
+
+// range-m on every shard: the lists, each in phone order, are merged, and the shard
+// summaries added up into total.
+bool mergeBuyerRanges(RouteSummary &total) {
+    std::vector<RouteItem> heads(shardLinks.size());
+    auto next = [&](size_t i) {
+        if (!takeRouteItem(shardLinks[i], heads[i]))
+            return false;
+        if (heads[i].kind == ROUTE_SUMMARY) {
+            total.ok = total.ok && heads[i].summary.ok;
+            total.count += heads[i].summary.count;
+            return true;
+        }
+        return heads[i].kind == ROUTE_TEXT;
+    };
+    for (size_t i = 0; i < heads.size(); i++) {
+        if (!next(i))
+            return shardStopped(shardLinks[i]);
+    }
+    for (;;) {
+        int best = -1;
+        long long bestPhone = 0;
+        for (size_t i = 0; i < heads.size(); i++) {
+            if (heads[i].kind != ROUTE_TEXT)
+                continue;
+            long long phone = atoll(heads[i].line.c_str() + strlen("Phone: "));
+            if (best == -1 || phone < bestPhone) {
+                best = i;
+                bestPhone = phone;
+            }
+        }
+        if (best == -1)
+            break;
+        std::cout << heads[best].line << "\n";
+        if (!next(best))
+            return shardStopped(shardLinks[best]);
+    }
+    for (ShardLink &link : shardLinks) {
+        if (!relayShardText(link, ROUTE_DONE))
+            return false;
+    }
+    return true;
+}
+
+// Run a report line on the shards and print the merged result (see SHARDING).
+bool routeReport(int lineNo, const std::vector<std::string> &f, const std::string &line) {
+    const std::string &command = f[0];
+    int a = 0, b = 0;
+    double low = 0, high = 0;
+    bool noArgs = f.size() == 1 && (command == "calc-m" || command == "calc-s" || command == "ut-m" ||
+                                    command == "ut-s" || command == "pool-stats" || command == "stats" ||
+                                    command == "stats-json");
+    bool oneInt = f.size() == 2 && (command == "get-isbn" || command == "books-m") && parseInt(f[1], a);
+    bool twoInts = f.size() == 3 && (command == "range-m" || command == "join") && parseInt(f[1], a) && parseInt(f[2], b);
+    bool prices = f.size() == 3 && command == "range-price" && parseDouble(f[1], low) && parseDouble(f[2], high);
+    if (!noArgs && !oneInt && !twoInts && !prices) {
+        if (!printRoutedResults(false))
+            return false;
+        routedLines.push_back(0);
+        return sendRequest(shardLinks[0], std::to_string(lineNo) + "," + line);
     }
-    int buyerRecNum = it->recordNumber;
-    std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+    routerReporting = true;
+    bool ok = true;
+    RouteSummary total = {1, 0, 0, {0, 0, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()}};
+    std::vector<RouteSummary> summaries(shardLinks.size(), total);
+    auto allShards = [&](int kind) {
+        for (ShardLink &link : shardLinks) {
+            if (!relayShardText(link, kind, &summaries[link.shard]))
+                return false;
+        }
+        for (const RouteSummary &summary : summaries) {
+            total.ok = total.ok && summary.ok;
+            total.count += summary.count;
+            total.chains += summary.chains;
+        }
+        return true;
+    };
+    if (command == "books-m") {
+        ok = sendReport(line, shardOf(a)) && relayShardText(shardLinks[shardOf(a)], ROUTE_DONE);
+    } else if (!sendReport(line)) {
+        ok = false;
+    } else if (command == "calc-s") {
+        // The totals come first, then the buyers of every shard
+        for (ShardLink &link : shardLinks)
+            ok = ok && relayShardText(link, ROUTE_SUMMARY, &summaries[link.shard]);
+        PriceTotals &totals = total.totals;
+        for (const RouteSummary &summary : summaries) {
+            total.ok = total.ok && summary.ok;
+            totals.count += summary.totals.count;
+            totals.sum += summary.totals.sum;
+            totals.min = std::min(totals.min, summary.totals.min);
+            totals.max = std::max(totals.max, summary.totals.max);
+        }
+        if (ok && total.ok)
+            printPriceTotals(totals);
+        ok = ok && allShards(ROUTE_DONE);
+    } else if (command == "range-m") {
+        ok = mergeBuyerRanges(total);
+        if (ok && total.ok)
+            std::cout << "Buyers with phone in [" << a << ", " << b << "]: " << total.count << std::endl;
+    } else if (command == "join") {
+        std::cout << "\nPhone,Name,Address,ISBN,Title,Author,Price\n";
+        ok = allShards(ROUTE_DONE);
+        if (ok)
+            std::cout << "Pairs: " << total.count << " ("
+                      << (total.chains == shardCount ? "chain-following" : total.chains == 0 ? "hash join"
+                                                                                             : "chain-following, hash join")
+                      << ")" << std::endl;
+    } else if (command == "calc-m" || command == "get-isbn" || command == "range-price") {
+        ok = allShards(ROUTE_DONE);
+        if (ok && command == "calc-m" && total.ok)
+            std::cout << "Total valid buyer records: " << total.count << std::endl;
+        if (ok && command == "get-isbn" && total.ok)
+            printIsbnOwnerCount(a, total.count);
+        if (ok && command == "range-price" && total.ok)
+            std::cout << "Books with price in [" << low << ", " << high << "]: " << total.count << std::endl;
+    } else {
+        for (ShardLink &link : shardLinks) {
+            std::cout << "--- Shard " << link.shard << " (" << shardPath(link.shard) << ") ---\n";
+            ok = ok && relayShardText(link, ROUTE_DONE);
+        }
     }
-    mfile.seekg(buyerRecNum * sizeof(Buyer));
-    Buyer buyer;
-    mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
-        mfile.close();
-        return;
+    routerReporting = false;
+    std::cout.flush();
+    return ok;
+}
+
+// The router: run the lines of in (the prompt when interactive, see SHARDING) on the
+// shards, then stop them. Returns false if a shard failed.
+bool runRouter(const std::string &batchFile, bool interactive) {
+    bool ok = syncShards();
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (ok && !interactive && !batchFile.empty() && batchFile != "-") {
+        file.open(batchFile);
+        if (!file)
+            std::cerr << "Error opening batch file." << std::endl;
+        in = &file;
     }
-    // Search for the book in the linked list
-    int currentIndex = buyer.firstBook;
-    int prevIndex = -1;
-    bool found = false;
-    std::fstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
-        mfile.close();
-        return;
+    std::string line;
+    int lineNo = 0;
+    while (ok && (interactive || !batchFile.empty())) {
+        if (interactive)
+            std::cout << "\nEnter a batch line or a report (see --shards), or exit: " << std::flush;
+        if (!std::getline(*in, line))
+            break;
+        lineNo++;
+        std::vector<std::string> f = splitFields(line);
+        if (f.empty() || f[0][0] == '#')
+            continue;
+        if (f[0] == "exit" && interactive)
+            break;
+        if (f[0] == "calc-m" || f[0] == "calc-s" || f[0] == "ut-m" || f[0] == "ut-s" || f[0] == "get-isbn" ||
+            f[0] == "range-m" || f[0] == "books-m" || f[0] == "range-price" || f[0] == "join" ||
+            f[0] == "pool-stats" || f[0] == "stats" || f[0] == "stats-json") {
+            ok = routeReport(lineNo, f, line);
+        } else {
+            int phone;
+            int target = f[0] == "del-m-range" || f[0] == "del-s-where" || f[0] == "update-s-where" || f[0] == "vacuum"
+                       ? -1 : f.size() >= 2 && parseInt(f[1], phone) ? shardOf(phone) : 0;
+            routedLines.push_back(target);
+            for (ShardLink &link : shardLinks) {
+                if ((target == -1 || link.shard == target) && !sendRequest(link, std::to_string(lineNo) + "," + line))
+                    ok = shardStopped(link);
+            }
+            ok = ok && printRoutedResults(false);
+        }
+        if (ok && interactive)
+            ok = syncShards();
     }
-    while (currentIndex != -1) {
-        bkfile.seekg(currentIndex * sizeof(Book));
-        Book bookRec;
-        bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        if (bookRec.valid == 1 && bookRec.ISBN == ISBN) {
-            found = true;
-            // If this is the first record in the chain
-            if (prevIndex == -1) {
-                buyer.firstBook = bookRec.nextBook;
+    ok = ok && syncShards();
+    return stopShards() && ok;
+}
+
+// ===================== BENCHMARK =====================
+// --bench <threads> measures throughput on the current files with 1, 2, 4, ... up
+// to <threads> threads. Each step has two runs of BENCH_SECONDS:
+//   read-only  get-m on random buyers and get-s on random books (half each);
+//   mixed      the same with BENCH_WRITE_PERCENT of the operations replaced by
+//              insert-s / del-s pairs on random buyers, committed one by one, so
+//              the log commits of concurrent threads are grouped.
+// The books the mixed run inserts use negative ISBNs and are deleted again.
+const int BENCH_SECONDS = 2;
+const int BENCH_WRITE_PERCENT = 10;
+const int BENCH_MAX_KEYS = 1 << 20;    // Keys sampled from each index
+
+struct BenchKeys {
+    std::vector<int> phones;
+    std::vector<long long> books;      // (phone, ISBN) keys
+};
+
+BenchKeys collectBenchKeys() {
+    ExclusiveLatch engine(engineLatch);
+    BenchKeys keys;
+    IndexCursor cursor = btreeSeek(masterIndex, LLONG_MIN);
+    BTreeEntry entry;
+    while ((int)keys.phones.size() < BENCH_MAX_KEYS && btreeNext(masterIndex, cursor, entry))
+        keys.phones.push_back((int)entry.key);
+    cursor = btreeSeek(phoneIsbnIndex, LLONG_MIN);
+    while ((int)keys.books.size() < BENCH_MAX_KEYS && btreeNext(phoneIsbnIndex, cursor, entry))
+        keys.books.push_back(entry.key);
+    return keys;
+}
+
+void benchWorker(int id, int writePercent, const BenchKeys &keys, const std::atomic<bool> &stop,
+                 std::atomic<long long> &total, std::atomic<long long> &errors) {
+    std::mt19937 rng(id * 7919 + writePercent);
+    long long ops = 0;
+    int nextIsbn = -(id + 1) * 10000000;   // Private range of ISBNs for this thread
+    int pendingPhone = 0, pendingIsbn = 0;
+    bool pending = false;                   // A book inserted by this thread still has to be deleted
+    while (!stop.load(std::memory_order_relaxed)) {
+        int roll = rng() % 100;
+        if (roll < writePercent) {
+            OpStatus status;
+            if (pending) {
+                status = commitOp(opDelSlave(pendingPhone, pendingIsbn));
+                pending = false;
             } else {
-                // Update nextBook of the previous record
-                bkfile.seekg(prevIndex * sizeof(Book));
-                Book prevRec;
-                bkfile.read(reinterpret_cast<char*>(&prevRec), sizeof(Book));
-                prevRec.nextBook = bookRec.nextBook;
-                bkfile.seekp(prevIndex * sizeof(Book));
-                bkfile.write(reinterpret_cast<char*>(&prevRec), sizeof(Book));
+                Book bookRec;
+                memset(&bookRec, 0, sizeof(Book));
+                bookRec.phone = keys.phones[rng() % keys.phones.size()];
+                bookRec.ISBN = nextIsbn--;
+                copyField(bookRec.name, "bench");
+                copyField(bookRec.author, "bench");
+                int recNum;
+                status = commitOp(opInsertSlave(bookRec, recNum));
+                pending = status == OP_OK;
+                pendingPhone = bookRec.phone;
+                pendingIsbn = bookRec.ISBN;
             }
-            bookRec.valid = 0;
-            bkfile.seekp(currentIndex * sizeof(Book));
-            bkfile.write(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-            slaveGarbage.push_back(currentIndex);
-            buyer.bookCount--;
-            break;
+            if (status != OP_OK)
+                errors++;
+            checkpointIfNeeded();
+        } else if (roll % 2 == 0 || keys.books.empty()) {
+            Buyer buyer;
+            if (opGetMaster(keys.phones[rng() % keys.phones.size()], buyer) != OP_OK)
+                errors++;
+        } else {
+            long long key = keys.books[rng() % keys.books.size()];
+            Book bookRec;
+            if (opGetSlave(compositeHigh(key), compositeLow(key), bookRec) != OP_OK)
+                errors++;
         }
-        prevIndex = currentIndex;
-        currentIndex = bookRec.nextBook;
-    }
-    bkfile.close();
-    mfile.seekp(buyerRecNum * sizeof(Buyer));
-    mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    mfile.close();
-    if (!found)
-        std::cout << "Book record not found." << std::endl;
-    else
-        std::cout << "Book record deleted." << std::endl;
+        ops++;
+    }
+    if (pending && commitOp(opDelSlave(pendingPhone, pendingIsbn)) != OP_OK)
+        errors++;
+    total += ops;
 }
 
-// ===================== UPDATE FUNCTIONS =====================
+// Run threads workers for BENCH_SECONDS and return the operations per second.
+double benchRun(int threads, int writePercent, const BenchKeys &keys, long long &errors) {
+    std::atomic<bool> stop(false);
+    std::atomic<long long> total(0), failed(0);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back(benchWorker, i, writePercent, std::cref(keys), std::cref(stop),
+                             std::ref(total), std::ref(failed));
+    std::this_thread::sleep_for(std::chrono::seconds(BENCH_SECONDS));
+    stop = true;
+    for (auto &w : workers)
+        w.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    errors = failed;
+    return total / elapsed.count();
+}
 
-// update-m: Update a non-key field (name, address) of a buyer record.
-void updateMaster() {
-    int phone;
-    std::cout << "Enter Phone to update: ";
-    std::cin >> phone;
-    
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
-    }
-    int recNum = it->recordNumber;
-    std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
-    }
-    mfile.seekg(recNum * sizeof(Buyer));
-    Buyer buyer;
-    mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
-        mfile.close();
+void runBenchmark(int maxThreads) {
+    BenchKeys keys = collectBenchKeys();
+    if (keys.phones.empty()) {
+        std::cout << "No buyers to benchmark with." << std::endl;
         return;
     }
-    int choice;
-    std::cout << "Select field to update:\n1. Name\n2. Address\nChoice: ";
-    std::cin >> choice;
-    switch(choice) {
-        case 1:
-            std::cout << "Enter new Name: ";
-            std::cin >> buyer.name;
-            break;
-        case 2:
-            std::cout << "Enter new Address: ";
-            std::cin >> buyer.address;
+    std::cout << "Benchmark: " << keys.phones.size() << " buyers, " << keys.books.size()
+              << " books, " << BENCH_SECONDS << " s per run" << std::endl;
+    std::cout << "threads  read-only ops/s  mixed ops/s (" << BENCH_WRITE_PERCENT << "% writes)" << std::endl;
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        long long readErrors, mixedErrors;
+        double reads = benchRun(threads, 0, keys, readErrors);
+        double mixed = benchRun(threads, BENCH_WRITE_PERCENT, keys, mixedErrors);
+        std::cout << threads << "  " << (long long)reads << "  " << (long long)mixed;
+        if (readErrors + mixedErrors > 0)
+            std::cout << "  (" << readErrors + mixedErrors << " failed operations)";
+        std::cout << std::endl;
+        if (threads == maxThreads)
             break;
-        default:
-            std::cout << "Invalid choice." << std::endl;
-            mfile.close();
-            return;
     }
-    mfile.seekp(recNum * sizeof(Buyer));
-    mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    mfile.close();
-    std::cout << "Buyer record updated." << std::endl;
 }
 
-// update-s: Update a non-key field (name, author, price) of a book record.
-void updateSlave() {
-    int phone, ISBN;
-    std::cout << "Enter Phone for book update: ";
-    std::cin >> phone;
-    std::cout << "Enter ISBN of book to update: ";
-    std::cin >> ISBN;
-    
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
+// --bench <threads> --workload <get>,<insert>,<update>,<delete>[,<scan>] instead replays
+// one mixed workload with <threads> threads for WORKLOAD_SECONDS, the numbers being
+// the percentages of each kind of operation. Gets are get-m or get-s and updates
+// update-m (name) or update-s (price), half each, on random existing keys; inserts add
+// books to random buyers and deletes remove books the same thread inserted (while it
+// has none, an insert is done instead). A scan reads B.fl and BK.fl in full from a
+// snapshot, like calc-s, and fails unless the book counts of the buyers add up to the
+// valid books. Mutations are committed one by one, as at the
+// prompt, and the books still inserted at the end are deleted again. Throughput and
+// the p50/p99/p999 latency of each operation are reported; a latency includes the
+// checkpoint the operation may have run.
+const int WORKLOAD_SECONDS = 10;
+
+enum BenchOp { BENCH_GET_M, BENCH_GET_S, BENCH_INSERT_S, BENCH_UPDATE_M, BENCH_UPDATE_S, BENCH_DEL_S, BENCH_SCAN,
+               BENCH_OP_KINDS };
+const char* BENCH_OP_NAMES[BENCH_OP_KINDS] = {"get-m", "get-s", "insert-s", "update-m", "update-s", "del-s", "scan"};
+
+struct Workload {
+    int get, insert, update, del, scan;   // Percentages
+};
+
+OpStatus snapshotScan() {
+    ReportSnapshot rs({&masterFile, &slaveFile});
+    std::vector<long long> counted(scanThreads, 0), valid(scanThreads, 0);
+    bool ok = parallelScan<Buyer>(masterFile, 0, rs.records(masterFile), [&](int w, int, const Buyer* buyers, int n) {
+        for (int i = 0; i < n; i++)
+            counted[w] += buyers[i].valid == 1 ? buyers[i].bookCount : 0;
+    }, &rs.snap);
+    ok = ok && parallelScan<Book>(slaveFile, 0, rs.records(slaveFile), [&](int w, int, const Book* books, int n) {
+        valid[w] += countValid(books, n);
+    }, &rs.snap);
+    long long difference = 0;
+    for (int w = 0; w < scanThreads; w++)
+        difference += counted[w] - valid[w];
+    return ok && difference == 0 ? OP_OK : OP_IO_ERROR;
+}
+
+Histogram benchLatency[BENCH_OP_KINDS];
+
+void workloadWorker(int id, Workload mix, const BenchKeys &keys, const std::atomic<bool> &stop,
+                    std::atomic<long long> &errors) {
+    std::mt19937 rng(id * 7919 + 17);
+    int nextIsbn = -(id + 1) * 10000000;   // Private range of ISBNs for this thread
+    std::vector<long long> inserted;        // (phone, ISBN) of the books still to delete
+    auto timed = [&](BenchOp op, auto run) {
+        auto start = std::chrono::steady_clock::now();
+        OpStatus status = run();
+        if (op >= BENCH_INSERT_S && op != BENCH_SCAN)
+            checkpointIfNeeded();
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        histogramAdd(benchLatency[op], elapsed.count());
+        if (status != OP_OK)
+            errors++;
+        return status;
+    };
+    while (!stop.load(std::memory_order_relaxed)) {
+        int roll = rng() % 100;
+        bool half = rng() % 2 == 0 || keys.books.empty();
+        int phone = keys.phones[rng() % keys.phones.size()];
+        long long key = keys.books.empty() ? 0 : keys.books[rng() % keys.books.size()];
+        if (roll < mix.get && half) {
+            Buyer buyer;
+            timed(BENCH_GET_M, [&] { return opGetMaster(phone, buyer); });
+        } else if (roll < mix.get) {
+            Book bookRec;
+            timed(BENCH_GET_S, [&] { return opGetSlave(compositeHigh(key), compositeLow(key), bookRec); });
+        } else if (roll < mix.get + mix.update && half) {
+            timed(BENCH_UPDATE_M, [&] { return commitOp(opUpdateMaster(phone, FIELD_NAME, "bench")); });
+        } else if (roll < mix.get + mix.update) {
+            std::string price = std::to_string(rng() % 10000 / 100.0);
+            timed(BENCH_UPDATE_S, [&] {
+                return commitOp(opUpdateSlave(compositeHigh(key), compositeLow(key), FIELD_PRICE, price));
+            });
+        } else if (roll < mix.get + mix.update + mix.del && !inserted.empty()) {
+            size_t pick = rng() % inserted.size();
+            long long book = inserted[pick];
+            inserted[pick] = inserted.back();
+            inserted.pop_back();
+            timed(BENCH_DEL_S, [&] { return commitOp(opDelSlave(compositeHigh(book), compositeLow(book))); });
+        } else if (roll < mix.get + mix.update + mix.insert + mix.del) {
+            Book bookRec;
+            memset(&bookRec, 0, sizeof(Book));
+            bookRec.phone = phone;
+            bookRec.ISBN = nextIsbn--;
+            copyField(bookRec.name, "bench");
+            copyField(bookRec.author, "bench");
+            int recNum;
+            if (timed(BENCH_INSERT_S, [&] { return commitOp(opInsertSlave(bookRec, recNum)); }) == OP_OK)
+                inserted.push_back(compositeKey(bookRec.phone, bookRec.ISBN));
+        } else {
+            timed(BENCH_SCAN, snapshotScan);
+        }
     }
-    int buyerRecNum = it->recordNumber;
-    std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+    for (long long book : inserted) {
+        if (commitOp(opDelSlave(compositeHigh(book), compositeLow(book))) != OP_OK)
+            errors++;
     }
-    mfile.seekg(buyerRecNum * sizeof(Buyer));
-    Buyer buyer;
-    mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    mfile.close();
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
+}
+
+void runWorkload(int threads, Workload mix) {
+    BenchKeys keys = collectBenchKeys();
+    if (keys.phones.empty()) {
+        std::cout << "No buyers to benchmark with." << std::endl;
         return;
     }
-    int currentIndex = buyer.firstBook;
-    int targetIndex = -1;
-    std::fstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
-        return;
+    for (auto &h : benchLatency)
+        resetHistogram(h);
+    std::cout << "Workload: " << keys.phones.size() << " buyers, " << keys.books.size() << " books, " << threads
+              << " threads, " << WORKLOAD_SECONDS << " s, get " << mix.get << "% insert " << mix.insert
+              << "% update " << mix.update << "% delete " << mix.del << "%";
+    if (mix.scan > 0)
+        std::cout << " scan " << mix.scan << "%";
+    std::cout << std::endl;
+    std::atomic<bool> stop(false);
+    std::atomic<long long> errors(0);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back(workloadWorker, i, mix, std::cref(keys), std::cref(stop), std::ref(errors));
+    std::this_thread::sleep_for(std::chrono::seconds(WORKLOAD_SECONDS));
+    stop = true;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (auto &w : workers)
+        w.join();
+    long long total = 0;
+    std::cout << "operation  count  ops/s  p50 us  p99 us  p999 us" << std::endl;
+    for (int op = 0; op < BENCH_OP_KINDS; op++) {
+        const Histogram &h = benchLatency[op];
+        if (h.total == 0)
+            continue;
+        total += h.total;
+        std::cout << BENCH_OP_NAMES[op] << "  " << h.total << "  " << (long long)(h.total / elapsed.count()) << "  "
+                  << histogramPercentile(h, 0.5) / 1000.0 << "  " << histogramPercentile(h, 0.99) / 1000.0 << "  "
+                  << histogramPercentile(h, 0.999) / 1000.0 << std::endl;
     }
-    Book bookRec;
-    bool found = false;
-    while (currentIndex != -1) {
-        bkfile.seekg(currentIndex * sizeof(Book));
-        bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        if (bookRec.valid == 1 && bookRec.ISBN == ISBN) {
-            found = true;
-            targetIndex = currentIndex;
-            break;
+    std::cout << "total  " << total << "  " << (long long)(total / elapsed.count());
+    if (errors > 0)
+        std::cout << "  (" << errors << " failed operations)";
+    std::cout << std::endl;
+}
+
+// --generate <buyers> <books per buyer> <uniform|zipf> fills empty files with a
+// synthetic dataset through the batch bulk loads. Buyers get the phones 1..<buyers>
+// and each one a number of books around the given mean: uniformly drawn from
+// [0, 2 * mean], or following a Zipf law (the k-th buyer by book count has 1/k of
+// the first one's books; the counts are shuffled over the phones). ISBNs are
+// distinct and authors are drawn from GENERATE_AUTHORS names.
+const unsigned GENERATE_SEED = 12345;
+const int GENERATE_AUTHORS = 1000;
+
+bool generateDataset(int buyers, int booksPerBuyer, bool zipf) {
+    if (masterFile.recordCount > 0 || slaveFile.recordCount > 0) {
+        std::cerr << "--generate needs empty files." << std::endl;
+        return false;
+    }
+    // ISBNs and line numbers run from 1 over the whole dataset and must fit in an int
+    auto tooMany = [&] {
+        std::cerr << "--generate makes at most " << INT_MAX - buyers << " books with " << buyers << " buyers."
+                  << std::endl;
+        return false;
+    };
+    if (booksPerBuyer > INT_MAX / 2)
+        return tooMany();
+    auto start = std::chrono::steady_clock::now();
+    std::mt19937 rng(GENERATE_SEED);
+    std::vector<int> counts(buyers);
+    if (zipf) {
+        double harmonic = 0;
+        for (int k = 1; k <= buyers; k++)
+            harmonic += 1.0 / k;
+        std::uniform_real_distribution<double> unit(0, 1);
+        for (int k = 1; k <= buyers; k++) {
+            double share = (double)buyers * booksPerBuyer / (k * harmonic);
+            if (share >= INT_MAX)
+                return tooMany();
+            counts[k - 1] = (int)share + (unit(rng) < share - (int)share ? 1 : 0);
         }
-        currentIndex = bookRec.nextBook;
+        std::shuffle(counts.begin(), counts.end(), rng);
+    } else {
+        std::uniform_int_distribution<int> draw(0, 2 * booksPerBuyer);
+        for (int &count : counts)
+            count = draw(rng);
     }
-    if (!found) {
-        std::cout << "Book record not found." << std::endl;
-        bkfile.close();
-        return;
+    long long total = 0;
+    for (int count : counts)
+        total += count;
+    if (total > INT_MAX - buyers)
+        return tooMany();
+    // The bulk loads print one result per record, which is not wanted here
+    auto discardResults = [] {
+        walCommit();
+        batchOut.str("");
+    };
+    // A shard keeps its own buyers of the dataset; the draws stay the same
+    auto own = [](int phone) { return shardIndex < 0 || shardOf(phone) == shardIndex; };
+    int lineNo = 0;
+    long long ownBuyers = 0;
+    for (int i = 0; i < buyers; i++) {
+        BatchBuyer item;
+        memset(&item.buyer, 0, sizeof(Buyer));
+        item.lineNo = ++lineNo;
+        item.buyer.phone = i + 1;
+        copyField(item.buyer.name, "Buyer " + std::to_string(i + 1));
+        copyField(item.buyer.address, "Street " + std::to_string(rng() % 10000));
+        if (!own(i + 1))
+            continue;
+        pendingBuyers.push_back(item);
+        ownBuyers++;
+        if (pendingBuyers.size() >= (size_t)BATCH_RUN_LIMIT) {
+            flushPendingBuyers();
+            discardResults();
+        }
     }
-    int choice;
-    std::cout << "Select field to update:\n1. Name\n2. Author\n3. Price\nChoice: ";
-    std::cin >> choice;
-    switch(choice) {
-        case 1:
-            std::cout << "Enter new Name: ";
-            std::cin >> bookRec.name;
-            break;
-        case 2:
-            std::cout << "Enter new Author: ";
-            std::cin >> bookRec.author;
-            break;
-        case 3:
-            std::cout << "Enter new Price: ";
-            std::cin >> bookRec.price;
-            break;
-        default:
-            std::cout << "Invalid choice." << std::endl;
-            bkfile.close();
-            return;
+    flushPendingBuyers();
+    discardResults();
+    long long books = 0;
+    int ISBN = 1;
+    for (int i = 0; i < buyers; i++) {
+        for (int j = 0; j < counts[i]; j++) {
+            BatchBook item;
+            memset(&item.book, 0, sizeof(Book));
+            item.lineNo = ++lineNo;
+            item.book.phone = i + 1;
+            item.book.ISBN = ISBN++;
+            copyField(item.book.name, "Book " + std::to_string(item.book.ISBN));
+            copyField(item.book.author, "Author " + std::to_string(rng() % GENERATE_AUTHORS));
+            item.book.price = 1 + rng() % 10000 / 100.0;
+            if (!own(i + 1))
+                continue;
+            pendingBooks.push_back(item);
+            books++;
+            if (pendingBooks.size() >= (size_t)BATCH_RUN_LIMIT) {
+                flushPendingBooks();
+                discardResults();
+            }
+        }
     }
-    bkfile.seekp(targetIndex * sizeof(Book));
-    bkfile.write(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-    bkfile.close();
-    std::cout << "Book record updated." << std::endl;
+    flushPendingBooks();
+    discardResults();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    bool ok = masterIndex.header.keyCount == ownBuyers && phoneIsbnIndex.header.keyCount == books;
+    std::cout << "Generated " << masterIndex.header.keyCount << " buyers and " << phoneIsbnIndex.header.keyCount
+              << " books (" << (zipf ? "zipf" : "uniform") << ") in " << elapsed.count() << " s" << std::endl;
+    if (!ok)
+        std::cerr << "Error generating dataset." << std::endl;
+    return ok;
 }
 
-// ===================== INSERT FUNCTIONS =====================
+// ===================== CONVERSION =====================
+// --convert migrates B.fl and BK.fl of older versions, which had no header (format
+// version 1), to the current format. Older master files come in two layouts: the
+// original 80-byte buyers and the 88-byte ones with firstExtent/extentCount; the layout
+// is told from the file size and the contents. Record numbers do not change, so the
+// indexes and garbage files stay valid. The log must hold no operations to replay,
+// because its offsets describe the old files; it is removed before the first file is
+// replaced, so an interrupted conversion can simply be run again. BK.fl is also
+// rewritten when its storage differs from the one selected: compressed blocks with
+// --compress, plain records without.
+const int CONVERT_CHUNK_RECORDS = 65536;   // Records read and written per call
 
-// insert-m: Insert a new buyer record into B.fl, using the master garbage zone if available.
-void insertMaster() {
-    Buyer buyer;
-    std::cout << "Enter Phone: ";
-    std::cin >> buyer.phone;
-    std::cout << "Enter Name: ";
-    std::cin >> buyer.name;
-    std::cout << "Enter Address: ";
-    std::cin >> buyer.address;
-    buyer.firstBook = -1;
-    buyer.bookCount = 0;
-    buyer.valid = 1;
-    
-    int recNum;
-    // Use a free record from masterGarbage if available.
-    if (!masterGarbage.empty()) {
-        recNum = masterGarbage.back();
-        masterGarbage.pop_back();
-        std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in | std::ios::out);
-        if (!mfile) {
-            std::cerr << "Error opening master file." << std::endl;
-            return;
+// Buyer of the versions before the extents
+struct OldBuyer {
+    int phone;
+    char name[31];
+    char address[31];
+    int firstBook;
+    int bookCount;
+    int valid;
+};
+
+// Call fn(record) for every record of a headerless file until fn returns false.
+// Returns false on a read error or when fn stopped the scan.
+template <typename Rec, typename Fn>
+bool forEachOldRecord(const char* fileName, Fn fn) {
+    std::ifstream in(fileName, std::ios::binary);
+    std::vector<Rec> recs(CONVERT_CHUNK_RECORDS);
+    while (in) {
+        in.read(reinterpret_cast<char*>(recs.data()), recs.size() * sizeof(Rec));
+        size_t count = in.gcount() / sizeof(Rec);
+        for (size_t i = 0; i < count; i++) {
+            if (!fn(recs[i]))
+                return false;
         }
-        mfile.seekp(recNum * sizeof(Buyer));
-        mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-        mfile.close();
-    } else {
-        std::ofstream mfile(MASTER_FILE, std::ios::binary | std::ios::app);
-        if (!mfile) {
-            std::cerr << "Error opening master file." << std::endl;
-            return;
+    }
+    return in.eof();
+}
+
+// Write the records produced by next(Rec&) (false at the end) as a current-format
+// file, replacing fileName once it is synced.
+template <typename Rec, typename Next>
+bool writeConvertedFile(const char* fileName, int count, Next next) {
+    std::string tempName = std::string(fileName) + ".tmp";
+    int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    std::vector<char> head(FILE_HEADER_BYTES, 0);
+    FileHeader header = {FILE_MAGIC, FILE_VERSION, (int)sizeof(Rec), count, 0};
+    memcpy(head.data(), &header, sizeof(header));
+    bool ok = write(fd, head.data(), head.size()) == (ssize_t)head.size();
+    std::vector<Rec> recs;
+    recs.reserve(CONVERT_CHUNK_RECORDS);
+    for (int done = 0; ok && done < count; ) {
+        recs.clear();
+        Rec rec;
+        while ((int)recs.size() < CONVERT_CHUNK_RECORDS && done + (int)recs.size() < count && next(rec))
+            recs.push_back(rec);
+        if (recs.empty()) {
+            ok = false;
+            break;
         }
-        mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-        mfile.close();
-        std::ifstream in(MASTER_FILE, std::ios::binary);
-        in.seekg(0, std::ios::end);
-        recNum = in.tellg() / sizeof(Buyer) - 1;
-        in.close();
+        size_t bytes = recs.size() * sizeof(Rec);
+        ok = write(fd, recs.data(), bytes) == (ssize_t)bytes;
+        done += recs.size();
     }
-    // Update the index table.
-    IndexRecord ir;
-    ir.phone = buyer.phone;
-    ir.recordNumber = recNum;
-    indexTable.push_back(ir);
-    std::sort(indexTable.begin(), indexTable.end(), [](const IndexRecord &a, const IndexRecord &b) {
-        return a.phone < b.phone;
+    ok = ok && fdatasync(fd) == 0;
+    close(fd);
+    return ok && rename(tempName.c_str(), fileName) == 0 && syncDirectory();
+}
+
+// Copy a headerless file of count records of OldRec into the current format, with
+// convert(old, rec) filling each new record.
+template <typename OldRec, typename Rec, typename Convert>
+bool convertRecords(const char* fileName, int count, Convert convert) {
+    std::ifstream in(fileName, std::ios::binary);
+    return writeConvertedFile<Rec>(fileName, count, [&](Rec &rec) {
+        OldRec old;
+        if (!in.read(reinterpret_cast<char*>(&old), sizeof(OldRec)))
+            return false;
+        convert(old, rec);
+        return true;
     });
-    std::cout << "Buyer record inserted." << std::endl;
 }
 
-// insert-s: Insert a new book record into BK.fl and link it as the first record in the buyer's chain.
-void insertSlave() {
-    int phone;
-    std::cout << "Enter Phone for the book: ";
-    std::cin >> phone;
-    // Find the buyer.
-    auto it = std::lower_bound(indexTable.begin(), indexTable.end(), phone,
-        [](const IndexRecord &ir, int id) { return ir.phone < id; });
-    if (it == indexTable.end() || it->phone != phone) {
-        std::cout << "Buyer not found." << std::endl;
-        return;
+// Size of the file, -1 if it does not exist. header is zeroed unless the file is in
+// the current format.
+long long dataFileSize(const char* fileName, size_t recSize, FileHeader &header) {
+    memset(&header, 0, sizeof(header));
+    struct stat st;
+    if (stat(fileName, &st) != 0)
+        return -1;
+    std::ifstream in(fileName, std::ios::binary);
+    if (st.st_size < FILE_HEADER_BYTES || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != FILE_MAGIC || header.version != FILE_VERSION || header.recordSize != (int)recSize)
+        memset(&header, 0, sizeof(header));
+    return st.st_size;
+}
+
+bool plausibleLink(int recNum, long long count) {
+    return recNum >= -1 && recNum < count;
+}
+
+// Rewrite the records of source (headerless, plain or compressed) as BK.fl in the
+// format --compress selects, replacing the file once the new one (and its directory)
+// is synced.
+bool rewriteSlaveFile(const RecordFile &source) {
+    std::string tempName = std::string(SLAVE_FILE) + ".tmp";
+    RecordFile target;
+    target.fileName = SLAVE_FILE;
+    target.recSize = sizeof(Book);
+    target.recordsPerPage = RECORDS_PER_PAGE;
+    target.recordCount = source.recordCount;
+    target.dataOffset = FILE_HEADER_BYTES;
+    target.compressed = compressSlave;
+    target.directoryName = SLAVE_DIRECTORY_FILE;
+    target.sectorHand = 0;
+    target.fd = open(tempName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (target.fd < 0)
+        return false;
+    bool ok = ftruncate(target.fd, FILE_HEADER_BYTES) == 0 && writeFileHeader(target);
+    std::vector<char> page(RECORDS_PER_PAGE * sizeof(Book));
+    for (int first = 0; ok && first < target.recordCount; first += RECORDS_PER_PAGE) {
+        int records = std::min(RECORDS_PER_PAGE, target.recordCount - first);
+        ssize_t bytes = records * sizeof(Book);
+        ok = readPage(source, first / RECORDS_PER_PAGE, page.data()) &&
+             (target.compressed ? storeBlock(target, first / RECORDS_PER_PAGE, page.data(), records)
+                                : pwrite(target.fd, page.data(), bytes, FILE_HEADER_BYTES + (off_t)first * sizeof(Book)) == bytes);
     }
-    int buyerRecNum = it->recordNumber;
-    std::fstream mfile(MASTER_FILE, std::ios::binary | std::ios::in | std::ios::out);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+    ok = ok && fdatasync(target.fd) == 0 && (!target.compressed || writeDirectory(target));
+    close(target.fd);
+    ok = ok && rename(tempName.c_str(), SLAVE_FILE) == 0 && syncDirectory();
+    if (ok && !target.compressed)
+        unlink(SLAVE_DIRECTORY_FILE);
+    return ok;
+}
+
+bool convertFiles() {
+    FileHeader masterHeader, slaveHeader;
+    long long masterSize = dataFileSize(MASTER_FILE, sizeof(Buyer), masterHeader);
+    long long slaveSize = dataFileSize(SLAVE_FILE, sizeof(Book), slaveHeader);
+    bool slaveCurrent = slaveHeader.magic == FILE_MAGIC;
+    bool slaveCompressed = (slaveHeader.flags & FILE_COMPRESSED) != 0;
+    bool convertMaster = masterSize > 0 && masterHeader.magic != FILE_MAGIC;
+    bool convertSlave = slaveSize > 0 && (!slaveCurrent || slaveCompressed != compressSlave);
+    if (!convertMaster && !convertSlave) {
+        std::cout << "The files are in the current format (version " << FILE_VERSION << ")." << std::endl;
+        return true;
     }
-    mfile.seekg(buyerRecNum * sizeof(Buyer));
-    Buyer buyer;
-    mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    if (buyer.valid == 0) {
-        std::cout << "Buyer record is deleted." << std::endl;
-        mfile.close();
-        return;
+    // Books as counted by the slave file, for the checks of the master file
+    long long books = !slaveCurrent ? std::max(0LL, slaveSize) / (long long)sizeof(Book)
+                    : slaveCompressed ? slaveHeader.recordCount : (slaveSize - FILE_HEADER_BYTES) / (long long)sizeof(Book);
+    if (!slaveCurrent && slaveSize > 0 &&
+        (slaveSize % sizeof(Book) != 0 || !forEachOldRecord<Book>(SLAVE_FILE, [&](const Book &book) {
+             return (book.valid == 0 || book.valid == 1) && plausibleLink(book.nextBook, books);
+         }))) {
+        std::cerr << SLAVE_FILE << " is not a file of book records." << std::endl;
+        return false;
     }
-    // Prepare the book record.
-    Book bookRec;
-    bookRec.phone = phone;
-    std::cout << "Enter ISBN: ";
-    std::cin >> bookRec.ISBN;
-    std::cout << "Enter Name: ";
-    std::cin >> bookRec.name;
-    std::cout << "Enter Author: ";
-    std::cin >> bookRec.author;
-    std::cout << "Enter Price: ";
-    std::cin >> bookRec.price;
-    bookRec.nextBook = buyer.firstBook; // New record becomes the first in the chain.
-    bookRec.valid = 1;
-    
-    int recNum;
-    if (!slaveGarbage.empty()) {
-        recNum = slaveGarbage.back();
-        slaveGarbage.pop_back();
-        std::fstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::in | std::ios::out);
-        if (!bkfile) {
-            std::cerr << "Error opening slave file." << std::endl;
-            mfile.close();
-            return;
+    // Try the newer master layout first
+    int layout = 0;
+    if (convertMaster && masterSize % sizeof(Buyer) == 0 &&
+        forEachOldRecord<Buyer>(MASTER_FILE, [&](const Buyer &buyer) {
+            return (buyer.valid == 0 || buyer.valid == 1) && buyer.bookCount >= 0 && buyer.extentCount >= 0 &&
+                   plausibleLink(buyer.firstBook, books) && plausibleLink(buyer.firstExtent, books);
+        }))
+        layout = sizeof(Buyer);
+    else if (convertMaster && masterSize % sizeof(OldBuyer) == 0 &&
+             forEachOldRecord<OldBuyer>(MASTER_FILE, [&](const OldBuyer &buyer) {
+                 return (buyer.valid == 0 || buyer.valid == 1) && buyer.bookCount >= 0 &&
+                        plausibleLink(buyer.firstBook, books);
+             }))
+        layout = sizeof(OldBuyer);
+    if (convertMaster && layout == 0) {
+        std::cerr << MASTER_FILE << " is not a file of buyer records." << std::endl;
+        return false;
+    }
+    // Finish a checkpoint the old version left half done; a log with operations (or
+    // with pages for a compressed file) needs a normal start first
+    std::vector<WalOp> replay;
+    if (!recoverFiles(replay)) {
+        std::cerr << "Error recovering from log file." << std::endl;
+        return false;
+    }
+    if (!replay.empty() || !recoveredPages.empty()) {
+        std::cerr << WAL_FILE << " holds changes of an interrupted run; open the files once with the "
+                  << "version that wrote them, then convert." << std::endl;
+        return false;
+    }
+    if (unlink(WAL_FILE) != 0 && errno != ENOENT) {
+        std::cerr << "Error removing " << WAL_FILE << "." << std::endl;
+        return false;
+    }
+    if (convertMaster) {
+        int count = masterSize / layout;
+        bool ok = layout == sizeof(Buyer)
+            ? convertRecords<Buyer, Buyer>(MASTER_FILE, count, [](const Buyer &old, Buyer &rec) { rec = old; })
+            : convertRecords<OldBuyer, Buyer>(MASTER_FILE, count, [](const OldBuyer &old, Buyer &rec) {
+                  memset(&rec, 0, sizeof(Buyer));
+                  rec.phone = old.phone;
+                  memcpy(rec.name, old.name, sizeof(rec.name));
+                  memcpy(rec.address, old.address, sizeof(rec.address));
+                  rec.firstBook = old.firstBook;
+                  rec.bookCount = old.bookCount;
+                  rec.firstExtent = -1;
+                  rec.extentCount = 0;
+                  rec.valid = old.valid;
+              });
+        if (!ok) {
+            std::cerr << "Error converting " << MASTER_FILE << "." << std::endl;
+            return false;
         }
-        bkfile.seekp(recNum * sizeof(Book));
-        bkfile.write(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        bkfile.close();
-    } else {
-        std::ofstream bkfile(SLAVE_FILE, std::ios::binary | std::ios::app);
-        if (!bkfile) {
-            std::cerr << "Error opening slave file." << std::endl;
-            mfile.close();
-            return;
+        std::cout << "Converted " << MASTER_FILE << ": " << count << " buyers (" << layout << "-byte records)." << std::endl;
+    }
+    if (convertSlave) {
+        RecordFile source;
+        source.fileName = SLAVE_FILE;
+        source.recSize = sizeof(Book);
+        source.recordsPerPage = RECORDS_PER_PAGE;
+        source.recordCount = books;
+        source.dataOffset = slaveCurrent ? FILE_HEADER_BYTES : 0;
+        source.compressed = slaveCompressed;
+        source.directoryName = SLAVE_DIRECTORY_FILE;
+        source.fd = open(SLAVE_FILE, O_RDONLY);
+        bool ok = source.fd >= 0 && (!source.compressed || loadDirectory(source)) && rewriteSlaveFile(source);
+        if (source.fd >= 0)
+            close(source.fd);
+        if (!ok) {
+            std::cerr << "Error converting " << SLAVE_FILE << "." << std::endl;
+            return false;
         }
-        bkfile.write(reinterpret_cast<char*>(&bookRec), sizeof(Book));
-        bkfile.close();
-        std::ifstream in(SLAVE_FILE, std::ios::binary);
-        in.seekg(0, std::ios::end);
-        recNum = in.tellg() / sizeof(Book) - 1;
-        in.close();
+        std::cout << "Converted " << SLAVE_FILE << ": " << source.recordCount << " books"
+                  << (compressSlave ? " (compressed)." : ".") << std::endl;
     }
-    // Update the buyer record: new book becomes the first, increment bookCount.
-    buyer.firstBook = recNum;
-    buyer.bookCount++;
-    mfile.seekp(buyerRecNum * sizeof(Buyer));
-    mfile.write(reinterpret_cast<char*>(&buyer), sizeof(Buyer));
-    mfile.close();
-    std::cout << "Book record inserted." << std::endl;
+    return true;
 }
 
-// ===================== CALC FUNCTIONS =====================
+// ===================== SELF-CHECK =====================
+// --self-check tests the LZ codec and the B+-tree against simple models, then exits:
+//   codec    blocks of zeros, random bytes, short repeats and book records, from empty
+//            to a full BK.fl page, must come back unchanged; compressBlock never writes
+//            past its capacity, and a truncated or damaged block never decodes past
+//            its page;
+//   B+-tree  random inserts and erases, one at a time and in bulk batches, on a
+//            scratch tree (CHECK_TREE_FILE) are mirrored in a std::map; after each
+//            round the key count, a full scan, point lookups, range reads and
+//            btreeContains must agree with it, and so must the tree reopened at the end.
+// Crash recovery is checked by checks/recovery.sh, with --crash-checkpoint.
+const unsigned CHECK_SEED = 4242;
+const int CHECK_ROUNDS = 8;
+const int CHECK_ROUND_OPS = 40000;   // Single inserts and erases per round
+const int CHECK_GUARD = 64;          // Bytes past each buffer that must stay untouched
 
-// calc-m: Count valid buyer records.
-void calcMaster() {
-    std::ifstream mfile(MASTER_FILE, std::ios::binary);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+bool checkFailed(const std::string &what) {
+    std::cerr << "Self-check failed: " << what << "." << std::endl;
+    return false;
+}
+
+bool guardIntact(const std::vector<char> &buf, size_t from) {
+    for (size_t i = from; i < buf.size(); i++) {
+        if (buf[i] != (char)0xA5)
+            return false;
     }
-    int count = 0;
-    Buyer buyer;
-    while (mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer))) {
-        if (buyer.valid == 1)
-            count++;
+    return true;
+}
+
+bool checkCodec(std::mt19937 &rng) {
+    int page = RECORDS_PER_PAGE * (int)sizeof(Book);
+    for (int size : {0, 1, 3, 4, 5, 15, 16, 19, 270, 300, 4096, page}) {
+        for (int kind = 0; kind < 4; kind++) {
+            std::vector<char> src(size, 0);
+            if (kind == 1) {
+                for (char &c : src)
+                    c = (char)rng();
+            } else if (kind == 2) {
+                int period = 1 + rng() % 7;   // Matches that overlap their own output
+                for (int i = 0; i < size; i++)
+                    src[i] = (char)('a' + i % period);
+            } else if (kind == 3) {
+                for (int i = 0; (i + 1) * (int)sizeof(Book) <= size; i++) {
+                    Book bookRec;
+                    memset(&bookRec, 0, sizeof(Book));
+                    bookRec.phone = rng() % 100000;
+                    bookRec.ISBN = i + 1;
+                    copyField(bookRec.name, "Book " + std::to_string(bookRec.ISBN));
+                    copyField(bookRec.author, "Author " + std::to_string(rng() % 1000));
+                    bookRec.price = 1 + rng() % 10000 / 100.0;
+                    bookRec.nextBook = i - 1;
+                    bookRec.valid = 1;
+                    memcpy(src.data() + i * sizeof(Book), &bookRec, sizeof(Book));
+                }
+            }
+            std::string name = "codec, " + std::to_string(size) + " bytes of kind " + std::to_string(kind);
+            // Worst case of the format: every byte a literal
+            int capacity = size + size / 255 + 16;
+            std::vector<char> packed(capacity + CHECK_GUARD, (char)0xA5);
+            int length = compressBlock(src.data(), size, packed.data(), capacity);
+            if (length <= 0 || !guardIntact(packed, capacity))
+                return checkFailed(name + ": compression");
+            std::vector<char> out(size + CHECK_GUARD, (char)0xA5);
+            if (!decompressBlock(packed.data(), length, out.data(), size) || memcmp(out.data(), src.data(), size) != 0 ||
+                !guardIntact(out, size))
+                return checkFailed(name + ": round trip");
+            // One byte less than it needs: compressBlock gives up within the capacity
+            std::vector<char> tight(length - 1 + CHECK_GUARD, (char)0xA5);
+            if (compressBlock(src.data(), size, tight.data(), length - 1) != 0 || !guardIntact(tight, length - 1))
+                return checkFailed(name + ": tight capacity");
+            // A truncated block is rejected unless only the empty final token was cut
+            std::fill(out.begin(), out.end(), (char)0xA5);
+            if (length > 1 && decompressBlock(packed.data(), length - 1, out.data(), size) &&
+                memcmp(out.data(), src.data(), size) != 0)
+                return checkFailed(name + ": truncated block accepted");
+            if (!guardIntact(out, size))
+                return checkFailed(name + ": truncated block overran its page");
+            for (int i = 0; i < 16 && length > 0; i++) {
+                std::vector<char> damaged(packed.begin(), packed.begin() + length);
+                damaged[rng() % length] ^= (char)(1 + rng() % 255);
+                std::fill(out.begin(), out.end(), (char)0xA5);
+                decompressBlock(damaged.data(), length, out.data(), size);
+                if (!guardIntact(out, size))
+                    return checkFailed(name + ": damaged block overran its page");
+            }
+        }
     }
-    mfile.close();
-    std::cout << "Total valid buyer records: " << count << std::endl;
+    return true;
 }
 
-// calc-s: Count valid book records overall and display bookCount for each buyer.
-void calcSlave() {
-    std::ifstream bkfile(SLAVE_FILE, std::ios::binary);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
-        return;
+// Compare the tree with the model: key count, full scan, lookups, ranges and btreeContains.
+bool checkTreeAgainst(BTree &tree, const std::map<long long, int> &model, std::mt19937 &rng,
+                      const std::function<long long()> &randomKey) {
+    if (tree.header.keyCount != (int)model.size() || !validTreeHeader(tree, tree.header))
+        return checkFailed("B+-tree header");
+    IndexCursor cursor = btreeSeek(tree, LLONG_MIN);
+    BTreeEntry entry;
+    auto it = model.begin();
+    while (btreeNext(tree, cursor, entry)) {
+        if (it == model.end() || entry.key != it->first || entry.value != it->second)
+            return checkFailed("B+-tree scan");
+        ++it;
     }
-    int total = 0;
-    Book bookRec;
-    while (bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book))) {
-        if (bookRec.valid == 1)
-            total++;
+    if (it != model.end())
+        return checkFailed("B+-tree scan ends early");
+    for (int i = 0; i < 2000; i++) {
+        long long key = randomKey();
+        auto found = model.find(key);
+        if (btreeFind(tree, key) != (found == model.end() ? -1 : found->second))
+            return checkFailed("B+-tree lookup");
     }
-    bkfile.close();
-    std::cout << "Total valid book records: " << total << std::endl;
-    
-    std::cout << "Book counts for each buyer (from master records):" << std::endl;
-    std::ifstream mfile(MASTER_FILE, std::ios::binary);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+    for (int i = 0; i < 200; i++) {
+        long long low = randomKey();
+        long long high = low + (long long)(rng() % 4) * (rng() % 100000);
+        size_t limit = i % 2 == 0 ? (size_t)-1 : 1 + rng() % 500;
+        std::vector<BTreeEntry> entries;
+        if (!btreeRange(tree, low, high, limit, entries))
+            return checkFailed("B+-tree range read");
+        auto from = model.lower_bound(low);
+        for (const BTreeEntry &e : entries) {
+            if (from == model.end() || from->first > high || e.key != from->first || e.value != from->second)
+                return checkFailed("B+-tree range");
+            ++from;
+        }
+        if (entries.size() < limit && from != model.end() && from->first <= high)
+            return checkFailed("B+-tree range ends early");
     }
-    Buyer buyer;
-    while (mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer))) {
-        if (buyer.valid == 1) {
-            std::cout << "Phone " << buyer.phone << ": " << buyer.bookCount << " books." << std::endl;
+    // A small batch is probed key by key, a large one merged with the leaves
+    for (size_t count : {(size_t)16, model.size() / BULK_REBUILD_DIVISOR + 1}) {
+        std::vector<long long> keys;
+        for (size_t i = 0; i < count; i++) {
+            long long key = randomKey();
+            auto present = model.lower_bound(key);
+            keys.push_back(i % 2 == 0 || present == model.end() ? key : present->first);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<bool> found = btreeContains(tree, keys);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (found[i] != (model.count(keys[i]) > 0))
+                return checkFailed("B+-tree contains");
         }
     }
-    mfile.close();
+    return true;
 }
 
-// ===================== UTILITY FUNCTIONS =====================
-
-// ut-m: Print all master records (including service fields), index table and master garbage list.
-void utMaster() {
-    std::ifstream mfile(MASTER_FILE, std::ios::binary);
-    if (!mfile) {
-        std::cerr << "Error opening master file." << std::endl;
-        return;
+bool checkTree(std::mt19937 &rng) {
+    BTree tree;
+    unlink(CHECK_TREE_FILE);
+    if (openTree(tree, CHECK_TREE_FILE) != 0 || !btreeBuild(tree, std::vector<BTreeEntry>()))
+        return checkFailed("B+-tree scratch file");
+    std::map<long long, int> model;
+    // Both halves of the composite keys take negative values too
+    auto randomKey = [&]() { return compositeKey((int)(rng() % 256) - 128, (int)(rng() % 8192) - 4096); };
+    bool ok = true;
+    for (int round = 0; ok && round < CHECK_ROUNDS; round++) {
+        for (int i = 0; ok && i < CHECK_ROUND_OPS; i++) {
+            long long key = randomKey();
+            if (rng() % 4 != 0) {
+                int value = rng() % INT_MAX;
+                bool inserted = btreeInsert(tree, key, value);
+                if (inserted != (model.count(key) == 0))
+                    ok = checkFailed("B+-tree insert");
+                else if (inserted)
+                    model[key] = value;
+            } else {
+                // Half of the erases hit a key that is present
+                auto it = model.lower_bound(key);
+                if (rng() % 2 == 0 && it != model.end())
+                    key = it->first;
+                bool erased = btreeErase(tree, key);
+                if (erased != (model.erase(key) > 0))
+                    ok = checkFailed("B+-tree erase");
+            }
+        }
+        // A bulk batch of new keys and one of present keys, rebuilt bottom-up when large
+        std::vector<BTreeEntry> added;
+        std::vector<long long> removed;
+        size_t batch = round % 2 == 0 ? 32 : model.size() / 4 + 1;
+        for (size_t i = 0; i < batch; i++) {
+            long long key = randomKey();
+            if (model.count(key) == 0)
+                added.push_back(BTreeEntry{key, (int)(rng() % INT_MAX)});
+        }
+        sortEntries(added);
+        added.erase(std::unique(added.begin(), added.end(),
+                                [](const BTreeEntry &a, const BTreeEntry &b) { return a.key == b.key; }), added.end());
+        size_t step = 2 + rng() % 8;
+        size_t n = 0;
+        for (auto &kv : model) {
+            if (n++ % step == 0 && removed.size() < batch)
+                removed.push_back(kv.first);
+        }
+        ok = ok && (btreeBulkInsert(tree, added) || checkFailed("B+-tree bulk insert"));
+        for (const BTreeEntry &e : added)
+            model[e.key] = e.value;
+        ok = ok && (btreeBulkErase(tree, removed) || checkFailed("B+-tree bulk erase"));
+        for (long long key : removed)
+            model.erase(key);
+        ok = ok && checkTreeAgainst(tree, model, rng, randomKey);
     }
-    std::cout << "\n--- Master File Contents ---\n";
-    int recNum = 0;
-    Buyer buyer;
-    while (mfile.read(reinterpret_cast<char*>(&buyer), sizeof(Buyer))) {
-        std::cout << "Record " << recNum << ":\n";
-        std::cout << "  Phone: " << buyer.phone << std::endl;
-        std::cout << "  Name: " << buyer.name << std::endl;
-        std::cout << "  Address: " << buyer.address << std::endl;
-        std::cout << "  First Book Index: " << buyer.firstBook << std::endl;
-        std::cout << "  Book Count: " << buyer.bookCount << std::endl;
-        std::cout << "  Valid: " << buyer.valid << std::endl;
-        recNum++;
-    }
-    mfile.close();
-    std::cout << "--- End of Master File ---\n";
-    std::cout << "Index Table:\n";
-    for (auto &ir : indexTable)
-        std::cout << "  Phone: " << ir.phone << ", Record Number: " << ir.recordNumber << std::endl;
-    std::cout << "Master Garbage List: ";
-    for (auto &g : masterGarbage)
-        std::cout << g << " ";
-    std::cout << "\n";
+    if (ok && tree.header.height < 3)
+        ok = checkFailed("B+-tree too small to have inner levels");
+    // The tree as read back from its file
+    closeTree(tree);
+    if (ok && openTree(tree, CHECK_TREE_FILE) != BTREE_MAGIC)
+        ok = checkFailed("B+-tree reopen");
+    ok = ok && checkTreeAgainst(tree, model, rng, randomKey);
+    closeRecordFile(tree.file);
+    unlink(CHECK_TREE_FILE);
+    if (ok)
+        std::cout << "B+-tree: " << model.size() << " keys, height " << tree.header.height << "." << std::endl;
+    return ok;
 }
 
-// ut-s: Print all slave records (including service fields) and slave garbage list.
-void utSlave() {
-    std::ifstream bkfile(SLAVE_FILE, std::ios::binary);
-    if (!bkfile) {
-        std::cerr << "Error opening slave file." << std::endl;
-        return;
-    }
-    std::cout << "\n--- Slave File Contents ---\n";
-    int recNum = 0;
-    Book bookRec;
-    while (bkfile.read(reinterpret_cast<char*>(&bookRec), sizeof(Book))) {
-        std::cout << "Record " << recNum << ":\n";
-        std::cout << "  Phone: " << bookRec.phone << std::endl;
-        std::cout << "  ISBN: " << bookRec.ISBN << std::endl;
-        std::cout << "  Name: " << bookRec.name << std::endl;
-        std::cout << "  Author: " << bookRec.author << std::endl;
-        std::cout << "  Price: " << bookRec.price << std::endl;
-        std::cout << "  Next Book Index: " << bookRec.nextBook << std::endl;
-        std::cout << "  Valid: " << bookRec.valid << std::endl;
-        recNum++;
-    }
-    bkfile.close();
-    std::cout << "--- End of Slave File ---\n";
-    std::cout << "Slave Garbage List: ";
-    for (auto &g : slaveGarbage)
-        std::cout << g << " ";
-    std::cout << "\n";
+bool runSelfCheck() {
+    std::mt19937 rng(CHECK_SEED);
+    if (!checkCodec(rng))
+        return false;
+    std::cout << "Codec: ok." << std::endl;
+    if (!checkTree(rng))
+        return false;
+    std::cout << "Self-check passed." << std::endl;
+    return true;
 }
 
 // ===================== MAIN FUNCTION =====================
-int main() {
-    // Load index table and garbage zones from files (if they exist)
-    loadIndexTable();
-    loadMasterGarbage();
-    loadSlaveGarbage();
+int main(int argc, char* argv[]) {
+    // --mmap selects the memory-mapped storage mode instead of the buffer pool,
+    // --batch <file> runs a script instead of the interactive prompt,
+    // --bench <threads> runs the throughput benchmark on the current files,
+    // --pool-frames <n> sets the number of page frames per file (default POOL_FRAMES),
+    // --extents places each buyer's books in extents of consecutive records,
+    // --scan-threads <n> sets the workers of full scans and index rebuilds (default one per core),
+    // --cache-mb <n> sets the record cache size (default RECORD_CACHE_MB, 0 disables it),
+    // --workload <get>,<insert>,<update>,<delete>[,<scan>] makes --bench replay that mix instead (see BENCHMARK),
+    // --generate <buyers> <books per buyer> <uniform|zipf> fills empty files with a synthetic dataset,
+    // --io-threads <n> sets the threads that prefetch pages into the pool (default IO_THREADS, 0: none),
+    // --stats-interval <s> appends the stats to B.stats every s seconds (see STATISTICS),
+    // --compress stores a new BK.fl as compressed blocks (with --convert: compresses an existing one),
+    // --convert migrates the files of an older version to the current format and exits,
+    // --self-check tests the LZ codec and the B+-tree and exits (see SELF-CHECK),
+    // --crash-checkpoint <n> <log|pages> stops the process in a checkpoint (crash tests, see WRITE-AHEAD LOG),
+    // --shards <n> partitions the files over n shard processes behind this one, in <dir>/shard<i>
+    //   with the directories of --shard-dirs <dir>,<dir>,... in turn (see SHARDING)
+    std::string batchFile;
+    int benchThreads = 0;
+    bool convert = false;
+    bool selfCheck = false;
+    int crashAt = 0;
+    Workload workload = {0, 0, 0, 0, 0};
+    bool useWorkload = false;
+    int generateBuyers = 0, generateBooks = 0;
+    bool generateZipf = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--mmap")
+            useMmap = true;
+        else if (arg == "--batch" && i + 1 < argc)
+            batchFile = argv[++i];
+        else if (arg == "--bench" && i + 1 < argc)
+            benchThreads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--pool-frames" && i + 1 < argc)
+            poolFrames = std::max(1, atoi(argv[++i]));
+        else if (arg == "--extents")
+            useExtents = true;
+        else if (arg == "--scan-threads" && i + 1 < argc)
+            scanThreads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--cache-mb" && i + 1 < argc)
+            cacheCapacity = (size_t)std::max(0, atoi(argv[++i])) << 20;
+        else if (arg == "--io-threads" && i + 1 < argc)
+            ioThreadCount = std::max(0, atoi(argv[++i]));
+        else if (arg == "--workload" && i + 1 < argc) {
+            std::vector<std::string> f = splitFields(argv[++i]);
+            useWorkload = (f.size() == 4 || f.size() == 5) && parseInt(f[0], workload.get) &&
+                          parseInt(f[1], workload.insert) && parseInt(f[2], workload.update) &&
+                          parseInt(f[3], workload.del) && (f.size() == 4 || parseInt(f[4], workload.scan)) &&
+                          workload.get >= 0 && workload.insert >= 0 && workload.update >= 0 && workload.del >= 0 &&
+                          workload.scan >= 0 &&
+                          workload.get + workload.insert + workload.update + workload.del + workload.scan == 100;
+            if (!useWorkload) {
+                std::cerr << "--workload takes four or five percentages adding up to 100." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--generate" && i + 3 < argc) {
+            generateBuyers = std::max(0, atoi(argv[++i]));
+            generateBooks = std::max(0, atoi(argv[++i]));
+            std::string distribution = argv[++i];
+            generateZipf = distribution == "zipf";
+            if (!generateZipf && distribution != "uniform") {
+                std::cerr << "--generate takes uniform or zipf." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--stats-interval" && i + 1 < argc)
+            statsInterval = std::max(0, atoi(argv[++i]));
+        else if (arg == "--compress")
+            compressSlave = true;
+        else if (arg == "--convert")
+            convert = true;
+        else if (arg == "--self-check")
+            selfCheck = true;
+        else if (arg == "--crash-checkpoint" && i + 2 < argc) {
+            crashAt = std::max(0, atoi(argv[++i]));
+            std::string stage = argv[++i];
+            crashWhileLogging = stage == "log";
+            if (!crashWhileLogging && stage != "pages") {
+                std::cerr << "--crash-checkpoint takes log or pages." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--shards" && i + 1 < argc)
+            shardCount = std::max(1, atoi(argv[++i]));
+        else if (arg == "--shard-dirs" && i + 1 < argc)
+            shardDirs = splitFields(argv[++i]);
+    }
+    if (shardCount > 0 && (convert || benchThreads > 0)) {
+        std::cerr << "--convert and --bench work on one set of files; run them in each shard directory." << std::endl;
+        return 1;
+    }
+    if (shardCount == 0 && access(SHARDS_FILE, F_OK) == 0) {
+        std::cerr << "The files are sharded (see " << SHARDS_FILE << "); run with --shards." << std::endl;
+        return 1;
+    }
+    if (selfCheck)
+        return runSelfCheck() ? 0 : 1;
+    if (convert)
+        return convertFiles() ? 0 : 1;
+    if (shardCount > 0) {
+        if (!startShards())
+            return 1;
+        if (shardIndex < 0)
+            return runRouter(batchFile, batchFile.empty() && generateBuyers == 0) ? 0 : 1;
+    }
+    {
+        // Startup: recovery, then the files, garbage zones and indexes
+        OpTimer timer(STAT_LOAD);
+        // Repair the files from the log of an interrupted run before anything is opened
+        std::vector<WalOp> replay;
+        if (!recoverFiles(replay)) {
+            std::cerr << "Error recovering from log file." << std::endl;
+            return 1;
+        }
+        // Open the data files once; all records go through the buffer pool (or the mapping)
+        if (!openRecordFile(masterFile, MASTER_FILE, sizeof(Buyer))) {
+            std::cerr << "Error opening master file." << std::endl;
+            return 1;
+        }
+        if (!openRecordFile(slaveFile, SLAVE_FILE, sizeof(Book), RECORDS_PER_PAGE, true, true, SLAVE_DIRECTORY_FILE)) {
+            std::cerr << "Error opening slave file." << std::endl;
+            return 1;
+        }
+        if (!applyRecoveredPages()) {
+            std::cerr << "Error recovering from log file." << std::endl;
+            return 1;
+        }
+        // Load the garbage zones and indexes from files (if they exist), rebuilding the
+        // ones that do not match the stamp of the last checkpoint. The garbage comes
+        // first: rebuilding BK.ind may free duplicate books.
+        CheckpointStamp stamp;
+        const CheckpointStamp* lastStamp = readStamp(stamp) ? &stamp : nullptr;
+        if (lastStamp)
+            checkpointGeneration = stamp.generation;
+        if (!loadGarbage(masterGarbage, MASTER_GARBAGE_LIST, masterFile.recordCount) ||
+            !loadGarbage(slaveGarbage, SLAVE_GARBAGE_LIST, slaveFile.recordCount)) {
+            std::cerr << "Error loading garbage files." << std::endl;
+            return 1;
+        }
+        if (garbageStale(masterGarbage, lastStamp, 0)) {
+            std::cerr << MASTER_GARBAGE_FILE << " does not match the last checkpoint; rebuilding it." << std::endl;
+            if (!rebuildGarbage<Buyer>(masterFile, masterGarbage, [](const Buyer &rec) { return rec.valid == 0; })) {
+                std::cerr << "Error rebuilding " << MASTER_GARBAGE_FILE << "." << std::endl;
+                return 1;
+            }
+        }
+        if (garbageStale(slaveGarbage, lastStamp, 1)) {
+            std::cerr << SLAVE_GARBAGE_FILE << " does not match the last checkpoint; rebuilding it." << std::endl;
+            // The unused records of an extent are deleted but not free
+            if (!rebuildGarbage<Book>(slaveFile, slaveGarbage, [](const Book &rec) {
+                    return rec.valid == 0 && rec.nextBook != EXTENT_RESERVED;
+                })) {
+                std::cerr << "Error rebuilding " << SLAVE_GARBAGE_FILE << "." << std::endl;
+                return 1;
+            }
+        }
+        loadIndexTable(lastStamp);
+        loadBookIndexes(lastStamp);
+        startIoThreads();
+        if (!walOpen()) {
+            std::cerr << "Error opening log file." << std::endl;
+            return 1;
+        }
+        replayLog(replay);
+        checkpoint();
+        crashCheckpoint = crashAt;
+    }
+    startStatsDump();
     
     std::string command;
-    do {
-        std::cout << "\nEnter command (get-m, get-s, del-m, del-s, update-m, update-s, insert-m, insert-s, calc-m, calc-s, ut-m, ut-s, exit): ";
+    int exitStatus = 0;
+    if (generateBuyers > 0) {
+        if (!generateDataset(generateBuyers, generateBooks, generateZipf))
+            exitStatus = 1;
+        command = "exit";
+    }
+    if (shardIndex >= 0) {
+        serveRouter();
+        command = "exit";
+    } else if (!batchFile.empty()) {
+        if (!runBatch(batchFile))
+            std::cerr << "Error opening batch file." << std::endl;
+        command = "exit";
+    }
+    if (benchThreads > 0 && useWorkload) {
+        runWorkload(benchThreads, workload);
+        command = "exit";
+    } else if (benchThreads > 0) {
+        runBenchmark(benchThreads);
+        command = "exit";
+    }
+    while (command != "exit") {
+        std::cout << "\nEnter command (get-m, get-s, del-m, del-s, update-m, update-s, del-m-range, del-s-where, update-s-where, insert-m, insert-s, calc-m, calc-s, ut-m, ut-s, get-isbn, range-m, books-m, range-price, join, pool-stats, stats, stats-json, vacuum, exit): ";
         std::cin >> command;
         if (command == "get-m")      getMaster();
         else if (command == "get-s") getSlave();
+        else if (command == "get-isbn") getIsbnOwners();
+        else if (command == "range-m") rangeMaster();
+        else if (command == "books-m") buyerBooks();
+        else if (command == "range-price") rangePrice();
+        else if (command == "join")     joinBuyersBooks();
         else if (command == "del-m") delMaster();
         else if (command == "del-s") delSlave();
         else if (command == "update-m") updateMaster();
         else if (command == "update-s") updateSlave();
+        else if (command == "del-m-range") delMasterRange();
+        else if (command == "del-s-where") delSlaveWhere();
+        else if (command == "update-s-where") updateSlaveWhere();
         else if (command == "insert-m") insertMaster();
         else if (command == "insert-s") insertSlave();
         else if (command == "calc-m")   calcMaster();
         else if (command == "calc-s")   calcSlave();
         else if (command == "ut-m")     utMaster();
         else if (command == "ut-s")     utSlave();
+        else if (command == "pool-stats") poolStats();
+        else if (command == "stats")    printStats(std::cout);
+        else if (command == "stats-json") {
+            printStatsJson(std::cout);
+            std::cout << std::endl;
+        }
+        else if (command == "vacuum")   vacuum();
         else if (command == "exit") break;
         else std::cout << "Unknown command." << std::endl;
-    } while(command != "exit");
+        checkpointIfNeeded();
+    }
     
-    // Before exiting, save index table and garbage zones to files
-    saveIndexTable();
-    saveMasterGarbage();
-    saveSlaveGarbage();
+    // Before exiting, let vacuum finish, write everything to the files and close them
+    if (vacuumThread.joinable())
+        vacuumThread.join();
+    stopIoThreads();
+    {
+        OpTimer timer(STAT_SAVE);
+        checkpoint();
+        saveIndexTable();
+        closeRecordFile(masterFile);
+        closeRecordFile(slaveFile);
+    }
+    stopStatsDump();
     
-    return 0;
+    return exitStatus;
 }
\ No newline at end of file